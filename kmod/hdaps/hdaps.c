@@ -44,8 +44,17 @@
 #include <sys/bus.h>
 #include <sys/module.h>
 #include <sys/systm.h>
+#include <sys/time.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+
+#include <machine/atomic.h>
+#include <machine/cpu.h>
 
 #include <sys/sysctl.h>
+#include <sys/eventhandler.h>
+#include <sys/taskqueue.h>
+#include <sys/sdt.h>
 
 #include <sys/conf.h>
 
@@ -55,6 +64,9 @@
 #include "hdaps_dev.h"
 //#include "hdaps_mousedev.h"
 #include "hdaps_joydev.h"
+#include "hdaps_shock.h"
+#include "hdaps_filter.h"
+#include "hdaps_ring.h"
 
 #define DEVICE_NAME	"hdaps"
 
@@ -79,11 +91,26 @@ static const struct thinkpad_ec_row ec_accel_args =
 #define MOUSE_MASK		0x40	/* set if mouse activity */
 
 #define READ_TIMEOUT_MSECS	100	/* wait this long for device read */
-#define RETRY_MSECS		3	/* retry delay */
+#define RETRY_MSECS		3	/* longest retry delay */
+#define RETRY_MIN_USECS		250	/* first retry delay, doubles up */
 
 #define KMACT_REMEMBER_PERIOD   (hz/10) /* keyboard/mouse persistance */
 
-struct callout hdaps_co;
+/* DTrace probes: every readout parsed, with its status (0 or a negative
+ * errno), the position and the raw row; and every poll tick, and the ones
+ * that got no sample, with the status and whether the EC lock was had.
+ */
+SDT_PROVIDER_DEFINE(hdaps);
+SDT_PROBE_DEFINE4(hdaps, , update, parse, "int", "int", "int",
+    "struct thinkpad_ec_row *");
+SDT_PROBE_DEFINE0(hdaps, , poll, fire);
+SDT_PROBE_DEFINE2(hdaps, , poll, skip, "int", "int");
+
+static struct callout hdaps_co;
+static struct mtx hdaps_co_mtx;	/* the sampler runs under it */
+MTX_SYSINIT(hdaps_co, &hdaps_co_mtx, "hdaps sampler", MTX_DEF);
+static struct task hdaps_reinit_task;
+static eventhandler_tag hdaps_reset_tag;
 
 static devclass_t hdaps_devclass;
 
@@ -91,24 +118,71 @@ static devclass_t hdaps_devclass;
 SYSCTL_NODE(_hw, OID_AUTO, hdaps, CTLFLAG_RD, NULL, "Hard Disk Active Protection System"); 
 
 static unsigned int hdaps_invert;
-static int needs_calibration = 0;
+static volatile u_int needs_calibration = 0; /* see hdaps_calib_sample() */
 
 /* Configuration: */
 static int sampling_rate = 50;       /* Sampling rate  */
+static int hdaps_rate = 50;          /* Rate the sampler and the EC run at
+                                      * now, see hdaps_adapt() */
+static int sampling_precision_us = 200; /* How late a poll may fire to
+                                         * be batched with other timers */
 static int oversampling_ratio = 5;   /* Ratio between our sampling rate and 
                                       * EC accelerometer sampling rate      */
 static int running_avg_filter_order = 2; /* EC running average filter order */
 static int fake_data_mode = 0;       /* Enable EC fake data mode? */
+static int hdaps_debug = 0;          /* Log EC config changes? */
+
+/* The last EC setup hdaps_device_init() got through, for resume */
+static struct {
+	int valid;
+	int ec_rate, order, fake;
+} hdaps_ec_good;
+
+/* Note a config the EC took, so resume can restore it. Resume goes back
+ * to sampling_rate, so a rate taken while idle only counts for the
+ * filter order. EC lock held.
+ */
+static void hdaps_ec_good_note(int ec_rate, int order)
+{
+	if (ec_rate == sampling_rate*oversampling_ratio)
+		hdaps_ec_good.ec_rate = ec_rate;
+	hdaps_ec_good.order = order;
+}
 
-/* Latest state readout: */
-int pos_x, pos_y;      /* position */
-static int temperature;       /* temperature */
+/* Latest state readout, see hdaps_get_state(): */
+static struct hdaps_state hdaps_st = {
+	.keyboard_ticks = -300000,
+	.mouse_ticks = -300000,
+};
+static volatile u_int hdaps_st_gen; /* odd while hdaps_st is written */
 static int stale_readout = 1; /* last read invalid */
-int rest_x, rest_y;    /* calibrated rest position */
+static int have_readout;      /* any valid readout so far */
+
+/* Everything of a 0x11 row the sampler uses */
+#define HDAPS_ROW_MASK \
+	((1 << EC_ACCEL_IDX_READOUTS) | (1 << EC_ACCEL_IDX_KMACT) | \
+	 (3 << EC_ACCEL_IDX_YPOS1)    | (3 << EC_ACCEL_IDX_XPOS1) | \
+	 (1 << EC_ACCEL_IDX_TEMP1)    | (3 << EC_ACCEL_IDX_XPOS2) | \
+	 (3 << EC_ACCEL_IDX_YPOS2)    | (1 << EC_ACCEL_IDX_TEMP2) | \
+	 (1 << EC_ACCEL_IDX_QUEUED)   | (1 << EC_ACCEL_IDX_RETVAL))
+
+/* Queue draining: with oversampling the EC queues readouts between two
+ * polls. After its row, the sampler reads up to drain_budget more rows
+ * while QUEUED says there are readouts left, so every readout reaches the
+ * sample ring.
+ */
+static int hdaps_drain_budget = 4;	/* extra rows per poll, 0 disables */
+static uint64_t hdaps_drained;		/* rows read while draining */
+static uint64_t hdaps_ec_queue_overruns; /* readouts left after the budget */
 
-/* Last time we saw keyboard and mouse activity: */
-static u_long last_keyboard_ticks = -300000;
-static u_long last_mouse_ticks = -300000;
+SYSCTL_INT(_hw_hdaps, OID_AUTO, drain_budget, CTLFLAG_RW, &hdaps_drain_budget, 0, "extra EC rows per poll to drain queued readouts, 0 disables");
+SYSCTL_UQUAD(_hw_hdaps, OID_AUTO, drained, CTLFLAG_RD, &hdaps_drained, 0, "EC rows read to drain queued readouts");
+SYSCTL_UQUAD(_hw_hdaps, OID_AUTO, ec_queue_overruns, CTLFLAG_RD, &hdaps_ec_queue_overruns, 0, "polls that left readouts queued in the EC");
+
+static int hdaps_want_drain(const struct thinkpad_ec_row *data)
+{
+	return hdaps_drain_budget > 0 && data->val[EC_ACCEL_IDX_QUEUED] > 0;
+}
 
 /* Some models require an axis transformation to the standard reprsentation */
 static void transform_axes(int *x, int *y)
@@ -119,66 +193,327 @@ static void transform_axes(int *x, int *y)
         }
 }
 
+/* hdaps_st is a sequence-locked snapshot. Its writers (the sampler,
+ * calibration, and attach loading a saved rest position) are serialized by
+ * hdaps_st_mtx, not by the EC client lock, and make hdaps_st_gen odd
+ * while they change it; readers take no lock and retry until they copied
+ * it with the same even count before and after.
+ */
+static struct mtx hdaps_st_mtx;
+MTX_SYSINIT(hdaps_st, &hdaps_st_mtx, "hdaps state", MTX_DEF);
+
+static void hdaps_state_write_begin(void)
+{
+	mtx_lock(&hdaps_st_mtx);
+	atomic_store_rel_int(&hdaps_st_gen, hdaps_st_gen + 1);
+	atomic_thread_fence_rel();
+}
+
+static void hdaps_state_write_end(void)
+{
+	atomic_store_rel_int(&hdaps_st_gen, hdaps_st_gen + 1);
+	mtx_unlock(&hdaps_st_mtx);
+}
+
+static void hdaps_set_rest(int x, int y)
+{
+	hdaps_state_write_begin();
+	hdaps_st.rest_x = x;
+	hdaps_st.rest_y = y;
+	hdaps_state_write_end();
+}
+
+/**
+ * hdaps_get_state - get a consistent copy of the latest state
+ * @st: filled in
+ *
+ * Never blocks and never touches the EC; the values are as recent as
+ * the last readout (@st->time, 0 if none yet).
+ */
+void hdaps_get_state(struct hdaps_state *st)
+{
+	u_int gen;
+
+	for (;;) {
+		gen = atomic_load_acq_int(&hdaps_st_gen);
+		if (!(gen & 1)) {	/* else being written */
+			*st = hdaps_st;
+			atomic_thread_fence_acq();
+			if (hdaps_st_gen == gen)
+				return;
+		}
+		cpu_spinwait();
+	}
+}
+
+/* How old the latest readout may be while the sampler is running */
+static sbintime_t hdaps_max_age(void)
+{
+	return 3 * SBT_1S / hdaps_rate;
+}
+
+/* Calibration: once asked for (needs_calibration), the sampler collects
+ * calib.samples readouts, drops those further than calib.reject from the
+ * per-axis median, and takes the mean of the rest as the rest position.
+ * If more than half were dropped, the machine was moving: start over.
+ *
+ * Afterwards, slow drift (temperature, how the machine sits) is tracked
+ * while it is quiet, i.e. within calib.drift_band of the rest position
+ * with no keyboard or mouse activity: each such readout moves the rest
+ * position 1/2^calib.drift_shift of the way towards it.
+ *
+ * All sampler only, but for needs_calibration.
+ */
+#define HDAPS_CALIB_MAX		128
+
+static int calib_samples = 32;
+static int calib_reject = 8;
+static int calib_drift_band = 6;
+static int calib_drift_shift = 12;	/* 0 disables drift tracking */
+static uint64_t calib_done;
+static uint64_t calib_retries;
+static uint64_t calib_drift_moves;	/* rest position changes by drift */
+
+static int calib_buf[2][HDAPS_CALIB_MAX];
+static int calib_n;
+static int64_t drift_x, drift_y;	/* rest position, Q16 */
+static int drift_valid;
+
+static int hdaps_calib_samples_sysctlproc(SYSCTL_HANDLER_ARGS)
+{
+	int error, n = calib_samples;
+
+	error = sysctl_handle_int(oidp, &n, 0, req);
+	if (error || !req->newptr)
+		return error;
+	if (n < 1 || n > HDAPS_CALIB_MAX)
+		return EINVAL;
+	calib_samples = n;
+	return 0;
+}
+
+SYSCTL_NODE(_hw_hdaps, OID_AUTO, calib, CTLFLAG_RD, NULL, "rest position calibration");
+SYSCTL_PROC(_hw_hdaps_calib, OID_AUTO, samples, CTLTYPE_INT|CTLFLAG_RW, NULL, 0, hdaps_calib_samples_sysctlproc, "I", "readouts averaged per calibration");
+SYSCTL_INT(_hw_hdaps_calib, OID_AUTO, reject, CTLFLAG_RW, &calib_reject, 0, "largest distance from the median of a readout kept");
+SYSCTL_INT(_hw_hdaps_calib, OID_AUTO, drift_band, CTLFLAG_RW, &calib_drift_band, 0, "largest distance from rest of a readout used to track drift");
+SYSCTL_INT(_hw_hdaps_calib, OID_AUTO, drift_shift, CTLFLAG_RW, &calib_drift_shift, 0, "drift tracking time constant, log2 readouts; 0 disables");
+SYSCTL_UQUAD(_hw_hdaps_calib, OID_AUTO, done, CTLFLAG_RD, &calib_done, 0, "calibrations completed");
+SYSCTL_UQUAD(_hw_hdaps_calib, OID_AUTO, retries, CTLFLAG_RD, &calib_retries, 0, "calibrations restarted because of motion");
+SYSCTL_UQUAD(_hw_hdaps_calib, OID_AUTO, drift_moves, CTLFLAG_RD, &calib_drift_moves, 0, "rest position changes from drift tracking");
+
+static int hdaps_calib_median(const int *v, int n)
+{
+	int sorted[HDAPS_CALIB_MAX];
+	int i, j, t;
+
+	for (i = 0; i < n; i++) {
+		t = v[i];
+		for (j = i; j > 0 && sorted[j - 1] > t; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = t;
+	}
+	return sorted[n / 2];
+}
+
+/* A calibration window is full: set the rest position, or start over */
+static void hdaps_calib_finish(void)
+{
+	int mx, my, i, kept = 0;
+	int64_t sx = 0, sy = 0;
+
+	mx = hdaps_calib_median(calib_buf[0], calib_n);
+	my = hdaps_calib_median(calib_buf[1], calib_n);
+	for (i = 0; i < calib_n; i++) {
+		if (abs(calib_buf[0][i] - mx) > calib_reject ||
+		    abs(calib_buf[1][i] - my) > calib_reject)
+			continue;
+		sx += calib_buf[0][i];
+		sy += calib_buf[1][i];
+		kept++;
+	}
+	if (kept * 2 < calib_n) {
+		calib_retries++;
+		calib_n = 0;
+		return;
+	}
+
+	/* round to nearest */
+	sx = sx >= 0 ? (sx + kept / 2) / kept : (sx - kept / 2) / kept;
+	sy = sy >= 0 ? (sy + kept / 2) / kept : (sy - kept / 2) / kept;
+	hdaps_set_rest(sx, sy);
+	drift_x = sx * 65536;
+	drift_y = sy * 65536;
+	drift_valid = 1;
+	calib_n = 0;
+	calib_done++;
+	atomic_store_rel_int(&needs_calibration, 0);
+}
+
+static void hdaps_calib_drift(int x, int y, int act,
+			      const struct hdaps_state *st)
+{
+	int rx, ry;
+
+	if (calib_drift_shift <= 0 || calib_drift_shift > 30 || act ||
+	    abs(x - st->rest_x) > calib_drift_band ||
+	    abs(y - st->rest_y) > calib_drift_band)
+		return;
+
+	if (!drift_valid ||
+	    (drift_x + (1 << 15)) >> 16 != st->rest_x ||
+	    (drift_y + (1 << 15)) >> 16 != st->rest_y) {
+		/* rest position was set elsewhere */
+		drift_x = (int64_t)st->rest_x * 65536;
+		drift_y = (int64_t)st->rest_y * 65536;
+		drift_valid = 1;
+	}
+	drift_x += ((int64_t)x * 65536 - drift_x) >> calib_drift_shift;
+	drift_y += ((int64_t)y * 65536 - drift_y) >> calib_drift_shift;
+	rx = (drift_x + (1 << 15)) >> 16;
+	ry = (drift_y + (1 << 15)) >> 16;
+	if (rx != st->rest_x || ry != st->rest_y) {
+		hdaps_set_rest(rx, ry);
+		calib_drift_moves++;
+	}
+}
+
+/* Feed a raw readout to calibration and drift tracking. Sampler only. */
+static void hdaps_calib_sample(int x, int y, int act,
+			       const struct hdaps_state *st)
+{
+	if (!atomic_load_acq_int(&needs_calibration)) {
+		calib_n = 0;
+		hdaps_calib_drift(x, y, act, st);
+		return;
+	}
+	if (calib_n >= calib_samples)
+		calib_n = 0;	/* window shrunk meanwhile */
+	calib_buf[0][calib_n] = x;
+	calib_buf[1][calib_n] = y;
+	if (++calib_n >= calib_samples)
+		hdaps_calib_finish();
+}
+
 /**
  * __hdaps_update - query current state, with locks already acquired
  * @fast: if nonzero, do one quick attempt without retries.
+ * @data: the row read, for the caller to publish
+ * @taken: when the EC was read, which for a prefetched row is earlier
  *
  * Query current accelerometer state and update global state variables.
- * Also prefetches the next query. Caller must hold controller lock.
+ * Also prefetches the next query, unless the EC has more readouts queued
+ * that the sampler will drain first (see hdaps_drain_start()).
+ * Caller must hold controller lock.
  */
-static int __hdaps_update(int fast)
+static int __hdaps_update(int fast, struct thinkpad_ec_row *data,
+			  sbintime_t *taken)
 {
-	/* Read data: */
-	struct thinkpad_ec_row data;
-	int ret;
-
-	data.mask = (1 << EC_ACCEL_IDX_READOUTS) | (1 << EC_ACCEL_IDX_KMACT) |
-	            (3 << EC_ACCEL_IDX_YPOS1)    | (3 << EC_ACCEL_IDX_XPOS1) |
-	            (1 << EC_ACCEL_IDX_TEMP1)    | (1 << EC_ACCEL_IDX_RETVAL);
-	if (fast)
-		ret = thinkpad_ec_try_read_row(&ec_accel_args, &data);
-	else
-		ret = thinkpad_ec_read_row(&ec_accel_args, &data);
+	int ret, x, y;
+
+	data->mask = HDAPS_ROW_MASK;
+	if (fast) {
+		ret = thinkpad_ec_try_read_row_time(&ec_accel_args, data,
+		    taken);
+	} else {
+		ret = thinkpad_ec_read_row(&ec_accel_args, data);
+		*taken = sbinuptime();
+	}
 
-	thinkpad_ec_prefetch_row(&ec_accel_args); /* Prefetch even if error */
 	if (ret)
-		return ret;
+		goto out;
 
 	/* Check status: */
-	if (data.val[EC_ACCEL_IDX_RETVAL] != 0x00) {
+	if (data->val[EC_ACCEL_IDX_RETVAL] != 0x00) {
 		printf("hdaps: read RETVAL=0x%02x\n",
-		       data.val[EC_ACCEL_IDX_RETVAL]);
-		return -EIO;
+		       data->val[EC_ACCEL_IDX_RETVAL]);
+		ret = -EIO;
+		goto out;
 	}
 
-	if (data.val[EC_ACCEL_IDX_READOUTS] < 1)
-		return -EBUSY; /* no pending readout, try again later */
+	if (data->val[EC_ACCEL_IDX_READOUTS] < 1) {
+		ret = -EBUSY; /* no pending readout, try again later */
+		goto out;
+	}
 
 	/* Parse position data: */
-	pos_x = *(short*)(data.val+EC_ACCEL_IDX_XPOS1);
-	pos_y = *(short*)(data.val+EC_ACCEL_IDX_YPOS1);
-	transform_axes(&pos_x, &pos_y);
-
+	x = *(short*)(data->val+EC_ACCEL_IDX_XPOS1);
+	y = *(short*)(data->val+EC_ACCEL_IDX_YPOS1);
+	transform_axes(&x, &y);
+
+	hdaps_state_write_begin();
+	hdaps_st.seq++;
+	hdaps_st.time = *taken;
+	hdaps_st.x = x;
+	hdaps_st.y = y;
+	hdaps_st.temp = data->val[EC_ACCEL_IDX_TEMP1];
+	hdaps_st.kmact = data->val[EC_ACCEL_IDX_KMACT] &
+	    (KEYBD_MASK | MOUSE_MASK);
 
 	/* Keyboard and mouse activity status is cleared as soon as it's read,
 	 * so applications will eat each other's events. Thus we remember any
 	 * event for KMACT_REMEMBER_PERIOD jiffies.
 	 */
-	if (data.val[EC_ACCEL_IDX_KMACT] & KEYBD_MASK)
-		last_keyboard_ticks = ticks;
-	if (data.val[EC_ACCEL_IDX_KMACT] & MOUSE_MASK)
-		last_mouse_ticks = ticks;
-
-	temperature = data.val[EC_ACCEL_IDX_TEMP1];
+	if (data->val[EC_ACCEL_IDX_KMACT] & KEYBD_MASK)
+		hdaps_st.keyboard_ticks = ticks;
+	if (data->val[EC_ACCEL_IDX_KMACT] & MOUSE_MASK)
+		hdaps_st.mouse_ticks = ticks;
+	hdaps_state_write_end();
 
 	stale_readout = 0;
-	if (needs_calibration) {
-		rest_x = pos_x;
-		rest_y = pos_y;
-		needs_calibration = 0;
-	}
+	have_readout = 1;
 
-	return 0;
+out:
+	/* Prefetch even if error */
+	if (!(fast && !ret && hdaps_want_drain(data)))
+		thinkpad_ec_prefetch_row(&ec_accel_args);
+	SDT_PROBE4(hdaps, , update, parse, ret, hdaps_st.x, hdaps_st.y, data);
+	return ret;
+}
+
+/* Admission control for EC reads on behalf of userland (sysctls and the
+ * devices). A token bucket holds up to one second's worth of
+ * hw.hdaps.user_ec_budget reads; past that, callers get the latest sample
+ * instead, so a process polling in a loop can't starve the sampler.
+ * The bucket is kept as time credit: each read costs 1s / budget.
+ */
+static int user_ec_budget = 25;		/* EC reads per second, 0 unlimited */
+static sbintime_t user_ec_credit = SBT_1S;
+static sbintime_t user_ec_last;
+static uint64_t user_ec_admitted;
+static uint64_t user_ec_throttled;
+static struct mtx hdaps_admit_mtx;
+MTX_SYSINIT(hdaps_admit, &hdaps_admit_mtx, "hdaps admission", MTX_DEF);
+
+SYSCTL_INT(_hw_hdaps, OID_AUTO, user_ec_budget, CTLFLAG_RW, &user_ec_budget, 0, "EC reads per second for userland requests, 0 unlimited");
+SYSCTL_UQUAD(_hw_hdaps, OID_AUTO, user_ec_admitted, CTLFLAG_RD, &user_ec_admitted, 0, "userland requests that read the EC");
+SYSCTL_UQUAD(_hw_hdaps, OID_AUTO, user_ec_throttled, CTLFLAG_RD, &user_ec_throttled, 0, "userland requests served from the latest sample");
+
+/* Returns nonzero if a userland request may read the EC now */
+static int hdaps_admit(void)
+{
+	sbintime_t now, cost;
+	int ok;
+
+	mtx_lock(&hdaps_admit_mtx);
+	now = sbinuptime();
+	if (user_ec_budget <= 0) {
+		ok = 1;
+	} else {
+		cost = SBT_1S / user_ec_budget;
+		user_ec_credit += now - user_ec_last;
+		if (user_ec_credit > SBT_1S)
+			user_ec_credit = SBT_1S;
+		ok = user_ec_credit >= cost;
+		if (ok)
+			user_ec_credit -= cost;
+	}
+	user_ec_last = now;
+	if (ok)
+		user_ec_admitted++;
+	else
+		user_ec_throttled++;
+	mtx_unlock(&hdaps_admit_mtx);
+	return ok;
 }
 
 /**
@@ -186,62 +521,276 @@ static int __hdaps_update(int fast)
  *
  * Query current accelerometer state and update global state variables.
  * Also prefetches the next query.
- * Retries until timeout if the accelerometer is not in ready status (common).
- * Does its own locking.
+ * Retries until timeout if the accelerometer is not in ready status (common),
+ * sleeping with exponential backoff between attempts.
+ * Over the userland EC budget, the latest readout is kept instead
+ * (-EBUSY if there is none yet).
+ * Does its own locking. Can sleep.
  */
 int hdaps_update(void)
 {
-	int total, ret;
+	struct thinkpad_ec_row data;
+	sbintime_t deadline, backoff, taken;
+	int ret;
 	if (!stale_readout) /* already updated recently? */
 		return 0;
+	if (!hdaps_admit())
+		return have_readout ? 0 : -EBUSY;
 
-	for (total=0; total<READ_TIMEOUT_MSECS; total+=RETRY_MSECS) {
+	deadline = sbinuptime() + READ_TIMEOUT_MSECS * SBT_1MS;
+	backoff = RETRY_MIN_USECS * SBT_1US;
+	for (;;) {
 		ret = thinkpad_ec_lock();
 		if (ret)
 			return ret;
-		ret = __hdaps_update(0);
+		ret = __hdaps_update(0, &data, &taken);
 		thinkpad_ec_unlock();
 
 		if (!ret)
 			return 0;
 		if (ret != -EBUSY)
 			break;
-		/* use tsleep here ? */
-		DELAY(RETRY_MSECS);
+		if (sbinuptime() + backoff > deadline)
+			break;
+		pause_sbt("hdapsrd", backoff, 0, 0);
+		backoff <<= 1;
+		if (backoff > RETRY_MSECS * SBT_1MS)
+			backoff = RETRY_MSECS * SBT_1MS;
 	}
 	return ret;
 }
 
+/* Sample ring, see hdaps_ring.h. The producer is the sampler: the
+ * callout, or the queue drain it started (see hdaps_drain_start()), never
+ * both at once.
+ */
+static struct hdaps_ring hdaps_ring;
+
+/* Filter and publish one readout, and run the shock detector on it. The
+ * detector gets the raw position: filtering would only delay it.
+ * The rest position is looked up for each readout, since the one before
+ * may have moved it (drift tracking, or the end of a calibration).
+ */
+static void hdaps_publish_readout(int x, int y, int temp, int act,
+				  sbintime_t taken)
+{
+	struct hdaps_state st;
+	struct hdaps_sample s;
+	int fx = x, fy = y;
+
+	hdaps_get_state(&st);
+	hdaps_filter_sample(&fx, &fy);
+	s.time = taken;
+	s.x = fx;
+	s.y = fy;
+	s.temp = temp;
+	s.kmact = act;
+	hdaps_ring_put(&hdaps_ring, &s);
+	s.x = x;
+	s.y = y;
+	/* no rest position to compare against until calibrated */
+	if (atomic_load_acq_int(&needs_calibration))
+		hdaps_shock_pause();
+	else
+		hdaps_shock_sample(&s, st.rest_x, st.rest_y);
+	hdaps_calib_sample(x, y, act, &st);
+}
+
+/* Publish the readouts of a valid 0x11 row, in row order; @taken is when
+ * the EC was read, not when the row got to us.
+ */
+static void hdaps_publish_row(const struct thinkpad_ec_row *data,
+			      sbintime_t taken)
+{
+	int x, y, act;
+
+	act = data->val[EC_ACCEL_IDX_KMACT] & (KEYBD_MASK | MOUSE_MASK);
+	x = *(const short*)(data->val+EC_ACCEL_IDX_XPOS1);
+	y = *(const short*)(data->val+EC_ACCEL_IDX_YPOS1);
+	transform_axes(&x, &y);
+	hdaps_publish_readout(x, y, data->val[EC_ACCEL_IDX_TEMP1], act, taken);
+
+	if (data->val[EC_ACCEL_IDX_READOUTS] < 2)
+		return;
+	x = *(const short*)(data->val+EC_ACCEL_IDX_XPOS2);
+	y = *(const short*)(data->val+EC_ACCEL_IDX_YPOS2);
+	transform_axes(&x, &y);
+	hdaps_publish_readout(x, y, data->val[EC_ACCEL_IDX_TEMP2], act, taken);
+}
+
+/* The drain runs as a chain of sampling-class EC requests, each started
+ * from the completion of the one before on the EC worker thread. The
+ * callout skips its polls while hdaps_draining is set, so the ring keeps
+ * a single producer.
+ */
+static struct thinkpad_ec_req hdaps_drain_req;
+static int hdaps_drain_left;
+static volatile u_int hdaps_draining;
+
+static void hdaps_drain_done(struct thinkpad_ec_req *req, void *arg);
+
+static int hdaps_drain_submit(void)
+{
+	hdaps_drain_req.args = ec_accel_args;
+	hdaps_drain_req.data.mask = HDAPS_ROW_MASK;
+	hdaps_drain_req.done = hdaps_drain_done;
+	hdaps_drain_req.done_arg = NULL;
+	hdaps_drain_req.prio = TP_EC_PRIO_RT;
+	return thinkpad_ec_submit(&hdaps_drain_req);
+}
+
+static void hdaps_drain_end(void)
+{
+	thinkpad_ec_prefetch_row(&ec_accel_args); /* for the next poll */
+	atomic_store_rel_int(&hdaps_draining, 0);
+}
+
+static void hdaps_drain_done(struct thinkpad_ec_req *req, void *arg)
+{
+	const struct thinkpad_ec_row *data = &req->data;
+
+	if (req->error || data->val[EC_ACCEL_IDX_RETVAL] != 0x00) {
+		hdaps_drain_end();
+		return;
+	}
+	hdaps_drained++;
+	if (data->val[EC_ACCEL_IDX_READOUTS] >= 1)
+		hdaps_publish_row(data, req->taken);
+
+	if (data->val[EC_ACCEL_IDX_QUEUED] > 0) {
+		if (--hdaps_drain_left > 0 && !hdaps_drain_submit())
+			return;
+		hdaps_ec_queue_overruns++;
+	}
+	hdaps_drain_end();
+}
+
+/* Start draining after a row that said more readouts are queued.
+ * Sampling callout only, EC lock held.
+ */
+static void hdaps_drain_start(void)
+{
+	atomic_store_rel_int(&hdaps_draining, 1);
+	hdaps_drain_left = hdaps_drain_budget;
+	if (hdaps_drain_submit())
+		hdaps_drain_end();
+}
+
+/* Wait for a drain in progress; the callout must be stopped */
+static void hdaps_drain_wait(void)
+{
+	while (atomic_load_acq_int(&hdaps_draining))
+		pause("hdapsdr", 1);
+}
+
+SYSCTL_UINT(_hw_hdaps, OID_AUTO, ring_overruns, CTLFLAG_RD, &hdaps_ring.overruns, 0, "samples overwritten before a reader got them");
+
 /**
- * hdaps_set_power - enable or disable power to the accelerometer.
- * Returns zero on success and negative error code on failure.  Can sleep.
+ * hdaps_ring_latest - get the newest sample taken by the sampler
+ * @s: filled in
+ *
+ * Never blocks. Returns -ENOENT if no sample was taken yet.
  */
-static int hdaps_set_power(int on) {
-	struct thinkpad_ec_row args = 
-		{ .mask=0x0003, .val={0x14, on?0x01:0x00} };
-	struct thinkpad_ec_row data = { .mask = 0x8000 };
-	int ret = thinkpad_ec_read_row(&args, &data);
+int hdaps_ring_latest(struct hdaps_sample *s)
+{
+	return hdaps_ring_newest(&hdaps_ring, s);
+}
+
+/**
+ * hdaps_ring_next - get the sample following the one seen last
+ * @cursor: sequence number of the last sample seen, 0 for none; advanced
+ * @s: filled in
+ *
+ * Samples that were overwritten before being read are skipped, and
+ * counted in hw.hdaps.ring_overruns. Never blocks. Returns -EAGAIN if
+ * there is no newer sample.
+ */
+int hdaps_ring_next(u_int *cursor, struct hdaps_sample *s)
+{
+	return hdaps_ring_follow(&hdaps_ring, cursor, s);
+}
+
+/**
+ * hdaps_read_state - get a consistent copy of the current state
+ * @st: filled in
+ *
+ * As hdaps_get_state(), but if the sampler isn't keeping the state up to
+ * date, read the EC first through hdaps_update(). Can sleep.
+ */
+int hdaps_read_state(struct hdaps_state *st)
+{
+	int ret;
+
+	hdaps_get_state(st);
+	if (st->time != 0 && sbinuptime() - st->time <= hdaps_max_age())
+		return 0;
+
+	ret = hdaps_update();
 	if (ret)
 		return ret;
-	if (data.val[0xF]!=0x00)
-		return -EIO;
+	hdaps_get_state(st);
 	return 0;
 }
 
 /**
- * hdaps_set_fake_data_mode - enable or disable EC test mode
- * EC test mode fakes accelerometer data using an incrementing counter.
- * Returns zero on success and negative error code on failure.  Can sleep.
+ * hdaps_get_sample - get a current sample
+ * @s: filled in
+ *
+ * From the sample ring if the sampler is keeping it up to date, else
+ * through hdaps_read_state() (seq 0 then). Can sleep.
  */
-static int hdaps_set_fake_data_mode(int on)
+int hdaps_get_sample(struct hdaps_sample *s)
 {
-	struct thinkpad_ec_row args = 
-		{ .mask=0x0007, .val={0x17, 0x83, on?0x01:0x00} };
-	struct thinkpad_ec_row data = { .mask = 0x8000 };
-	int ret = thinkpad_ec_read_row(&args, &data);
+	struct hdaps_state st;
+	int ret;
+
+	if (!hdaps_ring_latest(s) && sbinuptime() - s->time <= hdaps_max_age())
+		return 0;
+
+	ret = hdaps_read_state(&st);
 	if (ret)
 		return ret;
-	if (data.val[0xF]!=0x00) {
+	s->seq = 0;
+	s->time = st.time;
+	s->x = st.x;
+	s->y = st.y;
+	s->temp = st.temp;
+	s->kmact = st.kmact;
+	return 0;
+}
+
+/* Each EC command below comes as a function that fills in its argument and
+ * data rows and one that checks its result, so it can be issued on its own
+ * or as part of a thinkpad_ec_read_rows() batch.
+ */
+
+static void hdaps_power_row(struct thinkpad_ec_row *args,
+			    struct thinkpad_ec_row *data, int on)
+{
+	*args = (struct thinkpad_ec_row)
+		{ .mask=0x0003, .val={0x14, on?0x01:0x00} };
+	data->mask = 0x8000;
+}
+
+static int hdaps_power_result(const struct thinkpad_ec_row *data)
+{
+	if (data->val[0xF]!=0x00)
+		return -EIO;
+	return 0;
+}
+
+static void hdaps_fake_data_mode_row(struct thinkpad_ec_row *args,
+				     struct thinkpad_ec_row *data, int on)
+{
+	*args = (struct thinkpad_ec_row)
+		{ .mask=0x0007, .val={0x17, 0x83, on?0x01:0x00} };
+	data->mask = 0x8000;
+}
+
+static int hdaps_fake_data_mode_result(const struct thinkpad_ec_row *data,
+				       int on)
+{
+	if (data->val[0xF]!=0x00) {
 		printf("failed setting hdaps fake data to %d\n", on);
 		return -EIO;
 	}
@@ -250,38 +799,71 @@ static int hdaps_set_fake_data_mode(int on)
 }
 
 /**
- * hdaps_set_ec_config - set accelerometer parameters.
- * @ec_rate: embedded controller sampling rate
- * @order: embedded controller running average filter order
- * (Normally we have @ec_rate = sampling_rate * oversampling_ratio.)
+ * hdaps_set_fake_data_mode - enable or disable EC test mode
+ * EC test mode fakes accelerometer data using an incrementing counter.
  * Returns zero on success and negative error code on failure.  Can sleep.
  */
-static int hdaps_set_ec_config(int ec_rate, int order)
+static int hdaps_set_fake_data_mode(int on)
 {
-	struct thinkpad_ec_row args = { .mask=0x000F, 
-		.val={0x10, (u_char)ec_rate, (u_char)(ec_rate>>8), order} };
-	struct thinkpad_ec_row data = { .mask = 0x8000 };
-	int ret = thinkpad_ec_read_row(&args, &data);
-	printf("hdaps: setting ec_rate=%d, filter_order=%d\n",
-	       ec_rate, order);
+	struct thinkpad_ec_row args, data;
+	int ret;
+
+	hdaps_fake_data_mode_row(&args, &data, on);
+	ret = thinkpad_ec_read_row(&args, &data);
 	if (ret)
 		return ret;
-	if (data.val[0xF]==0x03) {
+	return hdaps_fake_data_mode_result(&data, on);
+}
+
+static void hdaps_ec_config_row(struct thinkpad_ec_row *args,
+				struct thinkpad_ec_row *data,
+				int ec_rate, int order)
+{
+	*args = (struct thinkpad_ec_row) { .mask=0x000F,
+		.val={0x10, (u_char)ec_rate, (u_char)(ec_rate>>8), order} };
+	data->mask = 0x8000;
+	if (hdaps_debug)
+		printf("hdaps: setting ec_rate=%d, filter_order=%d\n",
+		       ec_rate, order);
+}
+
+static int hdaps_ec_config_result(const struct thinkpad_ec_row *data)
+{
+	if (data->val[0xF]==0x03) {
 		printf("hdaps: config param out of range\n");
 		return -EINVAL;
 	}
-	if (data.val[0xF]==0x06) {
+	if (data->val[0xF]==0x06) {
 		printf("hdaps: config change already pending\n");
 		return -EBUSY;
 	}
-	if (data.val[0xF]!=0x00) {
+	if (data->val[0xF]!=0x00) {
 		printf("hdaps: config change error, ret=%d\n",
-		      data.val[0xF]);
+		      data->val[0xF]);
 		return -EIO;
 	}
 	return 0;
 }
 
+/**
+ * hdaps_set_ec_config - set accelerometer parameters.
+ * @ec_rate: embedded controller sampling rate
+ * @order: embedded controller running average filter order
+ * (Normally we have @ec_rate = sampling_rate * oversampling_ratio.)
+ * Returns zero on success and negative error code on failure.  Can sleep.
+ */
+static int hdaps_set_ec_config(int ec_rate, int order)
+{
+	struct thinkpad_ec_row args, data;
+	int ret;
+
+	hdaps_ec_config_row(&args, &data, ec_rate, order);
+	ret = thinkpad_ec_read_row(&args, &data);
+	if (ret)
+		return ret;
+	return hdaps_ec_config_result(&data);
+}
+
 /**
  * hdaps_get_ec_config - get accelerometer parameters.
  * @ec_rate: embedded controller sampling rate
@@ -326,22 +908,18 @@ static int hdaps_get_ec_mode(u_char *mode)
 	return 0;
 }
 
-/**
- * hdaps_check_ec - checks something about the EC.
- * Follows the clean-room spec for HDAPS; we don't know what it means.
- * Returns zero on success and negative error code on failure.  Can sleep.
- */
-static int hdaps_check_ec(u_char *mode)
+static void hdaps_check_ec_row(struct thinkpad_ec_row *args,
+			       struct thinkpad_ec_row *data)
+{
+	*args = (struct thinkpad_ec_row) { .mask=0x0003, .val={0x17, 0x81} };
+	data->mask = 0x800E;
+}
+
+static int hdaps_check_ec_result(const struct thinkpad_ec_row *data)
 {
-	const struct thinkpad_ec_row args = 
-		{ .mask=0x0003, .val={0x17, 0x81} };
-	struct thinkpad_ec_row data = { .mask = 0x800E };
-	int ret = thinkpad_ec_read_row(&args, &data);
     return 0;
-	if (ret)
-		return  ret;
-	if (data.val[0x1]!=0x00 || data.val[0x2]!=0x60 ||
-	    data.val[0x3]!=0x00 || data.val[0xF]!=0x00)
+	if (data->val[0x1]!=0x00 || data->val[0x2]!=0x60 ||
+	    data->val[0x3]!=0x00 || data->val[0xF]!=0x00)
 		return -EIO;
 	return 0;
 }
@@ -350,12 +928,14 @@ static int hdaps_check_ec(u_char *mode)
  * hdaps_device_init - initialize the accelerometer.
  *
  * Call several embedded controller functions to test and initialize the
- * accelerometer.
+ * accelerometer. All but the first go to the EC as one batch.
  * Returns zero on success and negative error code on failure. Can sleep.
  */
 #define ABORT_INIT(msg) printf("hdaps init failed at: %s\n", msg)
 static int hdaps_device_init(void)
 {
+	struct thinkpad_ec_row args[4], data[4];
+	int status[4];
 	int ret;
 	u_char mode;
 
@@ -370,17 +950,26 @@ static int hdaps_device_init(void)
 	if (mode==0x00)
                 { ABORT_INIT("accelerometer not available"); goto bad; }
 
-	if (hdaps_check_ec(&mode))
-                { ABORT_INIT("hdaps_check_ec failed"); goto bad; }
+	/* The rest goes to the EC in one batch */
+	hdaps_check_ec_row(&args[0], &data[0]);
+	hdaps_power_row(&args[1], &data[1], 1);
+	hdaps_ec_config_row(&args[2], &data[2],
+	    sampling_rate*oversampling_ratio, running_avg_filter_order);
+	hdaps_fake_data_mode_row(&args[3], &data[3], fake_data_mode);
+	ret = thinkpad_ec_read_rows(args, data, status, 4, TP_EC_ROWS_STOP);
 
-	if (hdaps_set_power(1))
-                { ABORT_INIT("hdaps_set_power failed"); goto bad; }
+	/* status[] only tells which row failed if the batch did */
+	if ((ret && status[0]) || hdaps_check_ec_result(&data[0]))
+                { ABORT_INIT("EC check failed"); goto bad; }
 
-	if (hdaps_set_ec_config(sampling_rate*oversampling_ratio,
-	                        running_avg_filter_order))
+	if ((ret && status[1]) || hdaps_power_result(&data[1]))
+                { ABORT_INIT("accelerometer power on failed"); goto bad; }
+
+	if ((ret && status[2]) || hdaps_ec_config_result(&data[2]))
                 { ABORT_INIT("hdaps_set_ec_config failed"); goto bad; }
 
-	if (hdaps_set_fake_data_mode(fake_data_mode))
+	if ((ret && status[3]) ||
+	    hdaps_fake_data_mode_result(&data[3], fake_data_mode))
                 { ABORT_INIT("hdaps_set_fake_data_mode failed"); goto bad; }
 
 	thinkpad_ec_invalidate();
@@ -390,6 +979,10 @@ static int hdaps_device_init(void)
 	ret = thinkpad_ec_prefetch_row(&ec_accel_args);
 	if (ret)
                 { ABORT_INIT("initial prefetch failed"); goto bad; }
+	hdaps_ec_good.ec_rate = sampling_rate*oversampling_ratio;
+	hdaps_ec_good.order = running_avg_filter_order;
+	hdaps_ec_good.fake = fake_data_mode;
+	hdaps_ec_good.valid = 1;
 	goto good;
 bad:
 	thinkpad_ec_invalidate();
@@ -406,66 +999,497 @@ good:
  */
 static int hdaps_device_shutdown(void)
 {
-        int ret;
-        ret = hdaps_set_power(0);
+        struct thinkpad_ec_row args[2], data[2];
+        int status[2];
+        int batch, ret;
+
+        hdaps_power_row(&args[0], &data[0], 0);
+        hdaps_ec_config_row(&args[1], &data[1], 0, 1);
+        batch = thinkpad_ec_read_rows(args, data, status, 2, TP_EC_ROWS_STOP);
+
+        /* status[] only tells which row failed if the batch did */
+        ret = (batch && status[0]) ? status[0] : hdaps_power_result(&data[0]);
         if (ret) {
                 printf("hdaps: cannot power off\n");
                 return ret;
         }
-        ret = hdaps_set_ec_config(0, 1);
+        ret = (batch && status[1]) ? status[1] :
+            hdaps_ec_config_result(&data[1]);
         if (ret)
                 printf("hdaps: cannot stop EC sampling\n");
         return ret;
 }
 
+/* Sampler timing. Polls are due at exact multiples of the sampling
+ * period, in sbintime, so any rate works whatever hz is; a poll that
+ * fires after the next one was due restarts the schedule from now.
+ * All under hdaps_co_mtx.
+ */
+static sbintime_t hdaps_poll_due;	/* deadline of the pending poll */
+static sbintime_t hdaps_poll_last;	/* when the last poll fired, 0 none */
+static uint64_t hdaps_polls;
+static uint64_t hdaps_polls_missed;	/* periods that passed without a poll */
+static uint64_t hdaps_jitter_max_ns;	/* |achieved - nominal period| */
+static uint64_t hdaps_jitter_ns[TP_EC_HIST_BUCKETS];
+
+SYSCTL_NODE(_hw_hdaps, OID_AUTO, sampler, CTLFLAG_RD, NULL, "sampler timing");
+SYSCTL_UQUAD(_hw_hdaps_sampler, OID_AUTO, polls, CTLFLAG_RD, &hdaps_polls, 0, "polls fired");
+SYSCTL_UQUAD(_hw_hdaps_sampler, OID_AUTO, missed, CTLFLAG_RD, &hdaps_polls_missed, 0, "periods that passed without a poll");
+SYSCTL_UQUAD(_hw_hdaps_sampler, OID_AUTO, jitter_max_ns, CTLFLAG_RD, &hdaps_jitter_max_ns, 0, "largest deviation of a period from nominal (ns)");
+SYSCTL_OPAQUE(_hw_hdaps_sampler, OID_AUTO, jitter_ns, CTLFLAG_RD, &hdaps_jitter_ns, sizeof(hdaps_jitter_ns), "QU", "log2 histogram of period deviation from nominal (ns)");
+
+static void hdaps_mousedev_poll(void* args);
+
+static sbintime_t hdaps_period(void)
+{
+	return SBT_1S / hdaps_rate;
+}
+
+/* Motion-adaptive sampling: with hw.hdaps.adaptive.enable set, once the
+ * position stayed within idle_band of the rest position, without
+ * keyboard or mouse activity, for idle_delay_ms, the EC and the sampler
+ * drop to idle_rate. The first poll that sees motion or activity goes
+ * back to hw.hdaps.sampling_rate. Reprogramming the EC can sleep, so it
+ * is done by hdaps_rate_task; the delay before going idle again keeps
+ * a signal at the edge of the band from switching at every poll.
+ * All under hdaps_co_mtx.
+ */
+static int adaptive = 0;
+static int idle_rate = 5;
+static int idle_band = 3;
+static int idle_delay_ms = 2000;
+static int hdaps_sampler_running;
+static int hdaps_idle;			/* running at idle_rate */
+static int hdaps_want_idle;		/* what hdaps_rate_task should do */
+static int hdaps_rate_pending;		/* hdaps_rate_task queued */
+static sbintime_t hdaps_still_since;
+static sbintime_t hdaps_mode_since;
+static sbintime_t hdaps_mode_time[2];	/* active, idle */
+static uint64_t hdaps_mode_switches;
+static uint64_t hdaps_mode_errors;
+static struct task hdaps_rate_task;
+
+static int hdaps_mode_time_sysctlproc(SYSCTL_HANDLER_ARGS)
+{
+	sbintime_t t;
+	uint64_t ms;
+
+	mtx_lock(&hdaps_co_mtx);
+	t = hdaps_mode_time[arg2];
+	if (hdaps_sampler_running && hdaps_idle == arg2)
+		t += sbinuptime() - hdaps_mode_since;
+	mtx_unlock(&hdaps_co_mtx);
+	ms = sbttons(t) / 1000000;
+	return SYSCTL_OUT(req, &ms, sizeof(ms));
+}
+
+SYSCTL_NODE(_hw_hdaps, OID_AUTO, adaptive, CTLFLAG_RD, NULL, "motion-adaptive sampling");
+SYSCTL_INT(_hw_hdaps_adaptive, OID_AUTO, enable, CTLFLAG_RW, &adaptive, 0, "drop to idle_rate while at rest");
+SYSCTL_INT(_hw_hdaps_adaptive, OID_AUTO, idle_rate, CTLFLAG_RW, &idle_rate, 0, "sampling rate while at rest");
+SYSCTL_INT(_hw_hdaps_adaptive, OID_AUTO, idle_band, CTLFLAG_RW, &idle_band, 0, "largest distance from the rest position counted as rest");
+SYSCTL_INT(_hw_hdaps_adaptive, OID_AUTO, idle_delay_ms, CTLFLAG_RW, &idle_delay_ms, 0, "time at rest before going idle (ms)");
+SYSCTL_INT(_hw_hdaps_adaptive, OID_AUTO, idle, CTLFLAG_RD, &hdaps_idle, 0, "running at idle_rate");
+SYSCTL_INT(_hw_hdaps_adaptive, OID_AUTO, rate, CTLFLAG_RD, &hdaps_rate, 0, "current sampling rate");
+SYSCTL_UQUAD(_hw_hdaps_adaptive, OID_AUTO, switches, CTLFLAG_RD, &hdaps_mode_switches, 0, "switches between active and idle");
+SYSCTL_UQUAD(_hw_hdaps_adaptive, OID_AUTO, errors, CTLFLAG_RD, &hdaps_mode_errors, 0, "switches the EC refused");
+SYSCTL_PROC(_hw_hdaps_adaptive, OID_AUTO, active_ms, CTLTYPE_U64|CTLFLAG_RD, NULL, 0, hdaps_mode_time_sysctlproc, "QU", "time sampled at sampling_rate (ms)");
+SYSCTL_PROC(_hw_hdaps_adaptive, OID_AUTO, idle_ms, CTLTYPE_U64|CTLFLAG_RD, NULL, 1, hdaps_mode_time_sysctlproc, "QU", "time sampled at idle_rate (ms)");
+
+/* Close the current stretch of time in a mode. hdaps_co_mtx held. */
+static void hdaps_mode_account(sbintime_t now)
+{
+	if (hdaps_sampler_running)
+		hdaps_mode_time[hdaps_idle] += now - hdaps_mode_since;
+	hdaps_mode_since = now;
+}
+
+/* Decide on the mode after a readout. Poll only, hdaps_co_mtx held. */
+static void hdaps_adapt(sbintime_t now)
+{
+	struct hdaps_state st;
+	int still;
+
+	hdaps_get_state(&st);
+	still = adaptive &&
+	    abs(st.x - st.rest_x) <= idle_band &&
+	    abs(st.y - st.rest_y) <= idle_band &&
+	    !st.kmact;
+	if (!still)
+		hdaps_still_since = now;
+	hdaps_want_idle = still &&
+	    now - hdaps_still_since >= mstosbt(idle_delay_ms);
+	if (hdaps_want_idle != hdaps_idle && !hdaps_rate_pending) {
+		hdaps_rate_pending = 1;
+		taskqueue_enqueue(taskqueue_thread, &hdaps_rate_task);
+	}
+}
+
+static void hdaps_sampler_arm(void);
+
+/* Switch the EC and the sampler to the mode hdaps_adapt() asked for */
+static void hdaps_rate_switch(void *context, int pending)
+{
+	int idle, rate, ret;
+
+	mtx_lock(&hdaps_co_mtx);
+	idle = hdaps_want_idle;
+	mtx_unlock(&hdaps_co_mtx);
+	rate = idle ? idle_rate : sampling_rate;
+	if (rate < 1 || rate > 0xFFFF / oversampling_ratio)
+		rate = sampling_rate;
+
+	ret = thinkpad_ec_lock();
+	if (!ret) {
+		mtx_lock(&hdaps_co_mtx);
+		ret = hdaps_sampler_running ? 0 : -ENXIO;
+		mtx_unlock(&hdaps_co_mtx);
+		if (!ret)
+			ret = hdaps_set_ec_config(rate*oversampling_ratio,
+			    running_avg_filter_order);
+		if (!ret)
+			hdaps_ec_good_note(rate*oversampling_ratio,
+			    running_avg_filter_order);
+		thinkpad_ec_unlock();
+	}
+
+	mtx_lock(&hdaps_co_mtx);
+	if (!ret && hdaps_sampler_running) {
+		hdaps_mode_account(sbinuptime());
+		hdaps_idle = idle;
+		hdaps_rate = rate;
+		hdaps_poll_last = 0;	/* the period changed, see account */
+		hdaps_mode_switches++;
+		if (!idle) {
+			/* don't wait out the idle period */
+			hdaps_poll_due = sbinuptime();
+			hdaps_sampler_arm();
+		}
+	} else if (ret != -ENXIO)
+		hdaps_mode_errors++;
+	hdaps_rate_pending = 0;
+	mtx_unlock(&hdaps_co_mtx);
+}
+
+/* Arm the callout for the next due poll. hdaps_co_mtx held. */
+static void hdaps_sampler_arm(void)
+{
+	sbintime_t now = sbinuptime();
+
+	hdaps_poll_due += hdaps_period();
+	if (hdaps_poll_due <= now)	/* counted by hdaps_sampler_account() */
+		hdaps_poll_due = now + hdaps_period();
+	callout_reset_sbt(&hdaps_co, hdaps_poll_due,
+	    ustosbt(sampling_precision_us), hdaps_mousedev_poll, NULL,
+	    C_ABSOLUTE);
+}
+
+/* Account the time since the last poll: the periods that passed without
+ * one, and how far it is from a whole number of periods. After a rate
+ * switch hdaps_poll_last is 0, so the gap spanning it isn't counted.
+ * hdaps_co_mtx held.
+ */
+static void hdaps_sampler_account(sbintime_t now)
+{
+	sbintime_t gap, jitter, period = hdaps_period();
+	int64_t periods;
+	uint64_t ns;
+	int bucket;
+
+	hdaps_polls++;
+	if (hdaps_poll_last != 0) {
+		gap = now - hdaps_poll_last;
+		periods = (gap + period / 2) / period;	/* nearest */
+		if (periods < 1)
+			periods = 1;
+		hdaps_polls_missed += periods - 1;
+		jitter = gap - periods * period;
+		ns = sbttons(jitter < 0 ? -jitter : jitter);
+		if (ns > hdaps_jitter_max_ns)
+			hdaps_jitter_max_ns = ns;
+		bucket = flsll(ns);
+		if (bucket >= TP_EC_HIST_BUCKETS)
+			bucket = TP_EC_HIST_BUCKETS - 1;
+		hdaps_jitter_ns[bucket]++;
+	}
+	hdaps_poll_last = now;
+}
+
+/* Start sampling, active; the EC must be set up for sampling_rate */
+static void hdaps_sampler_start(void)
+{
+	mtx_lock(&hdaps_co_mtx);
+	hdaps_poll_due = sbinuptime();
+	hdaps_poll_last = 0;
+	hdaps_rate = sampling_rate;
+	hdaps_idle = hdaps_want_idle = 0;
+	hdaps_still_since = hdaps_mode_since = hdaps_poll_due;
+	hdaps_sampler_running = 1;
+	hdaps_filter_reset();
+	hdaps_sampler_arm();
+	mtx_unlock(&hdaps_co_mtx);
+}
+
+/* Stop the sampler; once this returns, no poll runs or drains. A rate
+ * switch may still be queued, but won't touch the EC.
+ */
+static void hdaps_sampler_stop(void)
+{
+	mtx_lock(&hdaps_co_mtx);
+	callout_stop(&hdaps_co);
+	hdaps_mode_account(sbinuptime());
+	hdaps_sampler_running = 0;
+	mtx_unlock(&hdaps_co_mtx);
+	hdaps_drain_wait();
+}
+
+/**
+ * hdaps_device_restore - set the accelerometer up again after resume
+ *
+ * If the wanted setup is the one hdaps_device_init() last got through,
+ * only power the accelerometer on and restore the config, in one batch,
+ * and leave the checks to hdaps_verify(). Returns -EAGAIN if a full
+ * hdaps_device_init() is needed instead, or another negative error code
+ * on failure. Can sleep.
+ */
+static int hdaps_device_restore(void)
+{
+	struct thinkpad_ec_row args[3], data[3];
+	int status[3];
+	int batch, ret, n = 2;
+
+	if (!hdaps_ec_good.valid ||
+	    hdaps_ec_good.ec_rate != sampling_rate*oversampling_ratio ||
+	    hdaps_ec_good.order != running_avg_filter_order ||
+	    hdaps_ec_good.fake != fake_data_mode)
+		return -EAGAIN;
+
+	ret = thinkpad_ec_lock();
+	if (ret)
+		return ret;
+
+	hdaps_power_row(&args[0], &data[0], 1);
+	hdaps_ec_config_row(&args[1], &data[1], hdaps_ec_good.ec_rate,
+	    hdaps_ec_good.order);
+	if (hdaps_ec_good.fake) { /* shutdown leaves it alone otherwise */
+		hdaps_fake_data_mode_row(&args[2], &data[2], 1);
+		n = 3;
+	}
+	batch = thinkpad_ec_read_rows(args, data, status, n, TP_EC_ROWS_STOP);
+
+	/* status[] only tells which row failed if the batch did */
+	ret = (batch && status[0]) ? status[0] : hdaps_power_result(&data[0]);
+	if (!ret)
+		ret = (batch && status[1]) ? status[1] :
+		    hdaps_ec_config_result(&data[1]);
+	if (!ret && n > 2)
+		ret = (batch && status[2]) ? status[2] :
+		    hdaps_fake_data_mode_result(&data[2], 1);
+
+	/* No settling delay: the poll copes with readouts not ready yet */
+	thinkpad_ec_invalidate();
+	if (!ret)
+		ret = thinkpad_ec_prefetch_row(&ec_accel_args);
+	stale_readout = 1;
+	thinkpad_ec_unlock();
+	return ret;
+}
+
+/* Suspend/resume timing (hw.hdaps.pm), in us: the last time and the
+ * worst case of each phase.
+ */
+enum {
+	HDAPS_PM_SUSPEND,	/* hdaps_suspend() */
+	HDAPS_PM_RESUME,	/* hdaps_resume() */
+	HDAPS_PM_RESUME_EC,	/* its EC commands */
+	HDAPS_PM_VERIFY,	/* hdaps_verify(), after resume */
+	HDAPS_PM_PHASES
+};
+
+static uint64_t hdaps_pm_us[HDAPS_PM_PHASES];
+static uint64_t hdaps_pm_max_us[HDAPS_PM_PHASES];
+static uint64_t hdaps_fast_resumes;
+static uint64_t hdaps_full_resumes;
+static uint64_t hdaps_verify_failures;
+static struct task hdaps_verify_task;
+
+SYSCTL_NODE(_hw_hdaps, OID_AUTO, pm, CTLFLAG_RD, NULL, "suspend/resume");
+SYSCTL_UQUAD(_hw_hdaps_pm, OID_AUTO, suspend_us, CTLFLAG_RD, &hdaps_pm_us[HDAPS_PM_SUSPEND], 0, "last suspend (us)");
+SYSCTL_UQUAD(_hw_hdaps_pm, OID_AUTO, suspend_max_us, CTLFLAG_RD, &hdaps_pm_max_us[HDAPS_PM_SUSPEND], 0, "longest suspend (us)");
+SYSCTL_UQUAD(_hw_hdaps_pm, OID_AUTO, resume_us, CTLFLAG_RD, &hdaps_pm_us[HDAPS_PM_RESUME], 0, "last resume (us)");
+SYSCTL_UQUAD(_hw_hdaps_pm, OID_AUTO, resume_max_us, CTLFLAG_RD, &hdaps_pm_max_us[HDAPS_PM_RESUME], 0, "longest resume (us)");
+SYSCTL_UQUAD(_hw_hdaps_pm, OID_AUTO, resume_ec_us, CTLFLAG_RD, &hdaps_pm_us[HDAPS_PM_RESUME_EC], 0, "EC commands of the last resume (us)");
+SYSCTL_UQUAD(_hw_hdaps_pm, OID_AUTO, resume_ec_max_us, CTLFLAG_RD, &hdaps_pm_max_us[HDAPS_PM_RESUME_EC], 0, "EC commands of the longest resume (us)");
+SYSCTL_UQUAD(_hw_hdaps_pm, OID_AUTO, verify_us, CTLFLAG_RD, &hdaps_pm_us[HDAPS_PM_VERIFY], 0, "last check after resume (us)");
+SYSCTL_UQUAD(_hw_hdaps_pm, OID_AUTO, verify_max_us, CTLFLAG_RD, &hdaps_pm_max_us[HDAPS_PM_VERIFY], 0, "longest check after resume (us)");
+SYSCTL_UQUAD(_hw_hdaps_pm, OID_AUTO, fast_resumes, CTLFLAG_RD, &hdaps_fast_resumes, 0, "resumes that restored the cached EC setup");
+SYSCTL_UQUAD(_hw_hdaps_pm, OID_AUTO, full_resumes, CTLFLAG_RD, &hdaps_full_resumes, 0, "resumes that reinitialized the accelerometer");
+SYSCTL_UQUAD(_hw_hdaps_pm, OID_AUTO, verify_failures, CTLFLAG_RD, &hdaps_verify_failures, 0, "fast resumes found wrong afterwards");
+
+/* Account a phase that started at @start; returns now */
+static sbintime_t hdaps_pm_phase(int phase, sbintime_t start)
+{
+	sbintime_t now = sbinuptime();
+	uint64_t us = sbttous(now - start);
+
+	hdaps_pm_us[phase] = us;
+	if (us > hdaps_pm_max_us[phase])
+		hdaps_pm_max_us[phase] = us;
+	return now;
+}
+
 /* Device model stuff */
 
 
 static int hdaps_suspend(device_t dev)
 {
-	/* Don't do hdaps polls until resume re-initializes the sensor. */
-	callout_stop(&hdaps_co);
+	sbintime_t start = sbinuptime();
+
+	/* Don't do hdaps polls until resume re-initializes the sensor.
+	 * A reinit after an EC hang would start them again. */
+	taskqueue_drain(taskqueue_thread, &hdaps_reinit_task);
+	taskqueue_drain(taskqueue_thread, &hdaps_verify_task);
+	hdaps_sampler_stop();
+	taskqueue_drain(taskqueue_thread, &hdaps_rate_task);
         hdaps_device_shutdown(); /* ignore errors, effect is negligible */
+	hdaps_pm_phase(HDAPS_PM_SUSPEND, start);
 	return 0;
 }
 
-static void hdaps_mousedev_poll(void* args);
 static int hdaps_resume(device_t dev)
 {
-	int ret = hdaps_device_init();
+	sbintime_t start = sbinuptime();
+	int ret;
+
+	ret = hdaps_device_restore();
+	if (!ret) {
+		hdaps_fast_resumes++;
+		taskqueue_enqueue(taskqueue_thread, &hdaps_verify_task);
+	} else {
+		hdaps_full_resumes++;
+		ret = hdaps_device_init();
+	}
+	hdaps_pm_phase(HDAPS_PM_RESUME_EC, start);
 	if (ret)
 		return ret;
 
-	callout_reset(&hdaps_co, hz/sampling_rate, hdaps_mousedev_poll, NULL);
+	hdaps_sampler_start();
+	hdaps_pm_phase(HDAPS_PM_RESUME, start);
 	return 0;
 }
 
+/* The EC came back from a hang and has probably forgotten the
+ * accelerometer setup: redo it, off the EC worker thread.
+ */
+static void hdaps_reinit(void *context, int pending)
+{
+	hdaps_sampler_stop();
+	if (hdaps_device_init()) {
+		printf("hdaps: reinit after EC reset failed, disabling updates\n");
+		return;
+	}
+	hdaps_sampler_start();
+}
+
+/* After a fast resume: check that the accelerometer really is set up
+ * as hdaps_device_restore() left it, and reinitialize it if not.
+ */
+static void hdaps_verify(void *context, int pending)
+{
+	struct thinkpad_ec_row args, data;
+	sbintime_t start = sbinuptime();
+	int ret, tries, ec_rate, order;
+	u_char mode;
+
+	ret = thinkpad_ec_lock();
+	if (!ret) {
+		ret = hdaps_get_ec_mode(&mode);
+		if (!ret && mode == 0x00)
+			ret = -ENXIO;
+		if (!ret) {
+			hdaps_check_ec_row(&args, &data);
+			ret = thinkpad_ec_read_row(&args, &data);
+			if (!ret)
+				ret = hdaps_check_ec_result(&data);
+		}
+		thinkpad_ec_unlock();
+	}
+
+	/* The config change may still be going on. The sampler only
+	 * try-locks, so don't hold the lock while waiting for it. */
+	for (tries = 0; !ret && tries < 10; tries++) {
+		ret = thinkpad_ec_lock();
+		if (ret)
+			break;
+		ret = hdaps_get_ec_config(&ec_rate, &order);
+		thinkpad_ec_unlock();
+		if (ret != -EBUSY)
+			break;
+		pause_sbt("hdapsvf", 10 * SBT_1MS, 0, 0);
+		ret = 0;
+	}
+	if (!ret && (ec_rate != hdaps_rate*oversampling_ratio ||
+	    order != running_avg_filter_order))
+		ret = -EIO;
+
+	if (ret) {
+		hdaps_verify_failures++;
+		printf("hdaps: setup lost over resume (%d), reinitializing\n",
+		    ret);
+		hdaps_reinit(NULL, 0);
+	}
+	hdaps_pm_phase(HDAPS_PM_VERIFY, start);
+}
+
+static void hdaps_ec_reset(void *arg)
+{
+	taskqueue_enqueue(taskqueue_thread, &hdaps_reinit_task);
+}
+
 /**
  * hdaps_calibrate - set our "resting" values.
- * Does its own locking.
+ * The sampler does the work over the next hw.hdaps.calib.samples
+ * readouts; hw.hdaps.calibrate reads 1 until it is done.
  */
 static void hdaps_calibrate(void)
 {
-	needs_calibration = 1;
-	hdaps_update();
-	/* If that fails, the mousedev poll will take care of things later. */
+	atomic_store_rel_int(&needs_calibration, 1);
 }
 
-/* Timer handler for updating the input device. Runs in softirq context,
- * so avoid lenghty or blocking operations.
+/* Timer handler for updating the input device. Runs in softirq context
+ * with hdaps_co_mtx held, so avoid lenghty or blocking operations.
  */
 static void hdaps_mousedev_poll(void* args)
 {
+	struct thinkpad_ec_row data;
+	sbintime_t now = sbinuptime(), taken;
 	int ret;
 
+	hdaps_sampler_account(now);
 	stale_readout = 1;
+	SDT_PROBE0(hdaps, , poll, fire);
+
+	/* The last poll's readouts are still being drained */
+	if (atomic_load_acq_int(&hdaps_draining)) {
+		SDT_PROBE2(hdaps, , poll, skip, -EINPROGRESS, 0);
+		goto keep_active;
+	}
 
 	/* Cannot sleep.  Try nonblockingly.  If we fail, try again later. */
-	if (thinkpad_ec_try_lock())
+	if ((ret = thinkpad_ec_try_lock())) {
+		SDT_PROBE2(hdaps, , poll, skip, ret, 0);
 		goto keep_active;
+	}
 
-	ret = __hdaps_update(1); /* fast update, we're in softirq context */
+	ret = __hdaps_update(1, &data, &taken); /* fast update, we're in softirq context */
+	if (!ret) {
+		hdaps_publish_row(&data, taken);
+		hdaps_adapt(now);
+		if (hdaps_want_drain(&data))
+			hdaps_drain_start();
+	}
 	thinkpad_ec_unlock();
+	if (ret)
+		SDT_PROBE2(hdaps, , poll, skip, ret, 1);
 	/* Any of "successful", "not yet ready" and "not prefetched"? */
 	if (ret!=0 && ret!=-EBUSY && ret!=-ENOATTR) {
 		printf("hdaps: poll failed, disabling updates\n");
@@ -473,13 +1497,13 @@ static void hdaps_mousedev_poll(void* args)
 	}
 
 keep_active:
-	/* Even if we failed now, pos_x,y may have been updated earlier: */
+	/* Even if we failed now, the state may have been updated earlier: */
 
 	/* Retrun mouse movement */
 //	hdaps_mouse_report_pos(pos_x, pos_y);
 //	hdaps_joy_report_pos(pos_x - rest_x, pos_y - rest_y);
 //	hdaps_mouse_report_pos(pos_x - rest_x, pos_y - rest_y);
-	callout_reset(&hdaps_co, hz/sampling_rate, hdaps_mousedev_poll, NULL);
+	hdaps_sampler_arm();
 }
 
 /*********************
@@ -490,7 +1514,7 @@ keep_active:
 
 static int hdaps_sampling_rate_sysctlproc(SYSCTL_HANDLER_ARGS)
 {
-	int error = 0, rate;
+	int error = 0, idle, rate;
 
 	/* sysctl read or size requested */
 	error = SYSCTL_OUT(req, &sampling_rate, sizeof(sampling_rate));
@@ -502,43 +1526,73 @@ static int hdaps_sampling_rate_sysctlproc(SYSCTL_HANDLER_ARGS)
 		if (error)
 			return error;
 
-		if (rate > hz || rate < 1)
+		/* The EC takes its own rate, rate*oversampling_ratio, as
+		 * 16 bits and says if it can't do it. */
+		if (rate < 1 || rate > 0xFFFF / oversampling_ratio)
 			return (EINVAL);
 
-		if (rate != sampling_rate) {
+		/* The EC lock keeps hdaps_rate_switch() out, hdaps_co_mtx
+		 * the sampler. While idle, the new rate applies when we
+		 * wake up. */
+		error = thinkpad_ec_lock();
+		if (error)
+			return error;
+		mtx_lock(&hdaps_co_mtx);
+		idle = hdaps_idle;
+		mtx_unlock(&hdaps_co_mtx);
+		if (rate != sampling_rate && !idle) {
 			error = hdaps_set_ec_config(rate*oversampling_ratio, 
 					running_avg_filter_order);
-			if (error)
-				return error;
-
+			if (!error) {
+				mtx_lock(&hdaps_co_mtx);
+				hdaps_rate = rate;
+				hdaps_poll_last = 0;
+				mtx_unlock(&hdaps_co_mtx);
+			}
+		}
+		if (!error) {
 			sampling_rate = rate;
+			if (!idle)
+				hdaps_ec_good_note(rate*oversampling_ratio,
+				    running_avg_filter_order);
 		}
+		thinkpad_ec_unlock();
 	}
 
 	return error;
 }
 
 SYSCTL_PROC(_hw_hdaps, OID_AUTO, sampling_rate, CTLTYPE_INT|CTLFLAG_RW, NULL, 0, hdaps_sampling_rate_sysctlproc, "I", "sampling rate");
+SYSCTL_INT(_hw_hdaps, OID_AUTO, sampling_precision_us, CTLFLAG_RW, &sampling_precision_us, 0, "how late a poll may fire to coalesce with other timers (us)");
+SYSCTL_INT(_hw_hdaps, OID_AUTO, debug, CTLFLAG_RWTUN, &hdaps_debug, 0, "log EC config changes");
 
 static int hdaps_oversampling_ratio_sysctlproc(SYSCTL_HANDLER_ARGS)
 {
-	int error = 0, ratio, ec_rate, order;
+	int error = 0, ratio, ec_rate, order, rate;
 
 	if(req->oldptr) {
 		/* read */
+		error = thinkpad_ec_lock();
+		if (error)
+			return error;
 		error = hdaps_get_ec_config(&ec_rate, &order);
+		if (!error) {
+			mtx_lock(&hdaps_co_mtx);
+			rate = hdaps_rate;
+			mtx_unlock(&hdaps_co_mtx);
+			ratio = ec_rate / rate;
+			if (ratio > 0)
+				oversampling_ratio = ratio;
+			running_avg_filter_order = order;
+		}
+		thinkpad_ec_unlock();
 		if (error)
 			return error; /* EINVAL ??? */
-		
-		ratio = ec_rate / sampling_rate;
 	
 		error = SYSCTL_OUT(req, &ratio, sizeof(ratio));
 
 		if (error)
 			return error;
-		
-		oversampling_ratio = ratio;
-		running_avg_filter_order = order;
 
 	} else
 		error = SYSCTL_OUT(req,0,sizeof(oversampling_ratio));
@@ -551,17 +1605,29 @@ static int hdaps_oversampling_ratio_sysctlproc(SYSCTL_HANDLER_ARGS)
 		if (error)
 			return error;
 
-		if (ratio <1)
+		/* Both the rate we run at now and the one we go back to
+		 * must fit the EC's 16 bits, see sampling_rate. */
+		if (ratio < 1 || sampling_rate > 0xFFFF / ratio)
 			return (EINVAL);
 
-		 if (ratio != oversampling_ratio) {
-			error = hdaps_set_ec_config(sampling_rate*ratio, 
+		error = thinkpad_ec_lock();
+		if (error)
+			return error;
+		mtx_lock(&hdaps_co_mtx);
+		rate = hdaps_rate;
+		mtx_unlock(&hdaps_co_mtx);
+		if (rate > 0xFFFF / ratio)
+			error = EINVAL;
+		else if (ratio != oversampling_ratio) {
+			error = hdaps_set_ec_config(rate*ratio, 
 					running_avg_filter_order);
-			if (error)
-				return error;
-
-			oversampling_ratio = ratio;
+			if (!error) {
+				oversampling_ratio = ratio;
+				hdaps_ec_good_note(rate*ratio,
+				    running_avg_filter_order);
+			}
 		}
+		thinkpad_ec_unlock();
 	}
 
 	return error;
@@ -574,8 +1640,14 @@ static int hdaps_running_avg_filter_order_sysctlproc(SYSCTL_HANDLER_ARGS)
 	int error = 0, ec_rate, order, rate;
 
 	if(req->oldptr) {
-		/* read */
+		/* read; the rate stays ours, the sampler runs on it */
+		error = thinkpad_ec_lock();
+		if (error)
+			return error;
 		error = hdaps_get_ec_config(&ec_rate, &order);
+		if (!error)
+			running_avg_filter_order = order;
+		thinkpad_ec_unlock();
 		if (error)
 			return error; /* EINVAL ??? */
 		
@@ -583,13 +1655,6 @@ static int hdaps_running_avg_filter_order_sysctlproc(SYSCTL_HANDLER_ARGS)
 
 		if (error)
 			return error;
-		
-		running_avg_filter_order = order;
-
-		rate = ec_rate / oversampling_ratio;
-
-		if ( (rate <= hz) && (rate > 0) )
-			sampling_rate = rate;
 
 	} else
 		error = SYSCTL_OUT(req,0,sizeof(running_avg_filter_order));
@@ -602,15 +1667,22 @@ static int hdaps_running_avg_filter_order_sysctlproc(SYSCTL_HANDLER_ARGS)
 		if (error)
 			return error;
 
-		 if (order != running_avg_filter_order) {
-			error = hdaps_set_ec_config(
-					sampling_rate*oversampling_ratio, 
+		error = thinkpad_ec_lock();
+		if (error)
+			return error;
+		if (order != running_avg_filter_order) {
+			mtx_lock(&hdaps_co_mtx);
+			rate = hdaps_rate;
+			mtx_unlock(&hdaps_co_mtx);
+			error = hdaps_set_ec_config(rate*oversampling_ratio, 
 					order);
-			if (error)
-				return error;
-
-			running_avg_filter_order = order;
+			if (!error) {
+				running_avg_filter_order = order;
+				hdaps_ec_good_note(rate*oversampling_ratio,
+				    order);
+			}
 		}
+		thinkpad_ec_unlock();
 	}
 
 	return error; /* 0 */
@@ -635,14 +1707,17 @@ static int hdaps_fake_data_mode_sysctlproc(SYSCTL_HANDLER_ARGS)
 		if (on < 0 || on > 1)
 			return (EINVAL);
 
+		error = thinkpad_ec_lock();
+		if (error)
+			return error;
 		if (on!= fake_data_mode) {
 			error = hdaps_set_fake_data_mode(on);
-
-			if (error)
-				return error;
-
-			fake_data_mode = on;
+			if (!error) {
+				fake_data_mode = on;
+				hdaps_ec_good.fake = on;
+			}
 		}
+		thinkpad_ec_unlock();
 	}
 
 	return error;
@@ -683,7 +1758,8 @@ static int hdaps_calibrate_sysctlproc(SYSCTL_HANDLER_ARGS)
 	int error = 0, on;
 
 	/* sysctl read or size requested */
-	error = SYSCTL_OUT(req, &needs_calibration, sizeof(needs_calibration));
+	on = atomic_load_acq_int(&needs_calibration);
+	error = SYSCTL_OUT(req, &on, sizeof(on));
 	
 	if(!error && req->newptr) {
 		/* sysctl write */
@@ -705,17 +1781,18 @@ SYSCTL_PROC(_hw_hdaps, OID_AUTO, calibrate, CTLTYPE_INT|CTLFLAG_RW, NULL, 0, hda
 
 static int hdaps_mouse_activity_sysctlproc(SYSCTL_HANDLER_ARGS)
 {
+	struct hdaps_state st;
 	int error = 0, activity;
 
 	if (!req->oldptr)
 		return SYSCTL_OUT(req, 0, sizeof(activity));
 
-	error = hdaps_update();
+	error = hdaps_read_state(&st);
 	
 	if (error)
 		return error;
 
-	activity = ticks < last_mouse_ticks + KMACT_REMEMBER_PERIOD;
+	activity = ticks < st.mouse_ticks + KMACT_REMEMBER_PERIOD;
 
 	/* sysctl read or size requested */
 	return SYSCTL_OUT(req, &activity, sizeof(activity));
@@ -725,17 +1802,18 @@ SYSCTL_PROC(_hw_hdaps, OID_AUTO, mouse_activity, CTLTYPE_INT|CTLFLAG_RD, NULL, 0
 
 static int hdaps_keyboard_activity_sysctlproc(SYSCTL_HANDLER_ARGS)
 {
+	struct hdaps_state st;
 	int error = 0, activity;
 
 	if (!req->oldptr)
 		return SYSCTL_OUT(req, 0, sizeof(activity));
 
-	error = hdaps_update();
+	error = hdaps_read_state(&st);
 	
 	if (error)
 		return error;
 
-	activity = ticks < last_keyboard_ticks + KMACT_REMEMBER_PERIOD;
+	activity = ticks < st.keyboard_ticks + KMACT_REMEMBER_PERIOD;
 
 	/* sysctl read or size requested */
 	return SYSCTL_OUT(req, &activity, sizeof(activity));
@@ -745,35 +1823,38 @@ SYSCTL_PROC(_hw_hdaps, OID_AUTO, keyboard_activity, CTLTYPE_INT|CTLFLAG_RD, NULL
 
 static int hdaps_temp1_sysctlproc(SYSCTL_HANDLER_ARGS)
 {
+	struct hdaps_state st;
 	int error = 0;
 
 	if (!req->oldptr)
-		return SYSCTL_OUT(req, 0, sizeof(temperature));
+		return SYSCTL_OUT(req, 0, sizeof(st.temp));
 
-	error = hdaps_update();
+	error = hdaps_read_state(&st);
 	
 	if (error)
 		return error;
 
 	/* sysctl read or size requested */
-	return SYSCTL_OUT(req, &temperature, sizeof(temperature));
+	return SYSCTL_OUT(req, &st.temp, sizeof(st.temp));
 }
 
 SYSCTL_PROC(_hw_hdaps, OID_AUTO, temp1, CTLTYPE_INT|CTLFLAG_RD, NULL, 0, hdaps_temp1_sysctlproc, "I", "temperature");
 
 static int hdaps_position_sysctlproc(SYSCTL_HANDLER_ARGS)
 {
+	struct hdaps_sample sample;
 	int error = 0, position[2];
 
 	if (!req->oldptr)
 		return SYSCTL_OUT(req, 0, 2*sizeof(int));
 
-	error = hdaps_update();
+	/* filtered, if the sampler is running */
+	error = hdaps_get_sample(&sample);
 	if (error)
 		return error;
 
-	position[0] = pos_x;
-	position[1] = pos_y;
+	position[0] = sample.x;
+	position[1] = sample.y;
 
 	return SYSCTL_OUT(req, &position, 2*sizeof(int));
 }
@@ -782,10 +1863,12 @@ SYSCTL_PROC(_hw_hdaps, OID_AUTO, position, CTLTYPE_STRING|CTLFLAG_RD, NULL, 0, h
 
 static int hdaps_rest_position_sysctlproc(SYSCTL_HANDLER_ARGS)
 {
+	struct hdaps_state st;
 	int position[2];
 
-	position[0] = rest_x;
-	position[1] = rest_y;
+	hdaps_get_state(&st);
+	position[0] = st.rest_x;
+	position[1] = st.rest_y;
 	
 	return SYSCTL_OUT(req, &position, 2*sizeof(int));
 }
@@ -794,20 +1877,23 @@ SYSCTL_PROC(_hw_hdaps, OID_AUTO, rest_position, CTLTYPE_STRING|CTLFLAG_RD, NULL,
 
 static int hdaps_values_sysctlproc(SYSCTL_HANDLER_ARGS)
 {
+	struct hdaps_sample sample;
+	struct hdaps_state st;
 	int error = 0, values[5];
 
 	if (!req->oldptr)
 		return SYSCTL_OUT(req, 0, 5*sizeof(int));
 
-	error = hdaps_update();
+	error = hdaps_get_sample(&sample);
 	if (error)
 		return error;
+	hdaps_get_state(&st);
 
-	values[0] = pos_x;
-	values[1] = pos_y;
-	values[2] = temperature;
-	values[3] = ticks < last_keyboard_ticks + KMACT_REMEMBER_PERIOD;
-	values[4] = ticks < last_mouse_ticks + KMACT_REMEMBER_PERIOD;
+	values[0] = sample.x;
+	values[1] = sample.y;
+	values[2] = sample.temp;
+	values[3] = ticks < st.keyboard_ticks + KMACT_REMEMBER_PERIOD;
+	values[4] = ticks < st.mouse_ticks + KMACT_REMEMBER_PERIOD;
 	
 	return SYSCTL_OUT(req, &values, 5*sizeof(int));
 }
@@ -853,6 +1939,7 @@ static int hdaps_probe(device_t dev)
 
 static int hdaps_attach(device_t dev)
 {
+	int rest_x, rest_y;
 
 	/* FreeBSD DMI workaround */
 
@@ -875,18 +1962,35 @@ static int hdaps_attach(device_t dev)
 	}
 	
 	/* init callout */
-	callout_init(&hdaps_co, 0); /* mpsafe ? */
+	callout_init_mtx(&hdaps_co, &hdaps_co_mtx, 0);
 
-        /* calibration for the input device (deferred to avoid delay) */
-	needs_calibration = 1;
+	/* redo the setup if the EC recovers from a hang */
+	TASK_INIT(&hdaps_reinit_task, 0, hdaps_reinit, NULL);
+	TASK_INIT(&hdaps_rate_task, 0, hdaps_rate_switch, NULL);
+	TASK_INIT(&hdaps_verify_task, 0, hdaps_verify, NULL);
+	hdaps_reset_tag = EVENTHANDLER_REGISTER(thinkpad_ec_reset,
+	    hdaps_ec_reset, NULL, EVENTHANDLER_PRI_ANY);
+
+	/* rest position from the loader (hw.hdaps.rest_x, rest_y), else
+	 * calibrate as soon as sampling starts
+	 */
+	if (TUNABLE_INT_FETCH("hw.hdaps.rest_x", &rest_x) &&
+	    TUNABLE_INT_FETCH("hw.hdaps.rest_y", &rest_y)) {
+		hdaps_set_rest(rest_x, rest_y);
+		atomic_store_rel_int(&needs_calibration, 0);
+		printf("hdaps: rest position %d %d from loader\n",
+		    rest_x, rest_y);
+	} else
+		atomic_store_rel_int(&needs_calibration, 1);
 
 	/* create device */
 	//hdaps_mouse_make_dev();
 	hdaps_joy_make_dev();
 	hdaps_make_dev();
+	hdaps_shock_make_dev();
 
 	/* start timer */
-	callout_reset(&hdaps_co, hz/sampling_rate, hdaps_mousedev_poll, NULL);
+	hdaps_sampler_start();
 
         printf("hdaps: driver successfully loaded.\n");
 
@@ -896,10 +2000,16 @@ static int hdaps_attach(device_t dev)
 static int hdaps_detach(device_t dev)
 {
 	
-	callout_stop(&hdaps_co);
+	EVENTHANDLER_DEREGISTER(thinkpad_ec_reset, hdaps_reset_tag);
+	taskqueue_drain(taskqueue_thread, &hdaps_reinit_task);
+	taskqueue_drain(taskqueue_thread, &hdaps_verify_task);
+	hdaps_sampler_stop();
+	callout_drain(&hdaps_co);
+	taskqueue_drain(taskqueue_thread, &hdaps_rate_task);
 //	hdaps_mouse_destroy_dev();
 	hdaps_joy_destroy_dev();
 	hdaps_destroy_dev();
+	hdaps_shock_destroy_dev();
         hdaps_device_shutdown(); /* ignore errors, effect is negligible */
         printf("hdaps: driver unloaded.\n");
 	return 0;
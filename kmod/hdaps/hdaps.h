@@ -1,2 +1,29 @@
 int hdaps_update(void);
-extern int pos_x, pos_y, rest_x, rest_y;
+
+/* Latest accelerometer state, as one consistent snapshot */
+struct hdaps_state {
+	u_int seq;		/* readouts taken */
+	sbintime_t time;	/* of the latest readout, 0 if none */
+	int x, y;		/* position */
+	int temp;		/* temperature */
+	int kmact;		/* keyboard/mouse activity bits, as read */
+	int keyboard_ticks;	/* ticks at the last keyboard activity */
+	int mouse_ticks;	/* ticks at the last mouse activity */
+	int rest_x, rest_y;	/* calibrated rest position */
+};
+
+void hdaps_get_state(struct hdaps_state *st);
+int hdaps_read_state(struct hdaps_state *st);
+
+/* One accelerometer sample, as kept in the sample ring */
+struct hdaps_sample {
+	u_int seq;		/* sample number, 0 if not from the ring */
+	sbintime_t time;	/* when it was read */
+	int x, y;		/* position */
+	int temp;		/* temperature */
+	int kmact;		/* keyboard/mouse activity bits */
+};
+
+int hdaps_ring_latest(struct hdaps_sample *s);
+int hdaps_ring_next(u_int *cursor, struct hdaps_sample *s);
+int hdaps_get_sample(struct hdaps_sample *s);
@@ -27,6 +27,7 @@
 //SYSCTL_INT(_hw_hdaps, OID_AUTO, input_fuzz, CTLFLAG_RW, &input_fuzz, 0, "HDAPS input fuzz");
 
 static int state = 0;
+static u_int cursor;	/* last ring sample read */
 
 static struct cdev *hdapsdev;
 
@@ -52,6 +53,7 @@ hdaps_devopen(struct cdev *dev, int flag, int fmt, struct thread *td)
 		return (EBUSY);	
 
 	state |= FLAG_OPEN;
+	cursor = 0;
 
 	return 0;
 }
@@ -63,17 +65,23 @@ hdaps_devclose(struct cdev *dev, int flag, int fmt, struct thread *td)
 	return 0;
 };
 
+/* Each read returns the next sample the sampler took since the previous
+ * read, or a current one if there is none yet.
+ */
 static int
 hdaps_devread(struct cdev *dev, struct uio *uio, int flag)
 {
+	struct hdaps_sample sample;
 	int buf[2], error;
 
-	error = hdaps_update();
-	if (error)
-		return error;
+	if (hdaps_ring_next(&cursor, &sample)) {
+		error = hdaps_get_sample(&sample);
+		if (error)
+			return error;
+	}
 
-	buf[0] = pos_x;
-	buf[1] = pos_y;
+	buf[0] = sample.x;
+	buf[1] = sample.y;
 
 	error = uiomove(buf, sizeof(buf), uio);
 
@@ -0,0 +1,135 @@
+/*
+ * hdaps_filter.c - filter chain for hdaps samples, see hdaps_filter.h
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ *
+ * The sampler runs every sample through it before publishing, so all
+ * readers of the sample ring get filtered positions. Coefficients are
+ * set as strings of Q16 integers:
+ *	hw.hdaps.filter.biquad	"b0 b1 b2 a1 a2 ..." five per section
+ *	hw.hdaps.filter.fir	"t0 t1 ..." newest sample first
+ * An empty string removes that stage; by default both are empty and
+ * samples pass through unchanged. Coefficients beyond
+ * +-HDAPS_FILTER_COEF_MAX are refused.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/sysctl.h>
+#include "hdaps_filter.h"
+
+#define HDAPS_FILTER_STRLEN	256
+
+SYSCTL_DECL(_hw_hdaps);
+
+static struct hdaps_filter hdaps_filt;
+static struct mtx hdaps_filter_mtx;	/* guards hdaps_filt */
+MTX_SYSINIT(hdaps_filter, &hdaps_filter_mtx, "hdaps filter", MTX_DEF);
+
+static uint64_t hdaps_filtered;
+
+/**
+ * hdaps_filter_sample - filter one sample in place
+ * Sampler only, so samples come in order.
+ */
+void hdaps_filter_sample(int *x, int *y)
+{
+	mtx_lock(&hdaps_filter_mtx);
+	if (hdaps_filt.c.biquads > 0 || hdaps_filt.c.taps > 0) {
+		hdaps_filter_run(&hdaps_filt, x, y);
+		hdaps_filtered++;
+	}
+	mtx_unlock(&hdaps_filter_mtx);
+}
+
+/* Forget the history, e.g. after a gap in sampling */
+void hdaps_filter_reset(void)
+{
+	mtx_lock(&hdaps_filter_mtx);
+	hdaps_filt.primed = 0;
+	mtx_unlock(&hdaps_filter_mtx);
+}
+
+/* Parse up to @max coefficients separated by blanks or commas; returns
+ * how many, or -1 on junk, too many or one out of range.
+ */
+static int hdaps_filter_parse(const char *s, int32_t *v, int max)
+{
+	char *end;
+	long c;
+	int n = 0;
+
+	for (;;) {
+		while (*s == ' ' || *s == '\t' || *s == ',' || *s == '\n')
+			s++;
+		if (*s == '\0')
+			return n;
+		if (n == max)
+			return -1;
+		c = strtol(s, &end, 0);
+		if (end == s || c > HDAPS_FILTER_COEF_MAX ||
+		    c < -HDAPS_FILTER_COEF_MAX)
+			return -1;
+		v[n] = c;
+		s = end;
+		n++;
+	}
+}
+
+static void hdaps_filter_format(char *buf, const int32_t *v, int n)
+{
+	size_t len = 0;
+	int i;
+
+	buf[0] = '\0';
+	for (i = 0; i < n && len < HDAPS_FILTER_STRLEN; i++)
+		len += snprintf(buf + len, HDAPS_FILTER_STRLEN - len,
+		    i ? " %d" : "%d", v[i]);
+}
+
+/* arg2: 0 for the biquads, 1 for the FIR */
+static int hdaps_filter_sysctlproc(SYSCTL_HANDLER_ARGS)
+{
+	int32_t v[HDAPS_FILTER_BIQUADS * 5];
+	char buf[HDAPS_FILTER_STRLEN];
+	int error, n, max = arg2 ? HDAPS_FILTER_TAPS : HDAPS_FILTER_BIQUADS * 5;
+
+	mtx_lock(&hdaps_filter_mtx);
+	if (arg2)
+		hdaps_filter_format(buf, hdaps_filt.c.fir, hdaps_filt.c.taps);
+	else
+		hdaps_filter_format(buf, &hdaps_filt.c.bq[0][0],
+		    hdaps_filt.c.biquads * 5);
+	mtx_unlock(&hdaps_filter_mtx);
+
+	error = sysctl_handle_string(oidp, buf, sizeof(buf), req);
+	if (error || !req->newptr)
+		return error;
+
+	n = hdaps_filter_parse(buf, v, max);
+	if (n < 0 || (!arg2 && n % 5))
+		return EINVAL;
+
+	mtx_lock(&hdaps_filter_mtx);
+	if (arg2) {
+		memcpy(hdaps_filt.c.fir, v, n * sizeof(v[0]));
+		hdaps_filt.c.taps = n;
+	} else {
+		memcpy(hdaps_filt.c.bq, v, n * sizeof(v[0]));
+		hdaps_filt.c.biquads = n / 5;
+	}
+	hdaps_filt.primed = 0;
+	mtx_unlock(&hdaps_filter_mtx);
+	return 0;
+}
+
+SYSCTL_NODE(_hw_hdaps, OID_AUTO, filter, CTLFLAG_RD, NULL, "sample filter");
+SYSCTL_PROC(_hw_hdaps_filter, OID_AUTO, biquad, CTLTYPE_STRING|CTLFLAG_RW, NULL, 0, hdaps_filter_sysctlproc, "A", "biquad sections, b0 b1 b2 a1 a2 each (Q16)");
+SYSCTL_PROC(_hw_hdaps_filter, OID_AUTO, fir, CTLTYPE_STRING|CTLFLAG_RW, NULL, 1, hdaps_filter_sysctlproc, "A", "FIR taps, newest sample first (Q16)");
+SYSCTL_UQUAD(_hw_hdaps_filter, OID_AUTO, filtered, CTLFLAG_RD, &hdaps_filtered, 0, "samples filtered");
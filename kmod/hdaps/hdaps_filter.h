@@ -0,0 +1,146 @@
+/*
+ * hdaps_filter.h - fixed-point filter chain for the hdaps sampler
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ *
+ * Up to
+ * HDAPS_FILTER_BIQUADS biquad IIR sections followed by an FIR kernel of
+ * up to HDAPS_FILTER_TAPS taps, run on each axis separately.
+ *
+ * Coefficients are Q16 (65536 is 1.0). A section computes
+ *	y = b0*x + b1*x[-1] + b2*x[-2] - a1*y[-1] - a2*y[-2]
+ * in direct form I, and the FIR y = t0*x + t1*x[-1] + ... Values are
+ * kept with HDAPS_FILTER_FRAC extra fraction bits between stages, so
+ * narrow low-pass sections don't stall on rounding.
+ *
+ * Coefficients are limited to +-HDAPS_FILTER_COEF_MAX, so the 64 bit
+ * accumulators can't overflow; stage outputs saturate to 32 bits, which
+ * keeps an unstable section pinned at the rails instead of wrapping.
+ *
+ * The arithmetic is plain C here so that tool/hdapsfilter.c can time it
+ * outside the kernel.
+ */
+
+#ifndef _HDAPS_FILTER_H
+#define _HDAPS_FILTER_H
+
+#define HDAPS_FILTER_BIQUADS	4
+#define HDAPS_FILTER_TAPS	16
+#define HDAPS_FILTER_Q		16	/* coefficient fraction bits */
+#define HDAPS_FILTER_FRAC	8	/* sample fraction bits */
+#define HDAPS_FILTER_COEF_MAX	(1 << 24)	/* 256.0 */
+
+#define HDAPS_FILTER_VAL_MAX	0x7fffffff
+#define HDAPS_FILTER_VAL_MIN	(-HDAPS_FILTER_VAL_MAX - 1)
+
+struct hdaps_filter_coef {
+	int biquads;				/* sections in use */
+	int32_t bq[HDAPS_FILTER_BIQUADS][5];	/* b0 b1 b2 a1 a2 */
+	int taps;				/* FIR taps in use */
+	int32_t fir[HDAPS_FILTER_TAPS];
+};
+
+/* History of one axis */
+struct hdaps_filter_axis {
+	int32_t bq[HDAPS_FILTER_BIQUADS][4];	/* x1 x2 y1 y2 */
+	int32_t fir[HDAPS_FILTER_TAPS];		/* ring of inputs */
+	int fir_pos;
+};
+
+struct hdaps_filter {
+	struct hdaps_filter_coef c;
+	struct hdaps_filter_axis ax[2];
+	int primed;			/* history holds real samples */
+};
+
+/* Fill the history as if @v had always been the input, which is exact
+ * for filters with unity gain at DC (the smoothing ones); that way there
+ * is no step from zero when sampling starts.
+ */
+static __inline void
+hdaps_filter_prime_axis(struct hdaps_filter_axis *a, int32_t v, int taps)
+{
+	int i;
+
+	for (i = 0; i < HDAPS_FILTER_BIQUADS; i++)
+		a->bq[i][0] = a->bq[i][1] = a->bq[i][2] = a->bq[i][3] = v;
+	for (i = 0; i < taps; i++)
+		a->fir[i] = v;
+	a->fir_pos = 0;
+}
+
+/* Scale an accumulator back to a stage value, rounding and saturating */
+static __inline int32_t
+hdaps_filter_sat(int64_t acc)
+{
+	acc = (acc + (1 << (HDAPS_FILTER_Q - 1))) >> HDAPS_FILTER_Q;
+	if (acc > HDAPS_FILTER_VAL_MAX)
+		return HDAPS_FILTER_VAL_MAX;
+	if (acc < HDAPS_FILTER_VAL_MIN)
+		return HDAPS_FILTER_VAL_MIN;
+	return (int32_t)acc;
+}
+
+static __inline int
+hdaps_filter_axis_run(const struct hdaps_filter_coef *c,
+    struct hdaps_filter_axis *a, int in)
+{
+	const int32_t *k;
+	int32_t *h, v = in * (1 << HDAPS_FILTER_FRAC);
+	int64_t acc;
+	int i, j;
+
+	for (i = 0; i < c->biquads; i++) {
+		k = c->bq[i];
+		h = a->bq[i];
+		acc = (int64_t)k[0] * v + (int64_t)k[1] * h[0] +
+		    (int64_t)k[2] * h[1] - (int64_t)k[3] * h[2] -
+		    (int64_t)k[4] * h[3];
+		h[1] = h[0];
+		h[0] = v;
+		v = hdaps_filter_sat(acc);
+		h[3] = h[2];
+		h[2] = v;
+	}
+
+	if (c->taps > 0) {
+		a->fir[a->fir_pos] = v;
+		acc = 0;
+		j = a->fir_pos;
+		for (i = 0; i < c->taps; i++) {
+			acc += (int64_t)c->fir[i] * a->fir[j];
+			if (--j < 0)
+				j = c->taps - 1;
+		}
+		if (++a->fir_pos >= c->taps)
+			a->fir_pos = 0;
+		v = hdaps_filter_sat(acc);
+	}
+
+	return (int)(((int64_t)v + (1 << (HDAPS_FILTER_FRAC - 1))) >>
+	    HDAPS_FILTER_FRAC);
+}
+
+/* Run one sample through the chain, in place */
+static __inline void
+hdaps_filter_run(struct hdaps_filter *f, int *x, int *y)
+{
+	if (!f->primed) {
+		hdaps_filter_prime_axis(&f->ax[0],
+		    *x * (1 << HDAPS_FILTER_FRAC), f->c.taps);
+		hdaps_filter_prime_axis(&f->ax[1],
+		    *y * (1 << HDAPS_FILTER_FRAC), f->c.taps);
+		f->primed = 1;
+	}
+	*x = hdaps_filter_axis_run(&f->c, &f->ax[0], *x);
+	*y = hdaps_filter_axis_run(&f->c, &f->ax[1], *y);
+}
+
+#ifdef _KERNEL
+void hdaps_filter_sample(int *x, int *y);
+void hdaps_filter_reset(void);
+#endif
+
+#endif /* _HDAPS_FILTER_H */
@@ -18,13 +18,7 @@
 
 #define BUFSIZE	240
 
-SYSCTL_DECL(_hw_hdaps);
-
-static int input_fuzz = 4;
-SYSCTL_INT(_hw_hdaps, OID_AUTO, input_fuzz, CTLFLAG_RW, &input_fuzz, 0, "HDAPS input fuzz");
-
 static int state = 0;
-static int old_x, old_y;
 
 static struct cdev *joydev;
 
@@ -48,9 +42,6 @@ hdaps_joy_devopen(struct cdev *dev, int flag, int fmt, struct thread *td)
 {
 	if (state & FLAG_OPEN)
 		return (EBUSY);	
-	
-	old_x = pos_x;
-	old_y = pos_y;
 
 	state |= FLAG_OPEN;
 
@@ -64,54 +55,25 @@ hdaps_joy_devclose(struct cdev *dev, int flag, int fmt, struct thread *td)
 	state &= ~FLAG_OPEN;
 	return 0;
 };
-/**
-static void fuzz(int *value, int *old_value)
-{
 
-	if (input_fuzz) {
-		
-		if ( ( *value > *old_value - (input_fuzz >> 1)) && 
-		     ( *value < *old_value + (input_fuzz >> 1)))
-			return;
-
-		if ( (*value > *old_value - input_fuzz) &&
-		     (*value < *old_value + input_fuzz))
-			*value = (*old_value * 3 + *value) >> 2;
-
-		if ( (*value > *old_value - (input_fuzz << 1)) &&
-		     (*value < *old_value + (input_fuzz << 1)))
-			*value = (*old_value + *value) >> 1; 
-	}
-	
-	if ( *old_value == *value )
-		return;
-
-	*old_value = *value;
-}
-**/
 static int
 hdaps_joy_devread(struct cdev *dev, struct uio *uio, int flag)
 {
 
 	struct joystick joydata;
+	struct hdaps_sample sample;
 	int ret;
 
-	ret = hdaps_update();
+	ret = hdaps_get_sample(&sample);
 	if (ret)
 		return ret;
 
-	/* anti-jitter */
-
-	/* zero */
-
-	joydata.x = (old_x + pos_x) >> 1;
-	joydata.y = (old_y + pos_y) >> 1;
+	/* smoothing is up to hw.hdaps.filter */
+	joydata.x = sample.x;
+	joydata.y = sample.y;
 	joydata.b1 = 0;
 	joydata.b2 = 0;
 
-	old_x = pos_x;
-	old_y = pos_y;
-
 	return uiomove(&joydata, sizeof(struct joystick), uio);
 }
 
@@ -0,0 +1,128 @@
+/*
+ * hdaps_ring.h - sample ring between the hdaps sampler and its readers
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ *
+ * Every readout taken by the sampling callout is published here, so
+ * consumers get it without EC traffic or EC locks. There is one producer,
+ * the callout; readers never block it. Each slot is guarded by its own
+ * generation count, odd while the slot is being written, and a reader
+ * retries if the count changed under it. Sample n is in slot
+ * n % HDAPS_RING_LEN; head is the last sample published.
+ *
+ * The ring is plain C on the atomic(9) operations, with struct
+ * hdaps_sample from hdaps.h, so that test/test_ring.c can stress it
+ * outside the kernel.
+ */
+
+#ifndef _HDAPS_RING_H
+#define _HDAPS_RING_H
+
+#define HDAPS_RING_LEN	64	/* power of two */
+
+struct hdaps_ring_slot {
+	volatile u_int gen;
+	struct hdaps_sample s;
+};
+
+struct hdaps_ring {
+	struct hdaps_ring_slot slot[HDAPS_RING_LEN];
+	volatile u_int head;	/* 0: nothing published yet */
+	u_int overruns;		/* samples lost to slow readers */
+};
+
+/* Publish @s, setting its sequence number. Only the one producer may
+ * call this.
+ */
+static __inline void
+hdaps_ring_put(struct hdaps_ring *r, struct hdaps_sample *s)
+{
+	struct hdaps_ring_slot *slot;
+	u_int seq, gen;
+
+	seq = r->head + 1;
+	if (seq == 0)
+		seq = 1;	/* 0 means none */
+	s->seq = seq;
+	slot = &r->slot[seq & (HDAPS_RING_LEN - 1)];
+
+	gen = slot->gen;
+	atomic_store_rel_int(&slot->gen, gen + 1);
+	atomic_thread_fence_rel();
+	slot->s = *s;
+	atomic_store_rel_int(&slot->gen, gen + 2);
+
+	atomic_store_rel_int(&r->head, seq);
+}
+
+/* Copy sample @seq out of the ring; -EAGAIN if it was overwritten */
+static __inline int
+hdaps_ring_get(struct hdaps_ring *r, u_int seq, struct hdaps_sample *s)
+{
+	struct hdaps_ring_slot *slot = &r->slot[seq & (HDAPS_RING_LEN - 1)];
+	u_int gen;
+
+	for (;;) {
+		gen = atomic_load_acq_int(&slot->gen);
+		if (!(gen & 1)) {	/* else being written */
+			*s = slot->s;
+			atomic_thread_fence_acq();
+			if (slot->gen == gen)
+				break;
+		}
+		cpu_spinwait();
+	}
+	return s->seq == seq ? 0 : -EAGAIN;
+}
+
+/* The newest sample; -ENOENT if none was published yet */
+static __inline int
+hdaps_ring_newest(struct hdaps_ring *r, struct hdaps_sample *s)
+{
+	u_int seq;
+
+	do {
+		seq = atomic_load_acq_int(&r->head);
+		if (seq == 0)
+			return -ENOENT;
+	} while (hdaps_ring_get(r, seq, s));
+	return 0;
+}
+
+/* The sample after *@cursor, the last one seen (0 for none), which is
+ * advanced. Samples overwritten before being read are skipped and counted
+ * in overruns. -EAGAIN if there is no newer sample.
+ */
+static __inline int
+hdaps_ring_follow(struct hdaps_ring *r, u_int *cursor, struct hdaps_sample *s)
+{
+	u_int head, seq, lag;
+
+	for (;;) {
+		head = atomic_load_acq_int(&r->head);
+		if (head == 0 || head == *cursor)
+			return -EAGAIN;
+		if (*cursor == 0) {
+			seq = head;	/* new readers start at the newest */
+		} else {
+			seq = *cursor + 1;
+			/* the oldest slot may be rewritten right now */
+			lag = head - seq;
+			if (lag > HDAPS_RING_LEN - 2) {
+				atomic_add_int(&r->overruns,
+				    lag - (HDAPS_RING_LEN - 2));
+				seq = head - (HDAPS_RING_LEN - 2);
+			}
+		}
+		if (seq == 0)
+			seq = 1;
+		if (!hdaps_ring_get(r, seq, s)) {
+			*cursor = seq;
+			return 0;
+		}
+	}
+}
+
+#endif /* _HDAPS_RING_H */
@@ -0,0 +1,439 @@
+/*
+ * hdaps_shock.c - shock detection for hdaps
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ *
+ * Every sample the sampler takes goes through hdaps_shock_sample(). A
+ * sample is over the thresholds if it is more than hw.hdaps.shock.magnitude
+ * away from the rest position, or moved away from the sample before it
+ * faster than hw.hdaps.shock.jerk per second. Once samples stay over for
+ * hold_ms, a HDAPS_EVENT_SHOCK is posted; once they stay under for
+ * release_ms, a HDAPS_EVENT_RELEASE.
+ *
+ * The sensor only has X and Y, which read the zero g point both in free
+ * fall and lying flat. So a fall is only seen from a rest position away
+ * from it (freefall.zero_x, zero_y): samples that stay closer than
+ * freefall.band to the zero g point for freefall.ms are over the
+ * thresholds at once, without waiting for hold_ms.
+ *
+ * Events are read as struct hdaps_event from
+ * /dev/hdapsevent, which supports poll and kqueue; every open sees the
+ * events posted after it.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/malloc.h>
+#include <sys/proc.h>
+#include <sys/conf.h>
+#include <sys/selinfo.h>
+#include <sys/poll.h>
+#include <sys/event.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/uio.h>
+#include <sys/sysctl.h>
+#include "../thinkpad_ec.h"
+#include "hdaps.h"
+#include "hdaps_shock.h"
+
+#define DEVICE_NAME "hdapsevent"
+
+#define HDAPS_EVENTS_LEN	16	/* power of two */
+
+SYSCTL_DECL(_hw_hdaps);
+
+/* Configuration, read by the detector without locking: */
+static int shock_enable = 1;
+static int shock_magnitude = 30;	/* distance from rest */
+static int shock_jerk = 750;		/* speed between two samples, 1/s */
+static int shock_hold_ms = 0;
+static int shock_release_ms = 500;
+static int shock_ff_ms = 0;		/* free fall this long, 0 off */
+static int shock_ff_band = 10;		/* distance from the zero g point */
+static int shock_ff_zero_x = 500;	/* readout without gravity on X, Y */
+static int shock_ff_zero_y = 500;
+
+/* Detector state; only the sampler calls hdaps_shock_sample() */
+static int det_active;			/* between SHOCK and RELEASE */
+static int det_have_prev, det_prev_x, det_prev_y;
+static sbintime_t det_prev_time;
+static sbintime_t det_fall;		/* first sample falling, 0 none */
+static u_int det_cause;			/* causes seen since det_over */
+static sbintime_t det_over;		/* first sample over, 0 none */
+static sbintime_t det_under;		/* first sample under, 0 none */
+
+/* Posted events and statistics, under hdaps_shock_mtx: */
+static struct mtx hdaps_shock_mtx;
+static struct hdaps_event hdaps_events[HDAPS_EVENTS_LEN];
+static u_int hdaps_event_head;		/* seq of the last event posted */
+static int hdaps_shock_gone;		/* device being destroyed */
+static struct selinfo hdaps_shock_sel;
+static uint64_t shock_events;
+static uint64_t shock_overruns;
+static uint64_t shock_notify_max_ns;
+static uint64_t shock_notify_ns[TP_EC_HIST_BUCKETS];
+static uint64_t shock_deliver_max_ns;
+static uint64_t shock_deliver_ns[TP_EC_HIST_BUCKETS];
+
+SYSCTL_NODE(_hw_hdaps, OID_AUTO, shock, CTLFLAG_RD, NULL, "shock detection");
+SYSCTL_INT(_hw_hdaps_shock, OID_AUTO, enable, CTLFLAG_RW, &shock_enable, 0, "detect shocks");
+SYSCTL_INT(_hw_hdaps_shock, OID_AUTO, magnitude, CTLFLAG_RW, &shock_magnitude, 0, "distance from the rest position that counts as a shock");
+SYSCTL_INT(_hw_hdaps_shock, OID_AUTO, jerk, CTLFLAG_RW, &shock_jerk, 0, "distance per second between two samples that counts as a shock");
+SYSCTL_INT(_hw_hdaps_shock, OID_AUTO, hold_ms, CTLFLAG_RW, &shock_hold_ms, 0, "time over the thresholds before a shock event (ms)");
+SYSCTL_INT(_hw_hdaps_shock, OID_AUTO, release_ms, CTLFLAG_RW, &shock_release_ms, 0, "time under the thresholds before a release event (ms)");
+SYSCTL_NODE(_hw_hdaps_shock, OID_AUTO, freefall, CTLFLAG_RD, NULL, "free fall detection");
+SYSCTL_INT(_hw_hdaps_shock_freefall, OID_AUTO, ms, CTLFLAG_RW, &shock_ff_ms, 0, "time near the zero g point that counts as a fall (ms), 0 off");
+SYSCTL_INT(_hw_hdaps_shock_freefall, OID_AUTO, band, CTLFLAG_RW, &shock_ff_band, 0, "distance from the zero g point that counts as falling");
+SYSCTL_INT(_hw_hdaps_shock_freefall, OID_AUTO, zero_x, CTLFLAG_RW, &shock_ff_zero_x, 0, "X readout without gravity along X");
+SYSCTL_INT(_hw_hdaps_shock_freefall, OID_AUTO, zero_y, CTLFLAG_RW, &shock_ff_zero_y, 0, "Y readout without gravity along Y");
+SYSCTL_INT(_hw_hdaps_shock, OID_AUTO, active, CTLFLAG_RD, &det_active, 0, "a shock is in progress");
+SYSCTL_UQUAD(_hw_hdaps_shock, OID_AUTO, events, CTLFLAG_RD, &shock_events, 0, "events posted");
+SYSCTL_UQUAD(_hw_hdaps_shock, OID_AUTO, overruns, CTLFLAG_RD, &shock_overruns, 0, "events overwritten before a reader got them");
+SYSCTL_UQUAD(_hw_hdaps_shock, OID_AUTO, notify_max_ns, CTLFLAG_RD, &shock_notify_max_ns, 0, "longest time from sample to waking the waiters (ns)");
+SYSCTL_OPAQUE(_hw_hdaps_shock, OID_AUTO, notify_ns, CTLFLAG_RD, &shock_notify_ns, sizeof(shock_notify_ns), "QU", "log2 histogram of time from sample to waking the waiters (ns)");
+SYSCTL_UQUAD(_hw_hdaps_shock, OID_AUTO, deliver_max_ns, CTLFLAG_RD, &shock_deliver_max_ns, 0, "longest time from sample to read() (ns)");
+SYSCTL_OPAQUE(_hw_hdaps_shock, OID_AUTO, deliver_ns, CTLFLAG_RD, &shock_deliver_ns, sizeof(shock_deliver_ns), "QU", "log2 histogram of time from sample to read() (ns)");
+
+/* Count a latency. hdaps_shock_mtx held. */
+static void hdaps_shock_hist(uint64_t *hist, uint64_t *max, int64_t ns)
+{
+	int bucket;
+
+	if (ns < 0)
+		ns = 0;
+	if ((uint64_t)ns > *max)
+		*max = ns;
+	bucket = flsll(ns);
+	if (bucket >= TP_EC_HIST_BUCKETS)
+		bucket = TP_EC_HIST_BUCKETS - 1;
+	hist[bucket]++;
+}
+
+static void hdaps_shock_post(u_int type, u_int cause,
+			     const struct hdaps_sample *s)
+{
+	struct hdaps_event *ev;
+
+	mtx_lock(&hdaps_shock_mtx);
+	hdaps_event_head++;
+	ev = &hdaps_events[hdaps_event_head & (HDAPS_EVENTS_LEN - 1)];
+	ev->seq = hdaps_event_head;
+	ev->type = type;
+	ev->cause = cause;
+	ev->sample = s->seq;
+	ev->time_ns = sbttons(s->time);
+	ev->x = s->x;
+	ev->y = s->y;
+	shock_events++;
+	wakeup(&hdaps_event_head);
+	KNOTE_LOCKED(&hdaps_shock_sel.si_note, 0);
+	mtx_unlock(&hdaps_shock_mtx);
+	selwakeuppri(&hdaps_shock_sel, PZERO);
+
+	mtx_lock(&hdaps_shock_mtx);
+	hdaps_shock_hist(shock_notify_ns, &shock_notify_max_ns,
+	    sbttons(sbinuptime() - s->time));
+	mtx_unlock(&hdaps_shock_mtx);
+}
+
+static int hdaps_shock_over(int dx, int dy, int limit)
+{
+	return (int64_t)dx * dx + (int64_t)dy * dy >=
+	    (int64_t)limit * limit;
+}
+
+/* Did the sample move faster than hw.hdaps.shock.jerk from the previous? */
+static int hdaps_shock_jerk(const struct hdaps_sample *s)
+{
+	sbintime_t dt = s->time - det_prev_time;
+	int64_t limit;
+
+	if (!det_have_prev || dt <= 0 || dt > 10 * SBT_1S || shock_jerk <= 0)
+		return 0;
+	/* the distance allowed in dt, at least 1; readouts are 16 bits */
+	limit = ((int64_t)shock_jerk * sbttous(dt) + 500000) / 1000000;
+	if (limit < 1)
+		limit = 1;
+	if (limit > 0xFFFF)
+		return 0;
+	return hdaps_shock_over(s->x - det_prev_x, s->y - det_prev_y, limit);
+}
+
+/* Has the sample been closer than hw.hdaps.shock.freefall.band to the
+ * zero g point for freefall.ms? Never from a rest position within twice
+ * the band of it, where the machine would look the same.
+ */
+static int hdaps_shock_fall(const struct hdaps_sample *s, int rest_x,
+			    int rest_y)
+{
+	if (shock_ff_ms <= 0 ||
+	    hdaps_shock_over(s->x - shock_ff_zero_x, s->y - shock_ff_zero_y,
+		shock_ff_band) ||
+	    !hdaps_shock_over(rest_x - shock_ff_zero_x,
+		rest_y - shock_ff_zero_y, 2 * shock_ff_band)) {
+		det_fall = 0;
+		return 0;
+	}
+	if (!det_fall)
+		det_fall = s->time;
+	return s->time - det_fall >= mstosbt(shock_ff_ms);
+}
+
+/**
+ * hdaps_shock_pause - skip a sample, there being no rest position yet
+ *
+ * Called by the sampler instead of hdaps_shock_sample() while the rest
+ * position is being calibrated. Detection picks up afresh with the next
+ * sample; a shock in progress is still released by that one.
+ */
+void hdaps_shock_pause(void)
+{
+	det_have_prev = 0;
+	det_over = det_under = det_fall = 0;
+}
+
+/**
+ * hdaps_shock_sample - run the detector on a new sample
+ * @s: the sample, as published in the sample ring
+ * @rest_x, @rest_y: the rest position
+ *
+ * Sampler only: the callout or the queue drain, never both at once.
+ */
+void hdaps_shock_sample(const struct hdaps_sample *s, int rest_x, int rest_y)
+{
+	u_int cause = 0;
+
+	if (!shock_enable) {
+		det_active = det_have_prev = 0;
+		det_over = det_under = det_fall = 0;
+		return;
+	}
+
+	if (hdaps_shock_over(s->x - rest_x, s->y - rest_y, shock_magnitude))
+		cause |= HDAPS_CAUSE_MAGNITUDE;
+	if (hdaps_shock_jerk(s))
+		cause |= HDAPS_CAUSE_JERK;
+	if (hdaps_shock_fall(s, rest_x, rest_y))
+		cause |= HDAPS_CAUSE_FREEFALL;
+	det_prev_x = s->x;
+	det_prev_y = s->y;
+	det_prev_time = s->time;
+	det_have_prev = 1;
+
+	if (!det_active) {
+		if (!cause) {
+			det_over = 0;
+			return;
+		}
+		if (!det_over) {
+			det_over = s->time;
+			det_cause = 0;
+		}
+		det_cause |= cause;
+		if (s->time - det_over >= mstosbt(shock_hold_ms) ||
+		    (cause & HDAPS_CAUSE_FREEFALL)) {
+			det_active = 1;
+			det_under = 0;
+			hdaps_shock_post(HDAPS_EVENT_SHOCK, det_cause, s);
+		}
+	} else {
+		if (cause) {
+			det_under = 0;
+			return;
+		}
+		if (!det_under)
+			det_under = s->time;
+		if (s->time - det_under >= mstosbt(shock_release_ms)) {
+			det_active = 0;
+			det_over = 0;
+			hdaps_shock_post(HDAPS_EVENT_RELEASE, 0, s);
+		}
+	}
+}
+
+/*
+ * /dev/hdapsevent
+ */
+
+struct hdaps_shock_reader {
+	u_int cursor;		/* seq of the last event read */
+};
+
+static struct cdev *shockdev;
+
+static d_open_t		hdaps_shock_devopen;
+static d_read_t		hdaps_shock_devread;
+static d_poll_t		hdaps_shock_devpoll;
+static d_kqfilter_t	hdaps_shock_devkqfilter;
+
+static struct cdevsw hdaps_shock_devsw = {
+	.d_version = 	D_VERSION,
+	.d_open = 	hdaps_shock_devopen,
+	.d_read =	hdaps_shock_devread,
+	.d_poll =	hdaps_shock_devpoll,
+	.d_kqfilter =	hdaps_shock_devkqfilter,
+	.d_name =	DEVICE_NAME,
+};
+
+static void hdaps_shock_filt_detach(struct knote *kn);
+static int hdaps_shock_filt_read(struct knote *kn, long hint);
+
+static struct filterops hdaps_shock_filterops = {
+	.f_isfd =	1,
+	.f_detach =	hdaps_shock_filt_detach,
+	.f_event =	hdaps_shock_filt_read,
+};
+
+static void hdaps_shock_dtor(void *data)
+{
+	free(data, M_DEVBUF);
+}
+
+static int
+hdaps_shock_devopen(struct cdev *dev, int flag, int fmt, struct thread *td)
+{
+	struct hdaps_shock_reader *r;
+	int error;
+
+	r = malloc(sizeof(*r), M_DEVBUF, M_WAITOK | M_ZERO);
+	mtx_lock(&hdaps_shock_mtx);
+	r->cursor = hdaps_event_head;
+	mtx_unlock(&hdaps_shock_mtx);
+	error = devfs_set_cdevpriv(r, hdaps_shock_dtor);
+	if (error)
+		free(r, M_DEVBUF);
+	return error;
+}
+
+/* Each read returns whole events, blocking until there is one */
+static int
+hdaps_shock_devread(struct cdev *dev, struct uio *uio, int flag)
+{
+	struct hdaps_event buf[HDAPS_EVENTS_LEN];
+	struct hdaps_shock_reader *r;
+	int64_t now;
+	int error, n;
+
+	error = devfs_get_cdevpriv((void **)&r);
+	if (error)
+		return error;
+	if (uio->uio_resid < sizeof(buf[0]))
+		return EINVAL;
+
+	mtx_lock(&hdaps_shock_mtx);
+	while (r->cursor == hdaps_event_head) {
+		if (hdaps_shock_gone)
+			error = ENXIO;
+		else if (flag & IO_NDELAY)
+			error = EWOULDBLOCK;
+		else
+			error = mtx_sleep(&hdaps_event_head, &hdaps_shock_mtx,
+			    PZERO | PCATCH, "hdapsev", 0);
+		if (error) {
+			mtx_unlock(&hdaps_shock_mtx);
+			return error;
+		}
+	}
+	if (hdaps_event_head - r->cursor > HDAPS_EVENTS_LEN) {
+		shock_overruns += hdaps_event_head - r->cursor -
+		    HDAPS_EVENTS_LEN;
+		r->cursor = hdaps_event_head - HDAPS_EVENTS_LEN;
+	}
+	now = sbttons(sbinuptime());
+	for (n = 0; r->cursor != hdaps_event_head &&
+	    (n + 1) * sizeof(buf[0]) <= uio->uio_resid; n++) {
+		r->cursor++;
+		buf[n] = hdaps_events[r->cursor & (HDAPS_EVENTS_LEN - 1)];
+		hdaps_shock_hist(shock_deliver_ns, &shock_deliver_max_ns,
+		    now - buf[n].time_ns);
+	}
+	mtx_unlock(&hdaps_shock_mtx);
+
+	return uiomove(buf, n * sizeof(buf[0]), uio);
+}
+
+static int
+hdaps_shock_devpoll(struct cdev *dev, int events, struct thread *td)
+{
+	struct hdaps_shock_reader *r;
+	int revents = 0;
+
+	if (devfs_get_cdevpriv((void **)&r))
+		return events & (POLLIN | POLLRDNORM);
+
+	if (events & (POLLIN | POLLRDNORM)) {
+		mtx_lock(&hdaps_shock_mtx);
+		if (r->cursor != hdaps_event_head)
+			revents |= events & (POLLIN | POLLRDNORM);
+		else
+			selrecord(td, &hdaps_shock_sel);
+		mtx_unlock(&hdaps_shock_mtx);
+	}
+
+	return (revents);
+}
+
+static int
+hdaps_shock_devkqfilter(struct cdev *dev, struct knote *kn)
+{
+	struct hdaps_shock_reader *r;
+	int error;
+
+	if (kn->kn_filter != EVFILT_READ)
+		return EINVAL;
+	error = devfs_get_cdevpriv((void **)&r);
+	if (error)
+		return error;
+
+	kn->kn_fop = &hdaps_shock_filterops;
+	kn->kn_hook = r;
+	knlist_add(&hdaps_shock_sel.si_note, kn, 0);
+	return 0;
+}
+
+static void hdaps_shock_filt_detach(struct knote *kn)
+{
+	knlist_remove(&hdaps_shock_sel.si_note, kn, 0);
+}
+
+/* hdaps_shock_mtx held; kn_data is the number of bytes to read */
+static int hdaps_shock_filt_read(struct knote *kn, long hint)
+{
+	struct hdaps_shock_reader *r = kn->kn_hook;
+	u_int n;
+
+	n = hdaps_event_head - r->cursor;
+	if (n > HDAPS_EVENTS_LEN)
+		n = HDAPS_EVENTS_LEN;
+	kn->kn_data = n * sizeof(struct hdaps_event);
+	return n > 0;
+}
+
+void hdaps_shock_make_dev(void)
+{
+	mtx_init(&hdaps_shock_mtx, "hdapsshock", NULL, MTX_DEF);
+	knlist_init_mtx(&hdaps_shock_sel.si_note, &hdaps_shock_mtx);
+	hdaps_shock_gone = 0;
+
+	shockdev = make_dev(&hdaps_shock_devsw, 0, UID_ROOT, GID_WHEEL, 0600, DEVICE_NAME);
+}
+
+/* The sampler must be stopped */
+void hdaps_shock_destroy_dev(void)
+{
+	mtx_lock(&hdaps_shock_mtx);
+	hdaps_shock_gone = 1;
+	wakeup(&hdaps_event_head);
+	mtx_unlock(&hdaps_shock_mtx);
+
+	destroy_dev(shockdev);
+	seldrain(&hdaps_shock_sel);
+	knlist_clear(&hdaps_shock_sel.si_note, 0);
+	knlist_destroy(&hdaps_shock_sel.si_note);
+	mtx_destroy(&hdaps_shock_mtx);
+}
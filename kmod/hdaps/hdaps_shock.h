@@ -0,0 +1,37 @@
+/*
+ * hdaps_shock.h - shock events, as read from /dev/hdapsevent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+
+#ifndef _HDAPS_SHOCK_H
+#define _HDAPS_SHOCK_H
+
+struct hdaps_event {
+	u_int seq;		/* event number */
+	u_int type;		/* HDAPS_EVENT_* */
+	u_int cause;		/* HDAPS_CAUSE_* bits that triggered it */
+	u_int sample;		/* ring sequence number of that sample */
+	int64_t time_ns;	/* when that sample was read, uptime */
+	int x, y;		/* its position */
+};
+
+#define HDAPS_EVENT_SHOCK	1	/* thresholds crossed for hold_ms */
+#define HDAPS_EVENT_RELEASE	2	/* back below them for release_ms */
+
+#define HDAPS_CAUSE_MAGNITUDE	0x01	/* too far from the rest position */
+#define HDAPS_CAUSE_JERK	0x02	/* too fast from the previous sample */
+#define HDAPS_CAUSE_FREEFALL	0x04	/* near the zero g point for a while */
+
+#ifdef _KERNEL
+struct hdaps_sample;
+
+void hdaps_shock_sample(const struct hdaps_sample *s, int rest_x, int rest_y);
+void hdaps_shock_pause(void);
+void hdaps_shock_make_dev(void);
+void hdaps_shock_destroy_dev(void);
+#endif
+
+#endif /* _HDAPS_SHOCK_H */
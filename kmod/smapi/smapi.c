@@ -0,0 +1,345 @@
+/*
+ *  smapi.c - ThinkPad battery status through the embedded controller
+ *
+ *  A FreeBSD counterpart of the battery part of the Linux tp_smapi
+ *  driver, built on thinkpad_ec. The battery rows are read in the
+ *  background at a bounded rate and kept in a cache; the hw.smapi
+ *  sysctls only ever return the cached values, so reading them never
+ *  touches the EC.
+ *
+ *  Battery rows are requested with TWR0 = command, TWR15 = battery
+ *  (0 or 1) and come back as:
+ *	0x01 status	[0x1]    state: bit 7 installed, 0xc0 idle,
+ *				 0xd0 discharging, 0xe0 charging
+ *			[0x6..7] voltage (mV)
+ *			[0x8..9] current (mA, signed, < 0 discharging)
+ *			[0xa..b] average current (mA, signed)
+ *			[0xc..d] remaining charge (%)
+ *	0x02 capacity	[0x2..3] last full capacity (10 mWh)
+ *			[0x4..5] remaining capacity (10 mWh)
+ *			[0x6..7] time to full (min, 0xffff n/a)
+ *			[0x8..9] time to empty (min, 0xffff n/a)
+ *			[0xc..d] cycle count
+ *	0x03 design	[0x2..3] design capacity (10 mWh)
+ *			[0x4..5] design voltage (mV)
+ *			[0x8..9] manufacture date, (year-1980)<<9|month<<5|day
+ *			[0xa..b] serial number
+ *  All values little endian.
+ *
+ *  Charge thresholds are set through the SMAPI BIOS, not the EC, and are
+ *  not supported.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <sys/types.h>
+
+#include <sys/param.h>
+#include <sys/kernel.h>
+#include <sys/bus.h>
+#include <sys/module.h>
+#include <sys/systm.h>
+#include <sys/taskqueue.h>
+
+#include <sys/sysctl.h>
+
+#include "../thinkpad_ec.h"
+
+#define DEVICE_NAME	"smapi"
+
+#define SMAPI_NBAT		2
+#define SMAPI_CMD_STATUS	0x01
+#define SMAPI_CMD_CAPACITY	0x02
+#define SMAPI_CMD_DESIGN	0x03
+
+#define SMAPI_REFRESH_MS	5000	/* default cache refresh period */
+#define SMAPI_REFRESH_MIN_MS	1000	/* never read the EC more often */
+#define SMAPI_REFRESH_MAX_MS	3600000
+
+/* Cached battery state. Written by the refresh task only. */
+struct smapi_bat {
+	int present;
+	int state;		/* status row byte 0x1 */
+	int voltage;		/* mV */
+	int current_now;	/* mA */
+	int current_avg;	/* mA */
+	int remaining_percent;
+	int remaining_capacity;	/* mWh */
+	int last_full_capacity;	/* mWh */
+	int charging_time;	/* min, -1 n/a */
+	int running_time;	/* min, -1 n/a */
+	int cycle_count;
+	int design_valid;	/* design row read since the battery came */
+	int design_capacity;	/* mWh */
+	int design_voltage;	/* mV */
+	int manufacture_date;	/* YYYYMMDD */
+	int serial;
+	int age_ms;		/* cache age at the last refresh attempt */
+	sbintime_t updated;
+};
+
+static struct smapi_bat smapi_bats[SMAPI_NBAT];
+static struct timeout_task smapi_refresh_task;
+static int smapi_refresh_ms = SMAPI_REFRESH_MS;
+static int smapi_detaching;
+static uint64_t smapi_refreshes;	/* completed refreshes */
+static uint64_t smapi_errors;		/* failed battery rows */
+
+static devclass_t smapi_devclass;
+
+static int smapi_u16(const struct thinkpad_ec_row *data, int i)
+{
+	return data->val[i] | (data->val[i+1] << 8);
+}
+
+static int smapi_s16(const struct thinkpad_ec_row *data, int i)
+{
+	return (int16_t)smapi_u16(data, i);
+}
+
+static void smapi_bat_req(struct thinkpad_ec_req *req, int cmd, int bat)
+{
+	bzero(req, sizeof(*req));
+	req->args.mask = 0x8001;
+	req->args.val[0x0] = cmd;
+	req->args.val[0xF] = bat;
+	req->data.mask = 0xFFFF;
+	req->prio = TP_EC_PRIO_BACKGROUND;	/* sampling goes first */
+}
+
+/* Read the rows of one battery into its cache entry. The rows are queued
+ * together and served by the EC worker between accelerometer samples; the
+ * EC client lock is not taken, so the sampler never skips on our account.
+ */
+static int smapi_read_bat(int bat)
+{
+	struct smapi_bat *b = &smapi_bats[bat];
+	struct thinkpad_ec_req req[3];
+	int i, n, ret, err[3];
+
+	smapi_bat_req(&req[0], SMAPI_CMD_STATUS, bat);
+	smapi_bat_req(&req[1], SMAPI_CMD_CAPACITY, bat);
+	smapi_bat_req(&req[2], SMAPI_CMD_DESIGN, bat);
+	n = b->design_valid ? 2 : 3;
+
+	for (i = 0; i < n; i++)
+		err[i] = thinkpad_ec_submit(&req[i]);
+	for (i = 0; i < n; i++)
+		if (!err[i])
+			err[i] = thinkpad_ec_wait(&req[i]);
+	for (ret = 0, i = 0; i < n; i++)
+		if (err[i]) {
+			smapi_errors++;
+			ret = err[i];
+		}
+	if (ret)
+		return ret;
+
+	b->state = req[0].data.val[0x1];
+	b->present = (b->state & 0x80) != 0;
+	if (!b->present) {
+		b->design_valid = 0;
+		b->updated = sbinuptime();
+		return 0;
+	}
+	b->voltage = smapi_u16(&req[0].data, 0x6);
+	b->current_now = smapi_s16(&req[0].data, 0x8);
+	b->current_avg = smapi_s16(&req[0].data, 0xa);
+	b->remaining_percent = smapi_u16(&req[0].data, 0xc);
+
+	b->last_full_capacity = smapi_u16(&req[1].data, 0x2) * 10;
+	b->remaining_capacity = smapi_u16(&req[1].data, 0x4) * 10;
+	b->charging_time = smapi_u16(&req[1].data, 0x6);
+	if (b->charging_time == 0xffff)
+		b->charging_time = -1;
+	b->running_time = smapi_u16(&req[1].data, 0x8);
+	if (b->running_time == 0xffff)
+		b->running_time = -1;
+	b->cycle_count = smapi_u16(&req[1].data, 0xc);
+
+	if (n == 3) {
+		b->design_capacity = smapi_u16(&req[2].data, 0x2) * 10;
+		b->design_voltage = smapi_u16(&req[2].data, 0x4);
+		i = smapi_u16(&req[2].data, 0x8);
+		b->manufacture_date = ((i >> 9) + 1980) * 10000 +
+		    ((i >> 5) & 0xf) * 100 + (i & 0x1f);
+		b->serial = smapi_u16(&req[2].data, 0xa);
+		b->design_valid = 1;
+	}
+	b->updated = sbinuptime();
+	return 0;
+}
+
+/* Background refresh of the cache, once per hw.smapi.refresh_ms */
+static void smapi_refresh(void *context, int pending)
+{
+	int bat, ms;
+
+	for (bat = 0; bat < SMAPI_NBAT; bat++) {
+		smapi_read_bat(bat);
+		smapi_bats[bat].age_ms = smapi_bats[bat].updated == 0 ? -1 :
+		    (sbinuptime() - smapi_bats[bat].updated) / SBT_1MS;
+	}
+	smapi_refreshes++;
+
+	ms = smapi_refresh_ms;
+	if (!smapi_detaching)
+		taskqueue_enqueue_timeout(taskqueue_thread, &smapi_refresh_task,
+		    MAX(1, (int64_t)ms * hz / 1000));
+}
+
+/*********************
+ *
+ * SYSCTL functions
+ *
+ */
+
+SYSCTL_NODE(_hw, OID_AUTO, smapi, CTLFLAG_RD, NULL, "ThinkPad battery status");
+
+static int smapi_refresh_ms_sysctlproc(SYSCTL_HANDLER_ARGS)
+{
+	int error, ms;
+
+	ms = smapi_refresh_ms;
+	error = sysctl_handle_int(oidp, &ms, 0, req);
+	if (error || req->newptr == NULL)
+		return error;
+	if (ms < SMAPI_REFRESH_MIN_MS || ms > SMAPI_REFRESH_MAX_MS)
+		return EINVAL;
+	smapi_refresh_ms = ms;
+	return 0;
+}
+
+static int smapi_state_sysctlproc(SYSCTL_HANDLER_ARGS)
+{
+	struct smapi_bat *b = &smapi_bats[arg2];
+	char buf[16];
+	const char *txt;
+
+	if (!b->present)
+		txt = "none";
+	else switch (b->state & 0xf0) {
+	case 0xc0:
+		txt = "idle";
+		break;
+	case 0xd0:
+		txt = "discharging";
+		break;
+	case 0xe0:
+		txt = "charging";
+		break;
+	default:
+		snprintf(buf, sizeof(buf), "unknown 0x%02x", b->state);
+		txt = buf;
+	}
+	return sysctl_handle_string(oidp, __DECONST(char *, txt), 0, req);
+}
+
+SYSCTL_PROC(_hw_smapi, OID_AUTO, refresh_ms, CTLTYPE_INT|CTLFLAG_RW, NULL, 0, smapi_refresh_ms_sysctlproc, "I", "battery cache refresh period (ms)");
+SYSCTL_UQUAD(_hw_smapi, OID_AUTO, refreshes, CTLFLAG_RD, &smapi_refreshes, 0, "battery cache refreshes");
+SYSCTL_UQUAD(_hw_smapi, OID_AUTO, errors, CTLFLAG_RD, &smapi_errors, 0, "battery rows that failed");
+
+#define SMAPI_BAT_SYSCTLS(n) \
+SYSCTL_NODE(_hw_smapi, OID_AUTO, bat##n, CTLFLAG_RD, NULL, "battery " #n); \
+SYSCTL_PROC(_hw_smapi_bat##n, OID_AUTO, state, CTLTYPE_STRING|CTLFLAG_RD, NULL, n, smapi_state_sysctlproc, "A", "none, idle, charging or discharging"); \
+SYSCTL_INT(_hw_smapi_bat##n, OID_AUTO, installed, CTLFLAG_RD, &smapi_bats[n].present, 0, "battery installed"); \
+SYSCTL_INT(_hw_smapi_bat##n, OID_AUTO, voltage, CTLFLAG_RD, &smapi_bats[n].voltage, 0, "voltage (mV)"); \
+SYSCTL_INT(_hw_smapi_bat##n, OID_AUTO, current_now, CTLFLAG_RD, &smapi_bats[n].current_now, 0, "current (mA)"); \
+SYSCTL_INT(_hw_smapi_bat##n, OID_AUTO, current_avg, CTLFLAG_RD, &smapi_bats[n].current_avg, 0, "average current (mA)"); \
+SYSCTL_INT(_hw_smapi_bat##n, OID_AUTO, remaining_percent, CTLFLAG_RD, &smapi_bats[n].remaining_percent, 0, "remaining charge (%)"); \
+SYSCTL_INT(_hw_smapi_bat##n, OID_AUTO, remaining_capacity, CTLFLAG_RD, &smapi_bats[n].remaining_capacity, 0, "remaining capacity (mWh)"); \
+SYSCTL_INT(_hw_smapi_bat##n, OID_AUTO, last_full_capacity, CTLFLAG_RD, &smapi_bats[n].last_full_capacity, 0, "last full capacity (mWh)"); \
+SYSCTL_INT(_hw_smapi_bat##n, OID_AUTO, remaining_charging_time, CTLFLAG_RD, &smapi_bats[n].charging_time, 0, "time to full (min, -1 n/a)"); \
+SYSCTL_INT(_hw_smapi_bat##n, OID_AUTO, remaining_running_time, CTLFLAG_RD, &smapi_bats[n].running_time, 0, "time to empty (min, -1 n/a)"); \
+SYSCTL_INT(_hw_smapi_bat##n, OID_AUTO, cycle_count, CTLFLAG_RD, &smapi_bats[n].cycle_count, 0, "charge cycles"); \
+SYSCTL_INT(_hw_smapi_bat##n, OID_AUTO, design_capacity, CTLFLAG_RD, &smapi_bats[n].design_capacity, 0, "design capacity (mWh)"); \
+SYSCTL_INT(_hw_smapi_bat##n, OID_AUTO, design_voltage, CTLFLAG_RD, &smapi_bats[n].design_voltage, 0, "design voltage (mV)"); \
+SYSCTL_INT(_hw_smapi_bat##n, OID_AUTO, manufacture_date, CTLFLAG_RD, &smapi_bats[n].manufacture_date, 0, "manufacture date (YYYYMMDD)"); \
+SYSCTL_INT(_hw_smapi_bat##n, OID_AUTO, serial, CTLFLAG_RD, &smapi_bats[n].serial, 0, "serial number"); \
+SYSCTL_INT(_hw_smapi_bat##n, OID_AUTO, age_ms, CTLFLAG_RD, &smapi_bats[n].age_ms, 0, "age of these values at the last refresh (ms, -1 never read)")
+
+SMAPI_BAT_SYSCTLS(0);
+SMAPI_BAT_SYSCTLS(1);
+
+/* Device model stuff */
+
+static void smapi_identify(driver_t *driver, device_t parent)
+{
+	if (device_find_child(parent, DEVICE_NAME, -1))
+		return;
+	device_add_child_ordered(parent, 0, DEVICE_NAME, -1);
+}
+
+static int smapi_probe(device_t dev)
+{
+	struct thinkpad_ec_req req;
+	int ret;
+
+	if (device_get_unit(dev) != 0)
+		return (ENXIO);
+
+	/* the EC must answer the battery status row */
+	smapi_bat_req(&req, SMAPI_CMD_STATUS, 0);
+	ret = thinkpad_ec_submit(&req);
+	if (!ret)
+		ret = thinkpad_ec_wait(&req);
+	if (ret)
+		return (ENXIO);
+
+	device_set_desc(dev, "ThinkPad battery status");
+	return 0;
+}
+
+static int smapi_attach(device_t dev)
+{
+	int bat;
+
+	for (bat = 0; bat < SMAPI_NBAT; bat++)
+		smapi_bats[bat].age_ms = -1;
+	smapi_detaching = 0;
+	TIMEOUT_TASK_INIT(taskqueue_thread, &smapi_refresh_task, 0,
+	    smapi_refresh, NULL);
+	taskqueue_enqueue_timeout(taskqueue_thread, &smapi_refresh_task, 0);
+	return 0;
+}
+
+static int smapi_detach(device_t dev)
+{
+	smapi_detaching = 1;
+	while (taskqueue_cancel_timeout(taskqueue_thread, &smapi_refresh_task,
+	    NULL))
+		taskqueue_drain_timeout(taskqueue_thread, &smapi_refresh_task);
+	return 0;
+}
+
+static int smapi_resume(device_t dev)
+{
+	int bat;
+
+	/* batteries may have been swapped while suspended */
+	for (bat = 0; bat < SMAPI_NBAT; bat++)
+		smapi_bats[bat].design_valid = 0;
+	taskqueue_enqueue_timeout(taskqueue_thread, &smapi_refresh_task, 0);
+	return 0;
+}
+
+static device_method_t smapi_methods[] = {
+        DEVMETHOD(device_identify,      smapi_identify),
+        DEVMETHOD(device_probe,         smapi_probe),
+        DEVMETHOD(device_attach,        smapi_attach),
+        DEVMETHOD(device_detach,        smapi_detach),
+        DEVMETHOD(device_resume,	smapi_resume),
+        {0, 0}
+};
+
+static driver_t smapi_driver = {
+        DEVICE_NAME,
+        smapi_methods,
+	0,
+};
+
+DRIVER_MODULE(smapi, thinkpad_ec, smapi_driver, smapi_devclass, 0, 0);
+MODULE_DEPEND(smapi, thinkpad_ec, 1, 1, 1);
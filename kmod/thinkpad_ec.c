@@ -29,8 +29,12 @@
  *  Ported to FreeBSD by Maik Ehinger <m.ehinger@ltur.de>
  *
  *	Differences between FreeBSD and Linux Version
- *	- DELAY(9) instead of ndelay()
- *		 (microseconds instead nanoseconds)
+ *	- spin on cpu_ticks() with exponential backoff instead of ndelay()
+ *		 (waits are bounded by deadlines, not retry counts,
+ *		 and sleep once they get long)
+ *	- requests are queued to a worker thread, which alone talks to the
+ *	  EC, instead of spinning on the EC while holding a lock
+ *	- requests have priority classes, see thinkpad_ec_submit()
  *	- use sysctl instead of sysfs
  *
  */
@@ -40,9 +44,16 @@
 #include <sys/bus.h>
 #include <sys/module.h>
 #include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/sysctl.h>
 
 #include <sys/lock.h>
 #include <sys/mutex.h>
+#include <sys/proc.h>
+#include <sys/kthread.h>
+#include <sys/queue.h>
+#include <sys/eventhandler.h>
+#include <sys/sdt.h>
 
 //#include <sys/time.h>
 
@@ -50,8 +61,10 @@
 #include <sys/rman.h>
 #include <machine/resource.h>
 #include <machine/cpufunc.h>
+#include <machine/cpu.h>
 
 #include "thinkpad_ec.h"
+#include "thinkpad_ec_sim.h"
 
 #include "smbios.h" /* FreeBSD SMBIOS/DMI hack */
 
@@ -59,30 +72,41 @@
 
 #define DEVICE_NAME	"thinkpad_ec"
 
-/* IO ports used by embedded controller LPC channel 3: */
-#define TPC_BASE_PORT	0x1600
-#define TPC_NUM_PORTS	0x20
-#define TPC_STR3_PORT	0x04  /* Reads H8S EC register STR3 */
-#define TPC_TWR0_PORT	0x10 /* Mapped to H8S EC register TWR0MW/SW  */
-#define TPC_TWR15_PORT	0x1f /* Mapped to H8S EC register TWR15. */
-  /* (and port TPC_TWR0_PORT+i is mapped to H8S reg TWRi for 0<i<16) */
-
-/* H8S STR3 status flags (see "H8S/2104B Group Hardware Manual" p.549) */
-#define H8S_STR3_IBF3B 0x80  /* Bidi. Data Register Input Buffer Full */
-#define H8S_STR3_OBF3B 0x40  /* Bidi. Data Register Output Buffer Full */
-#define H8S_STR3_MWMF  0x20  /* Master Write Mode Flag */
-#define H8S_STR3_SWMF  0x10  /* Slave Write Mode Flag */
-#define H8S_STR3_MASK  0xf0  /* All bits we care about in STR3 */
-
-/* Timeouts and retries */
-/* At the moment we have only microsecond (1/1,000,000th second) delay instead
- * of the nanoseconds (1/1,000,000,000th second) delay
- */
-#define TPC_READ_RETRIES       75 /* Original Linux 150 */
-#define TPC_READ_NDELAY        1 /* Original Linux 500 */
-#define TPC_REQUEST_RETRIES    1000
-#define TPC_REQUEST_NDELAY     1 /* Original Linux 10 */
-#define TPC_PREFETCH_TIMEOUT   (hz/10)  /* invalidate prefetch after 0.1sec */
+/* Timeouts and backoff.
+ * Linux retries 150 times with ndelay(500) for reads and 1000 times with
+ * ndelay(10) for the request handshake; the deadlines below cover the same
+ * total time including port I/O. Waiting starts with sub-microsecond spins
+ * and doubles up to TPC_WAIT_MAX_NS, so a fast EC is noticed quickly and
+ * a slow one doesn't cost a port access every few nanoseconds. A wait
+ * still going after hw.thinkpad_ec.wait_sleep_us sleeps in
+ * TPC_WAIT_SLEEP_NS steps instead of spinning.
+ */
+#define TPC_READ_TIMEOUT_US    300  /* request retries, and data readout */
+#define TPC_REQUEST_TIMEOUT_US 1000 /* EC starting to reply to a request */
+#define TPC_WAIT_MIN_NS        100  /* first backoff step */
+#define TPC_WAIT_MAX_NS        8000 /* longest backoff step */
+#define TPC_WAIT_SLEEP_US      100  /* default hw.thinkpad_ec.wait_sleep_us */
+#define TPC_WAIT_SLEEP_NS      50000 /* sleep step, once sleeping */
+#define TPC_PREFETCH_TIMEOUT_US 100000 /* invalidate prefetch after 0.1sec */
+
+/* DTrace probes, e.g. dtrace -n 'thinkpad_ec::read:done { @ = quantize(arg3); }'
+ * Latencies are in nanoseconds, statuses are 0 or a negative errno.
+ */
+SDT_PROVIDER_DEFINE(thinkpad_ec);
+SDT_PROBE_DEFINE1(thinkpad_ec, , request, start, "struct thinkpad_ec_row *");
+SDT_PROBE_DEFINE3(thinkpad_ec, , request, done, "struct thinkpad_ec_row *",
+    "int", "uint64_t");
+SDT_PROBE_DEFINE1(thinkpad_ec, , read, start, "struct thinkpad_ec_row *");
+SDT_PROBE_DEFINE4(thinkpad_ec, , read, done, "struct thinkpad_ec_row *",
+    "struct thinkpad_ec_row *", "int", "uint64_t");
+SDT_PROBE_DEFINE2(thinkpad_ec, , prefetch, issue, "struct thinkpad_ec_row *",
+    "int");
+SDT_PROBE_DEFINE2(thinkpad_ec, , prefetch, hit, "struct thinkpad_ec_row *",
+    "uint64_t");
+SDT_PROBE_DEFINE1(thinkpad_ec, , prefetch, miss, "struct thinkpad_ec_row *");
+SDT_PROBE_DEFINE3(thinkpad_ec, , lock, acquire, "char *", "int", "uint64_t");
+SDT_PROBE_DEFINE2(thinkpad_ec, , lock, fail, "char *", "int");
+SDT_PROBE_DEFINE3(thinkpad_ec, , lock, release, "char *", "int", "uint64_t");
 
 /* A few macros for printk()ing: */
 #define MSG_FMT(fmt, args...) \
@@ -91,13 +115,54 @@
   MSG_FMT("%s: (0x%02x:0x%02x)->0x%02x", \
           msg, args->val[0x0], args->val[0xF], code)
 
-/* State of request prefetching: */
-static u_char prefetch_arg0, prefetch_argF;          /* Args of last prefetch */
+/* Console output on the EC path stalls sampling, so it is rate-limited
+ * and whatever is dropped gets counted instead.
+ */
+#define TPC_LOG_PPS	5	/* messages per second */
+#define TPC_LOG(...) do { \
+	if (ppsratecheck(&tpc_log_last, &tpc_log_pps, TPC_LOG_PPS)) \
+		device_printf(sc->dev, __VA_ARGS__); \
+	else \
+		TPC_STAT_INC(msgs_suppressed); \
+} while (0)
+
+/* Statistics are kept under thinkpad_ec_mtx */
+#define TPC_STAT_INC(field) do { \
+	mtx_lock(&thinkpad_ec_mtx); \
+	tpc_stats.field++; \
+	mtx_unlock(&thinkpad_ec_mtx); \
+} while (0)
+
+static struct timeval tpc_log_last;
+static int tpc_log_pps;
+
+static struct thinkpad_ec_stats tpc_stats;
+
+/* State of request prefetching.
+ * A prefetch is an ordinary queued request whose readout the worker parks
+ * in a slot instead of handing it to a waiter. Slots are keyed on the full
+ * masked argument row, so several prefetched rows can be kept and other
+ * transactions (config commands, battery queries) don't junk them.
+ */
+#define TPC_PREFETCH_SLOTS	4
+
+enum thinkpad_ec_slot_state {
+	TPC_SLOT_FREE = 0,		/* unused */
+	TPC_SLOT_PENDING,		/* queued or in flight */
+	TPC_SLOT_READY,			/* readout stored in slot */
+};
+
+struct thinkpad_ec_prefetch {
+	enum thinkpad_ec_slot_state state;
+	int junk;			/* invalidated while pending */
+	sbintime_t taken;		/* sbinuptime() of the readout */
+	struct thinkpad_ec_req req;	/* masked args, and data if READY */
+};
 
-/* ticks are from type int */
-static int prefetch_ticks;                      /* time of prefetch, or: */
-#define TPC_PREFETCH_NONE   -300*hz       /* - No prefetch */
-#define TPC_PREFETCH_JUNK   (-300*hz+1)   /* - Ignore prefetch */
+static struct thinkpad_ec_prefetch prefetch_slots[TPC_PREFETCH_SLOTS];
+
+/* How long a prefetched readout stays usable; also a loader tunable */
+static u_int tpc_prefetch_timeout_us = TPC_PREFETCH_TIMEOUT_US;
 
 struct thinkpad_ec_softc
 {
@@ -110,23 +175,138 @@ struct thinkpad_ec_softc
 
 struct thinkpad_ec_softc *sc;
 
+/* Port I/O backend: the LPC bus, or the simulator if hw.thinkpad_ec.simulate
+ * is set at load time.
+ */
+static u_char thinkpad_ec_bus_read(void *cookie, u_int port)
+{
+	struct thinkpad_ec_softc *bsc = cookie;
+
+	return bus_space_read_1(bsc->bst, bsc->bsh, port);
+}
+
+static void thinkpad_ec_bus_write(void *cookie, u_int port, u_char val)
+{
+	struct thinkpad_ec_softc *bsc = cookie;
+
+	bus_space_write_1(bsc->bst, bsc->bsh, port, val);
+}
+
+static void thinkpad_ec_bus_read_region(void *cookie, u_int port,
+					u_char *buf, u_int count)
+{
+	struct thinkpad_ec_softc *bsc = cookie;
+
+	bus_space_read_region_1(bsc->bst, bsc->bsh, port, buf, count);
+}
+
+static void thinkpad_ec_bus_write_region(void *cookie, u_int port,
+					 const u_char *buf, u_int count)
+{
+	struct thinkpad_ec_softc *bsc = cookie;
+
+	bus_space_write_region_1(bsc->bst, bsc->bsh, port, buf, count);
+}
+
+static const struct thinkpad_ec_port_ops thinkpad_ec_bus_ops = {
+	.name =		"bus_space",
+	.read =		thinkpad_ec_bus_read,
+	.write =	thinkpad_ec_bus_write,
+	.read_region =	thinkpad_ec_bus_read_region,
+	.write_region =	thinkpad_ec_bus_write_region,
+};
+
+static const struct thinkpad_ec_port_ops *tpc_ops = &thinkpad_ec_bus_ops;
+static void *tpc_cookie;
+
+/* Port accesses of the current transaction (worker only) */
+static u_int tpc_port_io;
+
+#define TPC_INB(port) \
+	(tpc_port_io++, tpc_ops->read(tpc_cookie, (port)))
+#define TPC_OUTB(port, val) \
+	(tpc_port_io++, tpc_ops->write(tpc_cookie, (port), (val)))
+
+static void thinkpad_ec_read_region(u_int port, u_char *buf, u_int count)
+{
+	tpc_port_io += count;
+	if (tpc_ops->read_region != NULL) {
+		tpc_ops->read_region(tpc_cookie, port, buf, count);
+		return;
+	}
+	while (count--)
+		*buf++ = tpc_ops->read(tpc_cookie, port++);
+}
+
+static void thinkpad_ec_write_region(u_int port, const u_char *buf,
+				     u_int count)
+{
+	tpc_port_io += count;
+	if (tpc_ops->write_region != NULL) {
+		tpc_ops->write_region(tpc_cookie, port, buf, count);
+		return;
+	}
+	while (count--)
+		tpc_ops->write(tpc_cookie, port++, *buf++);
+}
+
+/* Read STR3, keeping the last value for the trace (worker only) */
+static u_char tpc_str3;
+#define TPC_STR3()	(tpc_str3 = TPC_INB(TPC_STR3_PORT) & H8S_STR3_MASK)
+
+static int tpc_simulate = 0;
+TUNABLE_INT("hw.thinkpad_ec.simulate", &tpc_simulate);
+
 static devclass_t thinkpad_ec_devclass;
 
+/* sysctl node (hw.thinkpad_ec) */
+SYSCTL_NODE(_hw, OID_AUTO, thinkpad_ec, CTLFLAG_RD, NULL, "ThinkPad Embedded Controller");
+SYSCTL_INT(_hw_thinkpad_ec, OID_AUTO, simulate, CTLFLAG_RDTUN, &tpc_simulate, 0, "use the EC simulator instead of the LPC bus");
+SYSCTL_UINT(_hw_thinkpad_ec, OID_AUTO, prefetch_timeout_us, CTLFLAG_RWTUN, &tpc_prefetch_timeout_us, 0, "prefetched readouts expire after this long (us), or 1.5 sampling periods if longer");
+
 /*****
 	EC access functions
 */
 
+/* thinkpad_ec_mtx protects the request queue, the prefetch slots, the
+ * client lock and the statistics. It is never held while talking to the
+ * EC: only the worker thread touches the ports, and it does so unlocked.
+ */
 static struct mtx thinkpad_ec_mtx;
 
+static int tpc_locked;		/* client lock, see thinkpad_ec_lock() */
+
+/* lock profile events */
+#define TPC_LOCK_TAKEN		0	/* acquired */
+#define TPC_LOCK_CONTENDED	1	/* held by another, about to wait */
+#define TPC_LOCK_TRY_FAILED	2	/* held by another, try failed */
+
+static void thinkpad_ec_lock_prof(const char *file, int line,
+				  sbintime_t start, int event);
+static void thinkpad_ec_unlock_prof(void);
+
 /**
  * thinkpad_ec_lock - get lock on the ThinkPad EC
  *
  * Get exclusive lock for accesing the ThinkPad embedded controller LPC3
- * interface. Returns 0 iff lock acquired.
+ * interface. This serializes EC clients against each other, so a sequence
+ * of requests isn't interleaved with another client's; the requests
+ * themselves are serialized by the worker thread either way.
+ * The caller's @file and @line key the lock profile.
+ * May sleep. Returns 0 iff lock acquired.
  */
-int thinkpad_ec_lock(void)
+int __thinkpad_ec_lock(const char *file, int line)
 {
+	sbintime_t start = sbinuptime();
+
 	mtx_lock(&thinkpad_ec_mtx);
+	if (tpc_locked)
+		thinkpad_ec_lock_prof(file, line, start, TPC_LOCK_CONTENDED);
+	while (tpc_locked)
+		mtx_sleep(&tpc_locked, &thinkpad_ec_mtx, 0, "tpclk", 0);
+	tpc_locked = 1;
+	thinkpad_ec_lock_prof(file, line, start, TPC_LOCK_TAKEN);
+	mtx_unlock(&thinkpad_ec_mtx);
 	return 0;
 }
 
@@ -137,9 +317,20 @@ int thinkpad_ec_lock(void)
  * controller LPC3. Returns immediately if lock is not available; neither
  * blocks nor sleeps. Returns 0 iff lock acquired .
  */
-int thinkpad_ec_try_lock(void)
+int __thinkpad_ec_try_lock(const char *file, int line)
 {
-	return !mtx_trylock(&thinkpad_ec_mtx);
+	sbintime_t start = sbinuptime();
+	int ret = -EBUSY;
+
+	mtx_lock(&thinkpad_ec_mtx);
+	if (!tpc_locked) {
+		tpc_locked = 1;
+		ret = 0;
+	}
+	thinkpad_ec_lock_prof(file, line, start,
+	    ret ? TPC_LOCK_TRY_FAILED : TPC_LOCK_TAKEN);
+	mtx_unlock(&thinkpad_ec_mtx);
+	return ret;
 }
 
 /**
@@ -150,77 +341,333 @@ int thinkpad_ec_try_lock(void)
  */
 void thinkpad_ec_unlock(void)
 {
+	mtx_lock(&thinkpad_ec_mtx);
+	thinkpad_ec_unlock_prof();
+	tpc_locked = 0;
+	wakeup_one(&tpc_locked);
+	mtx_unlock(&thinkpad_ec_mtx);
+}
+
+/*****
+	Statistics (hw.thinkpad_ec.stats)
+*/
+
+static int thinkpad_ec_stats_sysctlproc(SYSCTL_HANDLER_ARGS)
+{
+	struct thinkpad_ec_stats *stats;
+	int error;
+
+	/* one consistent snapshot, too big for the stack */
+	stats = malloc(sizeof(*stats), M_TEMP, M_WAITOK);
+	mtx_lock(&thinkpad_ec_mtx);
+	*stats = tpc_stats;
 	mtx_unlock(&thinkpad_ec_mtx);
+
+	error = SYSCTL_OUT(req, stats, sizeof(*stats));
+	free(stats, M_TEMP);
+	return error;
+}
+
+SYSCTL_NODE(_hw_thinkpad_ec, OID_AUTO, stats, CTLFLAG_RD, NULL, "EC access statistics");
+SYSCTL_PROC(_hw_thinkpad_ec_stats, OID_AUTO, all, CTLTYPE_OPAQUE|CTLFLAG_RD, NULL, 0, thinkpad_ec_stats_sysctlproc, "S,thinkpad_ec_stats", "all statistics (struct thinkpad_ec_stats)");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, requests, CTLFLAG_RD, &tpc_stats.requests, 0, "rows requested");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, reads, CTLFLAG_RD, &tpc_stats.reads, 0, "rows read");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, busy, CTLFLAG_RD, &tpc_stats.busy, 0, "EC busy, retried");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, io_errors, CTLFLAG_RD, &tpc_stats.io_errors, 0, "EC protocol errors");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, err_0x80, CTLFLAG_RD, &tpc_stats.err_0x80, 0, "0x80 read from port 0x161F");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, prefetch_hits, CTLFLAG_RD, &tpc_stats.prefetch_hits, 0, "prefetched rows used");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, prefetch_misses, CTLFLAG_RD, &tpc_stats.prefetch_misses, 0, "rows not found prefetched");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, prefetch_evicts, CTLFLAG_RD, &tpc_stats.prefetch_evicts, 0, "prefetched rows dropped for another");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, prefetch_expired, CTLFLAG_RD, &tpc_stats.prefetch_expired, 0, "prefetched rows that timed out");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, submitted, CTLFLAG_RD, &tpc_stats.submitted, 0, "requests queued");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, coalesced, CTLFLAG_RD, &tpc_stats.coalesced, 0, "requests that shared another's transaction");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, completed, CTLFLAG_RD, &tpc_stats.completed, 0, "requests served");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, queue_max, CTLFLAG_RD, &tpc_stats.queue_max, 0, "longest request queue seen");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, port_io, CTLFLAG_RD, &tpc_stats.port_io, 0, "EC port accesses");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, outages, CTLFLAG_RD, &tpc_stats.outages, 0, "EC hangs detected");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, recoveries, CTLFLAG_RD, &tpc_stats.recoveries, 0, "EC hangs recovered from");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, recovery_attempts, CTLFLAG_RD, &tpc_stats.recovery_attempts, 0, "EC test handshakes while recovering");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, msgs_suppressed, CTLFLAG_RD, &tpc_stats.msgs_suppressed, 0, "rate-limited console messages");
+SYSCTL_OPAQUE(_hw_thinkpad_ec_stats, OID_AUTO, request_ns, CTLFLAG_RD, &tpc_stats.request_ns, sizeof(tpc_stats.request_ns), "QU", "log2 histogram of request latency (ns)");
+SYSCTL_OPAQUE(_hw_thinkpad_ec_stats, OID_AUTO, read_ns, CTLFLAG_RD, &tpc_stats.read_ns, sizeof(tpc_stats.read_ns), "QU", "log2 histogram of read latency (ns)");
+SYSCTL_OPAQUE(_hw_thinkpad_ec_stats, OID_AUTO, wait_ns, CTLFLAG_RD, &tpc_stats.wait_ns, sizeof(tpc_stats.wait_ns), "QU", "log2 histogram of queueing time (ns)");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, batches, CTLFLAG_RD, &tpc_stats.batches, 0, "thinkpad_ec_read_rows calls");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, batch_rows, CTLFLAG_RD, &tpc_stats.batch_rows, 0, "rows read in batches");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, slot_holds, CTLFLAG_RD, &tpc_stats.slot_holds, 0, "dispatches held for a sampling slot");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, promoted, CTLFLAG_RD, &tpc_stats.promoted, 0, "requests raised by a more urgent one");
+SYSCTL_OPAQUE(_hw_thinkpad_ec_stats, OID_AUTO, service_ns, CTLFLAG_RD, &tpc_stats.service_ns, sizeof(tpc_stats.service_ns), "QU", "log2 histogram of service time (ns)");
+SYSCTL_OPAQUE(_hw_thinkpad_ec_stats, OID_AUTO, prefetch_age_ns, CTLFLAG_RD, &tpc_stats.prefetch_age_ns, sizeof(tpc_stats.prefetch_age_ns), "QU", "log2 histogram of prefetched row age when used (ns)");
+SYSCTL_OPAQUE(_hw_thinkpad_ec_stats, OID_AUTO, recovery_ns, CTLFLAG_RD, &tpc_stats.recovery_ns, sizeof(tpc_stats.recovery_ns), "QU", "log2 histogram of time to recover from a hang (ns)");
+SYSCTL_OPAQUE(_hw_thinkpad_ec_stats, OID_AUTO, batch_ns, CTLFLAG_RD, &tpc_stats.batch_ns, sizeof(tpc_stats.batch_ns), "QU", "log2 histogram of batch time (ns)");
+
+SYSCTL_NODE(_hw_thinkpad_ec_stats, OID_AUTO, rt, CTLFLAG_RD, NULL, "sampling requests");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats_rt, OID_AUTO, completed, CTLFLAG_RD, &tpc_stats.prio[TP_EC_PRIO_RT].completed, 0, "requests served");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats_rt, OID_AUTO, wait_max_ns, CTLFLAG_RD, &tpc_stats.prio[TP_EC_PRIO_RT].wait_max_ns, 0, "longest queueing time (ns)");
+SYSCTL_OPAQUE(_hw_thinkpad_ec_stats_rt, OID_AUTO, wait_ns, CTLFLAG_RD, &tpc_stats.prio[TP_EC_PRIO_RT].wait_ns, sizeof(tpc_stats.prio[TP_EC_PRIO_RT].wait_ns), "QU", "log2 histogram of queueing time (ns)");
+
+SYSCTL_NODE(_hw_thinkpad_ec_stats, OID_AUTO, interactive, CTLFLAG_RD, NULL, "interactive requests");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats_interactive, OID_AUTO, completed, CTLFLAG_RD, &tpc_stats.prio[TP_EC_PRIO_INTERACTIVE].completed, 0, "requests served");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats_interactive, OID_AUTO, wait_max_ns, CTLFLAG_RD, &tpc_stats.prio[TP_EC_PRIO_INTERACTIVE].wait_max_ns, 0, "longest queueing time (ns)");
+SYSCTL_OPAQUE(_hw_thinkpad_ec_stats_interactive, OID_AUTO, wait_ns, CTLFLAG_RD, &tpc_stats.prio[TP_EC_PRIO_INTERACTIVE].wait_ns, sizeof(tpc_stats.prio[TP_EC_PRIO_INTERACTIVE].wait_ns), "QU", "log2 histogram of queueing time (ns)");
+
+SYSCTL_NODE(_hw_thinkpad_ec_stats, OID_AUTO, background, CTLFLAG_RD, NULL, "background requests");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats_background, OID_AUTO, completed, CTLFLAG_RD, &tpc_stats.prio[TP_EC_PRIO_BACKGROUND].completed, 0, "requests served");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats_background, OID_AUTO, wait_max_ns, CTLFLAG_RD, &tpc_stats.prio[TP_EC_PRIO_BACKGROUND].wait_max_ns, 0, "longest queueing time (ns)");
+SYSCTL_OPAQUE(_hw_thinkpad_ec_stats_background, OID_AUTO, wait_ns, CTLFLAG_RD, &tpc_stats.prio[TP_EC_PRIO_BACKGROUND].wait_ns, sizeof(tpc_stats.prio[TP_EC_PRIO_BACKGROUND].wait_ns), "QU", "log2 histogram of queueing time (ns)");
+
+/************************************
+ * Wait engine
+ *
+ * EC waits are a few microseconds as a rule, far below what sleeping can
+ * resolve, so the worker spins. Time is taken from cpu_ticks() (the TSC
+ * on x86), which is cheap enough to be read on every step and much finer
+ * than DELAY(9). A slow or hung EC can take up to the whole deadline,
+ * though; once a wait has lasted wait_sleep_us, the worker sleeps between
+ * polls and leaves the CPU to others. Only the worker waits, without
+ * locks held, so it may always sleep.
+ */
+
+struct thinkpad_ec_deadline {
+	uint64_t deadline;	/* cpu_ticks() value to give up at */
+	uint64_t sleep_at;	/* cpu_ticks() value to start sleeping at */
+	uint64_t step;		/* next spin length, in cpu ticks */
+};
+
+static uint64_t tpc_ticks_per_us;	/* cpu ticks per microsecond */
+static uint64_t tpc_wait_min, tpc_wait_max; /* backoff bounds, cpu ticks */
+static int tpc_wait_sleep_us = TPC_WAIT_SLEEP_US;
+static uint64_t tpc_wait_sleeps;	/* worker only */
+
+SYSCTL_INT(_hw_thinkpad_ec, OID_AUTO, wait_sleep_us, CTLFLAG_RW, &tpc_wait_sleep_us, 0, "spin this long on the EC before sleeping between polls (us), 0 never sleep");
+SYSCTL_UQUAD(_hw_thinkpad_ec_stats, OID_AUTO, wait_sleeps, CTLFLAG_RD, &tpc_wait_sleeps, 0, "sleeps while waiting for the EC");
+
+static void thinkpad_ec_deadline_calibrate(void)
+{
+	uint64_t rate = cpu_tickrate();
+
+	tpc_ticks_per_us = rate / 1000000;
+	if (tpc_ticks_per_us == 0)
+		tpc_ticks_per_us = 1;
+	tpc_wait_min = rate / (1000000000 / TPC_WAIT_MIN_NS);
+	if (tpc_wait_min == 0)
+		tpc_wait_min = 1;
+	tpc_wait_max = rate / (1000000000 / TPC_WAIT_MAX_NS);
+	if (tpc_wait_max < tpc_wait_min)
+		tpc_wait_max = tpc_wait_min;
+}
+
+static void thinkpad_ec_deadline_init(struct thinkpad_ec_deadline *w,
+				     u_int timeout_us)
+{
+	uint64_t now = cpu_ticks();
+	int sleep_us = tpc_wait_sleep_us;
+
+	w->deadline = now + timeout_us * tpc_ticks_per_us;
+	w->sleep_at = (sleep_us > 0 && (u_int)sleep_us < timeout_us) ?
+	    now + sleep_us * tpc_ticks_per_us : w->deadline;
+	w->step = tpc_wait_min;
+}
+
+/* Spin for the current backoff step, then double it; past w->sleep_at,
+ * sleep for TPC_WAIT_SLEEP_NS instead. Never waits past the deadline.
+ * Returns nonzero once the deadline has passed (without waiting).
+ */
+static int thinkpad_ec_backoff(struct thinkpad_ec_deadline *w)
+{
+	uint64_t now, until, left;
+
+	now = cpu_ticks();
+	if ((int64_t)(now - w->deadline) >= 0)
+		return 1;
+
+	if ((int64_t)(now - w->sleep_at) >= 0) {
+		left = (w->deadline - now) * 1000 / tpc_ticks_per_us;
+		pause_sbt("tpcwait", nstosbt(MIN(left, TPC_WAIT_SLEEP_NS)),
+		    0, 0);
+		tpc_wait_sleeps++;
+		return 0;
+	}
+
+	until = now + w->step;
+	if ((int64_t)(until - w->deadline) > 0)
+		until = w->deadline;
+	while ((int64_t)(cpu_ticks() - until) < 0)
+		cpu_spinwait();
+
+	w->step <<= 1;
+	if (w->step > tpc_wait_max)
+		w->step = tpc_wait_max;
+	return 0;
 }
 
 /************************************
- * bus_space_read/write functions need bus_spacetag/handle 
+ * LPC3 protocol, on top of the port I/O backend
  *
  */
 
+/* Command descriptors.
+ * Registers TWR1..TWR14 are written and read as runs of consecutive ports,
+ * so each run is one region access. For the commands we know, the runs
+ * are worked out once from the registers the command takes and the ones
+ * its reply uses; registers the reply doesn't use are never read, and
+ * STR3 isn't rechecked after the readout. Other commands get their runs
+ * from the request masks each time.
+ */
+struct thinkpad_ec_run {
+	u_char first;			/* register number */
+	u_char count;
+};
+
+#define TPC_MAX_RUNS	7	/* TWR1..TWR14, every other one */
+
+struct thinkpad_ec_runs {
+	int n;
+	struct thinkpad_ec_run run[TPC_MAX_RUNS];
+};
+
+struct thinkpad_ec_cmd {
+	u_char code;			/* TWR0 */
+	short sub;			/* TWR1, or -1 if any */
+	u_short args_mask;		/* registers the command takes */
+	u_short reply_mask;		/* registers its reply uses */
+	struct thinkpad_ec_runs wruns;	/* precomputed from args_mask */
+	struct thinkpad_ec_runs rruns;	/* precomputed from reply_mask */
+};
+
+static struct thinkpad_ec_cmd tpc_cmds[] = {
+	{ 0x01,   -1, 0x8001, 0xFFFF },	/* battery status */
+	{ 0x02,   -1, 0x8001, 0xFFFF },	/* battery capacity */
+	{ 0x03,   -1, 0x8001, 0xFFFF },	/* battery design data */
+	{ 0x10,   -1, 0x000F, 0x8001 },	/* set accelerometer config */
+	{ 0x11,   -1, 0x0001, 0xBFFF },	/* accelerometer readout */
+	{ 0x13,   -1, 0x0001, 0x8003 },	/* accelerometer mode */
+	{ 0x14,   -1, 0x0003, 0x8001 },	/* accelerometer power */
+	{ 0x17, 0x81, 0x0003, 0x800F },	/* check */
+	{ 0x17, 0x82, 0x0003, 0x801F },	/* get accelerometer config */
+	{ 0x17, 0x83, 0x0007, 0x8001 },	/* fake data mode */
+};
+
+/* Split the TWR1..TWR14 part of a mask into runs */
+static void thinkpad_ec_mask_runs(u_short mask, struct thinkpad_ec_runs *r)
+{
+	int i = 1;
+
+	r->n = 0;
+	while (i < TP_CONTROLLER_ROW_LEN-1) {
+		if (!((mask>>i)&1)) {
+			i++;
+			continue;
+		}
+		r->run[r->n].first = i;
+		while (i < TP_CONTROLLER_ROW_LEN-1 && ((mask>>i)&1))
+			i++;
+		r->run[r->n].count = i - r->run[r->n].first;
+		r->n++;
+	}
+}
+
+static void thinkpad_ec_cmds_init(void)
+{
+	struct thinkpad_ec_cmd *c;
+
+	for (c = tpc_cmds; c < tpc_cmds + nitems(tpc_cmds); c++) {
+		thinkpad_ec_mask_runs(c->args_mask, &c->wruns);
+		thinkpad_ec_mask_runs(c->reply_mask, &c->rruns);
+	}
+}
+
+static const struct thinkpad_ec_cmd *
+thinkpad_ec_find_cmd(const struct thinkpad_ec_row *args)
+{
+	const struct thinkpad_ec_cmd *c;
+
+	for (c = tpc_cmds; c < tpc_cmds + nitems(tpc_cmds); c++)
+		if (c->code == args->val[0] &&
+		    (c->sub < 0 || c->sub == args->val[1]) &&
+		    args->mask == c->args_mask)
+			return c;
+	return NULL;
+}
+
+/* A known command's reply leaves the other registers alone, so asking
+ * for them would only get stale bytes.
+ */
+static int thinkpad_ec_mask_ok(const struct thinkpad_ec_cmd *cmd,
+			       u_short data_mask)
+{
+	return cmd == NULL || (data_mask & ~cmd->reply_mask) == 0;
+}
+
 /* Tell embedded controller to prepare a row */
-static int thinkpad_ec_request_row(const struct thinkpad_ec_row *args)
+static int __thinkpad_ec_request_row(const struct thinkpad_ec_req *req)
 {
+	const struct thinkpad_ec_row *args = &req->args;
+	struct thinkpad_ec_runs runs;
+	const struct thinkpad_ec_runs *wr;
+	struct thinkpad_ec_deadline w;
 	u_char str3;
 	int i;
 
 	/* EC protocol requires write to TWR0 (function code): */
 	if (!(args->mask & 0x0001)) {
-		device_printf(sc->dev, MSG_FMT("bad args->mask=0x%02x", args->mask));
+		TPC_LOG(MSG_FMT("bad args->mask=0x%02x", args->mask));
 		return -EINVAL;
 	}
 
 	/* Check initial STR3 status */
-	str3 = bus_space_read_1(sc->bst, sc->bsh, TPC_STR3_PORT) & H8S_STR3_MASK;
+	/* -EBUSY is retried by the caller and counted in the statistics;
+	 * only giving up on it is worth a message. */
+	str3 = TPC_STR3();
 	if (str3 & H8S_STR3_OBF3B) { /* data already pending */
-		bus_space_read_1(sc->bst, sc->bsh, TPC_TWR15_PORT); /* marks end of previous transaction */
-		if (prefetch_ticks == TPC_PREFETCH_NONE)
-			device_printf(sc->dev, REQ_FMT("readout already pending", str3));
+		TPC_INB(TPC_TWR15_PORT); /* marks end of previous transaction */
 		return -EBUSY; /* EC will be ready in a few usecs */
 	} else if (str3 == H8S_STR3_SWMF) { /* busy with previous request */
-		if (prefetch_ticks == TPC_PREFETCH_NONE)
-			device_printf(sc->dev, REQ_FMT("EC handles previous request", str3));
 		return -EBUSY; /* data will be pending in a few usecs */
 	} else if (str3 != 0x00) { /* unexpected status */
-		device_printf(sc->dev, REQ_FMT("bad initial STR3", str3));
+		TPC_LOG(REQ_FMT("bad initial STR3", str3));
 		return -EIO;
 	}
 
 	/* Send TWR0MW */
-	bus_space_write_1(sc->bst, sc->bsh, TPC_TWR0_PORT, args->val[0]);
-	str3 = bus_space_read_1(sc->bst, sc->bsh, TPC_STR3_PORT) & H8S_STR3_MASK;
+	TPC_OUTB(TPC_TWR0_PORT, args->val[0]);
+	str3 = TPC_STR3();
 	if (str3 != H8S_STR3_MWMF) { /* not accepted */
-		device_printf(sc->dev, REQ_FMT("arg0 rejected", str3));
+		TPC_LOG(REQ_FMT("arg0 rejected", str3));
 		return -EIO;
 	}
 
 	/* Send TWR1 through TWR14 */
-	for (i=1; i<TP_CONTROLLER_ROW_LEN-1; i++) 
-		if ((args->mask>>i)&1)
-			bus_space_write_1(sc->bst, sc->bsh, TPC_TWR0_PORT+i, args->val[i]);
+	if (req->tr_cmd != NULL) {
+		wr = &req->tr_cmd->wruns;
+	} else {
+		thinkpad_ec_mask_runs(args->mask, &runs);
+		wr = &runs;
+	}
+	for (i = 0; i < wr->n; i++)
+		thinkpad_ec_write_region(TPC_TWR0_PORT + wr->run[i].first,
+		    args->val + wr->run[i].first, wr->run[i].count);
 			
 	/* Send TWR15 (default to 0x01). This marks end of command. */
-	bus_space_write_1(sc->bst, sc->bsh, TPC_TWR15_PORT, (args->mask & 0x8000) ? args->val[0xf] : 0x01);
+	TPC_OUTB(TPC_TWR15_PORT, (args->mask & 0x8000) ? args->val[0xf] : 0x01);
 
 	 /* Wait until EC starts writing its reply (~60ns on average).
          * Releasing locks before this happens may cause an EC hang
          * due to firmware bug!
          */
 
-	for (i=0; i<TPC_REQUEST_RETRIES; i++) {
-		str3 = bus_space_read_1(sc->bst, sc->bsh, TPC_STR3_PORT) & H8S_STR3_MASK;
+	thinkpad_ec_deadline_init(&w, TPC_REQUEST_TIMEOUT_US);
+	do {
+		str3 = TPC_STR3();
 		if (str3 & H8S_STR3_SWMF) /* EC started replying */
 			return 0;
-		else if ( str3 == (H8S_STR3_IBF3B|H8S_STR3_MWMF) || str3 == 0x00 ) /* normal progress, wait it out */
-			DELAY(TPC_REQUEST_NDELAY); /*XXX*/
-		else { /* weired EC status */
-			device_printf(sc->dev, REQ_FMT("bad end STR3", str3));
+		else if ( str3 != (H8S_STR3_IBF3B|H8S_STR3_MWMF) && str3 != 0x00 ) { /* weired EC status */
+			TPC_LOG(REQ_FMT("bad end STR3", str3));
 			return -EIO;
 		}
-	
-	} /* for */
+		/* normal progress, wait it out */
+	} while (!thinkpad_ec_backoff(&w));
 
-	device_printf(sc->dev, REQ_FMT("EC is mysteriously silent", str3));
+	TPC_LOG(REQ_FMT("EC is mysteriously silent", str3));
         return -EIO;
 
 }
@@ -228,11 +675,16 @@ static int thinkpad_ec_request_row(const struct thinkpad_ec_row *args)
 /* Read current row data from the controller, assuming it's already
  * requested. 
  */
-static int thinkpad_ec_read_data(const struct thinkpad_ec_row *args,
-				 struct thinkpad_ec_row *data)
+static int __thinkpad_ec_read_data(struct thinkpad_ec_req *req)
 {
+	const struct thinkpad_ec_row *args = &req->args;
+	const struct thinkpad_ec_cmd *cmd = req->tr_cmd;
+	struct thinkpad_ec_row *data = &req->data;
+	struct thinkpad_ec_runs runs;
+	const struct thinkpad_ec_runs *rr;
+	u_short mask;
         int i;
-	u_char str3 = bus_space_read_1(sc->bst, sc->bsh, TPC_STR3_PORT) & H8S_STR3_MASK;
+	u_char str3 = TPC_STR3();
         /* Once we make a request, STR3 assumes the sequence of values listed
          * in the following 'if' as it reads the request and writes its data.
          * It takes about a few dozen nanosecs total, with very high variance.
@@ -244,55 +696,1067 @@ static int thinkpad_ec_read_data(const struct thinkpad_ec_row *args,
 
         /* Finally, the EC signals output buffer full: */
         if (str3 != (H8S_STR3_OBF3B|H8S_STR3_SWMF)) {
-		device_printf(sc->dev,
-			 REQ_FMT("bad initial STR3", str3));
+		TPC_LOG(REQ_FMT("bad initial STR3", str3));
                 return -EIO;
         }
 
         /* Read first byte (signals start of read transactions): */
-        data->val[0] = bus_space_read_1(sc->bst, sc->bsh, TPC_TWR0_PORT);
-        /* Optionally read 14 more bytes: */
-        for (i=1; i<TP_CONTROLLER_ROW_LEN-1; i++)
-                if ((data->mask >> i)&1)
-        		data->val[i] = bus_space_read_1(sc->bst, sc->bsh, TPC_TWR0_PORT+i);
+        data->val[0] = TPC_INB(TPC_TWR0_PORT);
+        /* Optionally read 14 more bytes (for known commands, the mask
+         * was checked against the reply in thinkpad_ec_req_init()): */
+        mask = data->mask;
+        if (cmd != NULL && mask == cmd->reply_mask) {
+                rr = &cmd->rruns;
+        } else {
+                thinkpad_ec_mask_runs(mask, &runs);
+                rr = &runs;
+        }
+        for (i = 0; i < rr->n; i++)
+                thinkpad_ec_read_region(TPC_TWR0_PORT + rr->run[i].first,
+                    data->val + rr->run[i].first, rr->run[i].count);
 
         /* Read last byte from 0x161F (signals end of read transaction): */
-        data->val[0xf] = bus_space_read_1(sc->bst, sc->bsh, TPC_TWR15_PORT);
+        data->val[0xf] = TPC_INB(TPC_TWR15_PORT);
                 
-        /* Readout still pending? */
-	str3 = bus_space_read_1(sc->bst, sc->bsh, TPC_STR3_PORT) & H8S_STR3_MASK;
-        if (str3 & H8S_STR3_OBF3B)
-		device_printf(sc->dev,
-			 REQ_FMT("OBF3B=1 after read", str3));
+        /* Readout still pending? Known commands are never longer. */
+        if (cmd == NULL) {
+                str3 = TPC_STR3();
+                if (str3 & H8S_STR3_OBF3B)
+                        TPC_LOG(REQ_FMT("OBF3B=1 after read", str3));
+        }
 
 	/* If port 0x161f return 0x80 to often, the EC may lock up */
-	if (data->val[0xf] == 0x80)
-		device_printf(sc->dev,
-			REQ_FMT("0x161f reports error", data->val[0xf]));
+	if (data->val[0xf] == 0x80) {
+		TPC_STAT_INC(err_0x80);
+		TPC_LOG(REQ_FMT("0x161f reports error", data->val[0xf]));
+	}
 
         return 0;
 }
 
-/* Is the given row currently prefetched? 
- * To keep things simple we compare only the first and last args;
- * in practice this suffices                                        .*/
-static int thinkpad_ec_is_row_fetched(const struct thinkpad_ec_row *args)
+/* Count a duration in a log2 histogram. Caller holds thinkpad_ec_mtx. */
+static void thinkpad_ec_hist(uint64_t *hist, uint64_t ns)
+{
+	int bucket;
+
+	bucket = flsll(ns);
+	if (bucket >= TP_EC_HIST_BUCKETS)
+		bucket = TP_EC_HIST_BUCKETS - 1;
+	hist[bucket]++;
+}
+
+/*****
+	Client lock profile (hw.thinkpad_ec.stats.locks)
+*/
+
+/* The sampling callout only try-locks and skips a sample if that fails,
+ * so whoever holds the client lock for long costs samples. Acquisitions,
+ * failed tries, waits and hold times are kept per call site to tell who.
+ * Sites are keyed on the basename kept in the entry and the line, never
+ * on the caller's __FILE__ pointer, which belongs to a module that may
+ * be unloaded. Once TPC_LOCK_SITES - 1 sites are known, further ones
+ * share an entry of their own, "(other)".
+ */
+#define TPC_LOCK_SITES	32
+#define TPC_LOCK_OTHER	(TPC_LOCK_SITES - 1)	/* overflow entry */
+
+static struct thinkpad_ec_lock_site tpc_lock_sites[TPC_LOCK_SITES];
+static int tpc_lock_nsites;	/* entries in use, TPC_LOCK_SITES with
+				   the overflow entry */
+static struct thinkpad_ec_lock_site *tpc_lock_holder;
+static sbintime_t tpc_lock_taken;
+
+/* Find or make the entry for a call site. Caller holds thinkpad_ec_mtx. */
+static struct thinkpad_ec_lock_site *thinkpad_ec_lock_site(const char *file,
+							   int line)
+{
+	struct thinkpad_ec_lock_site *site;
+	const char *base;
+	int i, n;
+
+	base = strrchr(file, '/');
+	if (base != NULL)
+		file = base + 1;
+
+	n = MIN(tpc_lock_nsites, TPC_LOCK_OTHER);
+	for (i = 0; i < n; i++)
+		if (tpc_lock_sites[i].line == line &&
+		    strncmp(tpc_lock_sites[i].file, file,
+		    sizeof(tpc_lock_sites[i].file) - 1) == 0)
+			return &tpc_lock_sites[i];
+
+	if (n == TPC_LOCK_OTHER) {
+		site = &tpc_lock_sites[TPC_LOCK_OTHER];
+		if (tpc_lock_nsites < TPC_LOCK_SITES) {
+			tpc_lock_nsites = TPC_LOCK_SITES;
+			strlcpy(site->file, "(other)", sizeof(site->file));
+			site->line = 0;
+		}
+		return site;
+	}
+
+	site = &tpc_lock_sites[tpc_lock_nsites++];
+	strlcpy(site->file, file, sizeof(site->file));
+	site->line = line;
+	return site;
+}
+
+/* Account a lock @event for an attempt that started at @start.
+ * Caller holds thinkpad_ec_mtx.
+ */
+static void thinkpad_ec_lock_prof(const char *file, int line,
+				  sbintime_t start, int event)
+{
+	struct thinkpad_ec_lock_site *site;
+	sbintime_t now;
+	uint64_t ns;
+
+	site = thinkpad_ec_lock_site(file, line);
+	if (event != TPC_LOCK_TAKEN) {
+		if (event == TPC_LOCK_TRY_FAILED) {
+			site->try_failed++;
+			SDT_PROBE2(thinkpad_ec, , lock, fail, file, line);
+		}
+		if (tpc_lock_holder != NULL)
+			tpc_lock_holder->blocked++;
+		return;
+	}
+
+	now = sbinuptime();
+	ns = sbttons(now - start);
+	site->acquired++;
+	thinkpad_ec_hist(site->wait_ns, ns);
+	if (ns > site->wait_max_ns)
+		site->wait_max_ns = ns;
+	SDT_PROBE3(thinkpad_ec, , lock, acquire, file, line, ns);
+	tpc_lock_holder = site;
+	tpc_lock_taken = now;
+}
+
+/* Account the hold that ends now. Caller holds thinkpad_ec_mtx. */
+static void thinkpad_ec_unlock_prof(void)
+{
+	struct thinkpad_ec_lock_site *site = tpc_lock_holder;
+	uint64_t ns;
+
+	if (site == NULL)
+		return;
+	ns = sbttons(sbinuptime() - tpc_lock_taken);
+	thinkpad_ec_hist(site->hold_ns, ns);
+	if (ns > site->hold_max_ns)
+		site->hold_max_ns = ns;
+	SDT_PROBE3(thinkpad_ec, , lock, release, site->file, site->line, ns);
+	tpc_lock_holder = NULL;
+}
+
+static int thinkpad_ec_locks_sysctlproc(SYSCTL_HANDLER_ARGS)
+{
+	struct thinkpad_ec_lock_site *sites;
+	int error, n, reset;
+
+	if (req->newptr != NULL) {
+		/* writing anything clears the profile */
+		error = SYSCTL_IN(req, &reset, sizeof(reset));
+		if (error)
+			return error;
+		mtx_lock(&thinkpad_ec_mtx);
+		bzero(tpc_lock_sites, sizeof(tpc_lock_sites));
+		tpc_lock_nsites = 0;
+		tpc_lock_holder = NULL;
+		mtx_unlock(&thinkpad_ec_mtx);
+		return 0;
+	}
+
+	/* one consistent snapshot */
+	sites = malloc(sizeof(tpc_lock_sites), M_TEMP, M_WAITOK);
+	mtx_lock(&thinkpad_ec_mtx);
+	n = tpc_lock_nsites;
+	bcopy(tpc_lock_sites, sites, n * sizeof(*sites));
+	mtx_unlock(&thinkpad_ec_mtx);
+
+	error = SYSCTL_OUT(req, sites, n * sizeof(*sites));
+	free(sites, M_TEMP);
+	return error;
+}
+
+SYSCTL_PROC(_hw_thinkpad_ec_stats, OID_AUTO, locks, CTLTYPE_OPAQUE|CTLFLAG_RW, NULL, 0, thinkpad_ec_locks_sysctlproc, "S,thinkpad_ec_lock_site", "client lock profile per call site, write to clear");
+
+/* Account the result and duration of an EC access in tpc_stats.
+ * Returns the duration in ns.
+ */
+static uint64_t thinkpad_ec_account(int ret, uint64_t *count, uint64_t *hist,
+				    uint64_t start)
+{
+	uint64_t ns;
+
+	ns = (cpu_ticks() - start) * 1000 / tpc_ticks_per_us;
+
+	mtx_lock(&thinkpad_ec_mtx);
+	if (!ret)
+		(*count)++;
+	else if (ret == -EBUSY)
+		tpc_stats.busy++;
+	else if (ret == -EIO)
+		tpc_stats.io_errors++;
+	thinkpad_ec_hist(hist, ns);
+	mtx_unlock(&thinkpad_ec_mtx);
+	return ns;
+}
+
+static int thinkpad_ec_request_row(const struct thinkpad_ec_req *req)
+{
+	uint64_t start = cpu_ticks();
+	uint64_t ns;
+	int ret;
+
+	SDT_PROBE1(thinkpad_ec, , request, start, &req->args);
+	ret = __thinkpad_ec_request_row(req);
+	ns = thinkpad_ec_account(ret, &tpc_stats.requests,
+	    tpc_stats.request_ns, start);
+	SDT_PROBE3(thinkpad_ec, , request, done, &req->args, ret, ns);
+	return ret;
+}
+
+static int thinkpad_ec_read_data(struct thinkpad_ec_req *req)
 {
+	uint64_t start = cpu_ticks();
+	uint64_t ns;
 	int ret;
-        ret = (prefetch_ticks != TPC_PREFETCH_NONE) &&
-               (prefetch_ticks != TPC_PREFETCH_JUNK) &&
-               (prefetch_arg0 == args->val[0]) &&
-               (prefetch_argF == args->val[0xF]) &&
-               (ticks < prefetch_ticks + TPC_PREFETCH_TIMEOUT);
-/*	printf("prefetch_ticks: %i NONE:JUNK: %i:%i\n \
-		parg0:pargF: %i:%i arg0:argF: %i:%i\n \
-		ticks:TIMEOUT: %i:%i --> %i\n",
-		prefetch_ticks, TPC_PREFETCH_NONE, TPC_PREFETCH_JUNK,
-		prefetch_arg0, prefetch_argF, args->val[0], args->val[0xf],
-		ticks, TPC_PREFETCH_TIMEOUT, ret);
+
+	SDT_PROBE1(thinkpad_ec, , read, start, &req->args);
+	ret = __thinkpad_ec_read_data(req);
+	ns = thinkpad_ec_account(ret, &tpc_stats.reads, tpc_stats.read_ns,
+	    start);
+	SDT_PROBE4(thinkpad_ec, , read, done, &req->args, &req->data, ret, ns);
+	return ret;
+}
+
+/* Run the request and readout handshakes for one request, counting the
+ * attempts in @tr. Called by the worker only, without locks held.
+ */
+static int thinkpad_ec_transact(struct thinkpad_ec_req *req,
+				struct thinkpad_ec_trace_rec *tr)
+{
+        const struct thinkpad_ec_row *args = &req->args;
+        struct thinkpad_ec_deadline w;
+        int ret;
+
+        if (req->tr_issued) {
+                tr->request_tries = 1;
+                tr->flags |= TP_EC_TRACE_PIPELINED;
+                goto read_row; /* already requested by the pipeline */
+        }
+
+        /* Request the row */
+        thinkpad_ec_deadline_init(&w, TPC_READ_TIMEOUT_US);
+        do {
+                tr->request_tries++;
+                ret = thinkpad_ec_request_row(req);
+                if (!ret)
+                        goto read_row;
+                if (ret != -EBUSY)
+                        break;
+        } while (!thinkpad_ec_backoff(&w));
+	TPC_LOG(REQ_FMT("failed requesting row", ret));
+        return ret;
+
+read_row:
+        /* Read the row's data */
+        thinkpad_ec_deadline_init(&w, TPC_READ_TIMEOUT_US);
+        do {
+                tr->read_tries++;
+                ret = thinkpad_ec_read_data(req);
+                if (!ret)
+                        return 0;
+                if (ret!=-EBUSY)
+                        break;
+        } while (!thinkpad_ec_backoff(&w));
+
+	TPC_LOG(REQ_FMT("failed waiting for data", ret));
+        return ret;
+}
+
+/* Request states and flags (struct thinkpad_ec_req private part) */
+#define TPC_REQ_QUEUED		1
+#define TPC_REQ_RUNNING		2
+#define TPC_REQ_DONE		3
+
+#define TPC_REQF_PREFETCH	0x01	/* readout goes to a prefetch slot */
+#define TPC_REQF_BATCH		0x02	/* row of thinkpad_ec_read_rows() */
+#define TPC_REQF_STOP		0x04	/* batch stops if this row fails */
+
+/*****
+	Transaction trace (hw.thinkpad_ec.trace)
 */
+
+#define TPC_TRACE_LEN	512	/* records kept, power of 2 */
+
+static struct thinkpad_ec_trace_rec tpc_trace[TPC_TRACE_LEN];
+static uint64_t tpc_trace_seq;		/* records ever written */
+static int tpc_trace_enable = 1;
+
+SYSCTL_INT(_hw_thinkpad_ec, OID_AUTO, trace_enable, CTLFLAG_RW, &tpc_trace_enable, 0, "record EC transactions in the trace ring");
+
+/* Fill in the parts of a trace record known before the transaction */
+static void thinkpad_ec_trace_start(struct thinkpad_ec_trace_rec *tr,
+				    const struct thinkpad_ec_req *req,
+				    sbintime_t start)
+{
+	bzero(tr, sizeof(*tr));
+	tr->time_ns = sbttons(start);
+	tr->args_mask = req->args.mask;
+	bcopy(req->args.val, tr->args, sizeof(tr->args));
+	tr->prio = req->prio;
+	if (req->tr_flags & TPC_REQF_PREFETCH)
+		tr->flags |= TP_EC_TRACE_PREFETCH;
+	if (req->tr_flags & TPC_REQF_BATCH)
+		tr->flags |= TP_EC_TRACE_BATCH;
+}
+
+/* Complete a trace record and put it in the ring.
+ * Caller holds thinkpad_ec_mtx.
+ */
+static void thinkpad_ec_trace_end(struct thinkpad_ec_trace_rec *tr,
+				  const struct thinkpad_ec_req *req,
+				  int error, sbintime_t end)
+{
+	tpc_stats.port_io += tr->port_io;
+	if (!tpc_trace_enable)
+		return;
+	tr->latency_ns = sbttons(end) - tr->time_ns;
+	tr->error = error;
+	tr->str3 = tpc_str3;
+	if (!error) {
+		tr->data_mask = req->data.mask;
+		bcopy(req->data.val, tr->data, sizeof(tr->data));
+	}
+	tr->seq = tpc_trace_seq;
+	tpc_trace[tpc_trace_seq++ & (TPC_TRACE_LEN - 1)] = *tr;
+}
+
+static int thinkpad_ec_trace_sysctlproc(SYSCTL_HANDLER_ARGS)
+{
+	struct thinkpad_ec_trace_hdr hdr;
+	struct thinkpad_ec_trace_rec *recs;
+	uint64_t seq;
+	u_int i;
+	int error;
+
+	bzero(&hdr, sizeof(hdr));
+	hdr.magic = TP_EC_TRACE_MAGIC;
+	hdr.version = TP_EC_TRACE_VERSION;
+	hdr.rec_size = sizeof(struct thinkpad_ec_trace_rec);
+
+	if (req->oldptr == NULL)	/* size request */
+		return SYSCTL_OUT(req, NULL,
+		    sizeof(hdr) + sizeof(tpc_trace));
+
+	recs = malloc(sizeof(tpc_trace), M_TEMP, M_WAITOK);
+	mtx_lock(&thinkpad_ec_mtx);
+	seq = tpc_trace_seq > TPC_TRACE_LEN ? tpc_trace_seq - TPC_TRACE_LEN : 0;
+	for (i = 0; seq < tpc_trace_seq; i++, seq++)
+		recs[i] = tpc_trace[seq & (TPC_TRACE_LEN - 1)];
+	mtx_unlock(&thinkpad_ec_mtx);
+	hdr.count = i;
+
+	error = SYSCTL_OUT(req, &hdr, sizeof(hdr));
+	if (!error)
+		error = SYSCTL_OUT(req, recs, hdr.count * sizeof(*recs));
+	free(recs, M_TEMP);
+	return error;
+}
+
+SYSCTL_PROC(_hw_thinkpad_ec, OID_AUTO, trace, CTLTYPE_OPAQUE|CTLFLAG_RD, NULL, 0, thinkpad_ec_trace_sysctlproc, "S,thinkpad_ec_trace", "recent EC transactions (see thinkpad_ec.h)");
+
+/*****
+	Request queue and worker thread
+*/
+
+/* Scheduling.
+ * Each priority class has its own queue. Sampling (TP_EC_PRIO_RT) always
+ * goes first; interactive and background requests are served earliest
+ * deadline first, the deadline being their submission time plus the slack
+ * of their class, so background work is delayed but never starved.
+ * Sampling is periodic, so the worker also learns its period, from the
+ * prefetches the sampler issues once per poll, and won't start another
+ * request that would still be running when the next sample is due,
+ * unless that request is already past its deadline.
+ */
+static TAILQ_HEAD(, thinkpad_ec_req) tpc_queue[TP_EC_NPRIO];
+static int tpc_queue_len;
+
+static const sbintime_t tpc_prio_slack[TP_EC_NPRIO] = {
+	[TP_EC_PRIO_RT] =		0,
+	[TP_EC_PRIO_INTERACTIVE] =	5 * SBT_1MS,
+	[TP_EC_PRIO_BACKGROUND] =	100 * SBT_1MS,
+};
+
+static sbintime_t tpc_rt_last;		/* last sampling prefetch */
+static sbintime_t tpc_rt_period;	/* average sampling period, or 0 */
+static sbintime_t tpc_rt_gap;		/* last sampling period, or 0 */
+static sbintime_t tpc_service_est[TP_EC_NPRIO]; /* average service time */
+
+#define TPC_RT_PERIOD_MAX	SBT_1S	/* longer gaps aren't a period */
+#define TPC_PREFETCH_TTL_MAX	(2 * SBT_1S) /* see thinkpad_ec_find_prefetch */
+
+static struct thinkpad_ec_req *tpc_running;	/* request being served */
+static struct thinkpad_ec_req *tpc_batch_next;	/* queued row of a batch */
+
+static struct proc *tpc_worker;
+static int tpc_worker_exit;
+
+SYSCTL_INT(_hw_thinkpad_ec, OID_AUTO, queue_len, CTLFLAG_RD, &tpc_queue_len, 0, "requests waiting for the EC");
+
+static void thinkpad_ec_prefetch_done(struct thinkpad_ec_req *req);
+
+/* Moving average over 8 samples */
+#define TPC_EWMA(avg, val)	((avg) = (avg) ? ((avg) * 7 + (val)) / 8 : (val))
+
+/* Hand a finished request back to its submitter.
+ * Called with thinkpad_ec_mtx held; the request may be gone on return.
+ */
+static void thinkpad_ec_finish(struct thinkpad_ec_req *req, int error)
+{
+	struct thinkpad_ec_class_stats *cs = &tpc_stats.prio[req->prio];
+	struct thinkpad_ec_req *f;
+	sbintime_t now = sbinuptime();
+	uint64_t wait_ns;
+
+	wait_ns = sbttons(req->tr_started - req->tr_submitted);
+	tpc_stats.completed++;
+	thinkpad_ec_hist(tpc_stats.wait_ns, wait_ns);
+	thinkpad_ec_hist(tpc_stats.service_ns, sbttons(now - req->tr_started));
+	cs->completed++;
+	thinkpad_ec_hist(cs->wait_ns, wait_ns);
+	if (wait_ns > cs->wait_max_ns)
+		cs->wait_max_ns = wait_ns;
+	TPC_EWMA(tpc_service_est[req->prio], now - req->tr_started);
+
+	if (req == tpc_running)
+		tpc_running = NULL;
+
+	/* Rest of a batch that won't be served, see thinkpad_ec_chain() */
+	for (f = req->tr_next; f != NULL; f = f->tr_next) {
+		f->error = -ECANCELED;
+		f->tr_state = TPC_REQ_DONE;
+		wakeup(f);
+	}
+	req->tr_next = NULL;
+
+	/* Coalesced requests get a copy of the result first, since req
+	 * itself may be freed as soon as it is marked done. */
+	while ((f = TAILQ_FIRST(&req->tr_followers)) != NULL) {
+		TAILQ_REMOVE(&req->tr_followers, f, tr_link);
+		f->error = error;
+		f->taken = req->taken;
+		bcopy(req->data.val, f->data.val, sizeof(f->data.val));
+		f->tr_state = TPC_REQ_DONE;
+		if (f->done != NULL) {
+			mtx_unlock(&thinkpad_ec_mtx);
+			f->done(f, f->done_arg);
+			mtx_lock(&thinkpad_ec_mtx);
+		} else
+			wakeup(f);
+	}
+
+	req->error = error;
+	if (req->tr_flags & TPC_REQF_PREFETCH)
+		thinkpad_ec_prefetch_done(req);
+	req->tr_state = TPC_REQ_DONE;
+	if (req->done != NULL) {
+		mtx_unlock(&thinkpad_ec_mtx);
+		req->done(req, req->done_arg);
+		mtx_lock(&thinkpad_ec_mtx);
+	} else
+		wakeup(req);
+}
+
+/* Choose the request to serve next, without dequeueing it.
+ * Returns NULL if there is none, or if the candidate has to wait for the
+ * next sampling slot to pass; *hold is then set to when to look again.
+ * Caller holds thinkpad_ec_mtx.
+ */
+static struct thinkpad_ec_req *thinkpad_ec_pick(sbintime_t now,
+						sbintime_t *hold)
+{
+	struct thinkpad_ec_req *req, *best = NULL;
+	sbintime_t next_rt;
+	int prio;
+
+	*hold = 0;
+	req = TAILQ_FIRST(&tpc_queue[TP_EC_PRIO_RT]);
+	if (req != NULL)
+		return req;
+
+	/* A batch, once started, isn't interleaved with anything else */
+	best = tpc_batch_next;
+	for (prio = TP_EC_PRIO_RT + 1; best == NULL && prio < TP_EC_NPRIO;
+	    prio++) {
+		req = TAILQ_FIRST(&tpc_queue[prio]);
+		if (req != NULL &&
+		    (best == NULL || req->tr_deadline < best->tr_deadline))
+			best = req;
+	}
+	if (best == NULL || tpc_rt_period == 0 || now >= best->tr_deadline)
+		return best;
+
+	/* Keep the EC free for the sample that is due soon. A sample that
+	 * is more than a quarter period late isn't waited for. */
+	next_rt = tpc_rt_last + tpc_rt_period;
+	if (now + tpc_service_est[best->prio] > next_rt &&
+	    now < next_rt + tpc_rt_period / 4) {
+		*hold = next_rt + tpc_rt_period / 4;
+		if (*hold > best->tr_deadline)
+			*hold = best->tr_deadline;
+		return NULL;
+	}
+	return best;
+}
+
+/* Queue the next row of a batch right after the one just served, so the
+ * pipeline requests it from the EC while this one is being completed;
+ * thinkpad_ec_pick() serves it before any other request but sampling.
+ * Rows left chained are cancelled by thinkpad_ec_finish().
+ * Caller holds thinkpad_ec_mtx.
+ */
+static void thinkpad_ec_chain(struct thinkpad_ec_req *req, int error)
+{
+	struct thinkpad_ec_req *next = req->tr_next;
+	sbintime_t now;
+
+	if (next == NULL || tpc_worker_exit ||
+	    (error && (req->tr_flags & TPC_REQF_STOP)))
+		return;
+
+	req->tr_next = NULL;
+	now = sbinuptime();
+	next->tr_submitted = now;
+	next->tr_deadline = now + tpc_prio_slack[next->prio];
+	TAILQ_INSERT_HEAD(&tpc_queue[next->prio], next, tr_link);
+	tpc_batch_next = next;
+	tpc_stats.submitted++;
+	if (++tpc_queue_len > tpc_stats.queue_max)
+		tpc_stats.queue_max = tpc_queue_len;
+}
+
+static void thinkpad_ec_dequeue(struct thinkpad_ec_req *req)
+{
+	TAILQ_REMOVE(&tpc_queue[req->prio], req, tr_link);
+	if (req == tpc_batch_next)
+		tpc_batch_next = NULL;
+	tpc_queue_len--;
+	req->tr_state = TPC_REQ_RUNNING;
+	req->tr_started = sbinuptime();
+}
+
+/*****
+	Hang detection and recovery
+*/
+
+/* A wedged EC shows up as transactions failing in a row: STR3 stuck at
+ * some odd value, or the EC not answering at all. The worker then stops
+ * taking requests, fails the queued ones, drains whatever readout is
+ * stuck in the output buffer and repeats the thinkpad_ec_test() handshake,
+ * backing off between attempts, until the EC answers again. Clients are
+ * then told through the thinkpad_ec_reset event, since EC state such as
+ * accelerometer power may have been lost.
+ */
+#define TPC_EC_OK		0
+#define TPC_EC_RECOVERING	1
+
+#define TPC_RECOVER_MIN		SBT_1MS	/* first retry delay, doubles up */
+#define TPC_RECOVER_MAX		SBT_1S	/* longest retry delay */
+
+static int tpc_ec_state = TPC_EC_OK;
+static int tpc_fail_run;		/* transactions failed in a row */
+static int tpc_hang_threshold = 3;
+
+SYSCTL_INT(_hw_thinkpad_ec, OID_AUTO, state, CTLFLAG_RD, &tpc_ec_state, 0, "0 ok, 1 recovering from an EC hang");
+SYSCTL_INT(_hw_thinkpad_ec, OID_AUTO, hang_threshold, CTLFLAG_RW, &tpc_hang_threshold, 0, "failed transactions in a row taken as an EC hang");
+
+/* battery 0 basic status, see thinkpad_ec_test() */
+static const struct thinkpad_ec_row tpc_test_args =
+	{ .mask=0x8001, .val={0x01,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x00} };
+
+static int thinkpad_ec_req_init(struct thinkpad_ec_req *req, int flags,
+				sbintime_t now);
+
+/* Throw away any readout left in the output buffer and wait for the EC
+ * to go idle. Worker only, unlocked.
+ */
+static int thinkpad_ec_drain(void)
+{
+	struct thinkpad_ec_deadline w;
+	u_char str3;
+
+	thinkpad_ec_deadline_init(&w, TPC_REQUEST_TIMEOUT_US);
+	do {
+		str3 = TPC_STR3();
+		if (str3 == 0x00)
+			return 0;
+		if (str3 & H8S_STR3_OBF3B)
+			TPC_INB(TPC_TWR15_PORT); /* ends the stale readout */
+	} while (!thinkpad_ec_backoff(&w));
+	return -EIO;
+}
+
+/* One recovery attempt: drain, then the test handshake. Worker only. */
+static int thinkpad_ec_probe_ec(void)
+{
+	struct thinkpad_ec_trace_rec tr;
+	struct thinkpad_ec_req req;
+
+	if (thinkpad_ec_drain())
+		return -EIO;
+
+	bzero(&req, sizeof(req));
+	req.args = tpc_test_args;
+	req.prio = TP_EC_PRIO_BACKGROUND;
+	thinkpad_ec_req_init(&req, 0, sbinuptime());
+	bzero(&tr, sizeof(tr));
+	return thinkpad_ec_transact(&req, &tr);
+}
+
+/* Note the result of a transaction; returns nonzero if the EC looks hung.
+ * Caller holds thinkpad_ec_mtx.
+ */
+static int thinkpad_ec_check_hang(int error)
+{
+	if (error != -EIO && error != -EBUSY) {
+		tpc_fail_run = 0;
+		return 0;
+	}
+	return ++tpc_fail_run >= tpc_hang_threshold && tpc_hang_threshold > 0;
+}
+
+/* Get a hung EC going again. Called by the worker with thinkpad_ec_mtx
+ * held; drops it while talking to the EC or sleeping.
+ */
+static void thinkpad_ec_recover(void)
+{
+	struct thinkpad_ec_req *req;
+	sbintime_t start, backoff;
+	int prio, ret, tries;
+
+	tpc_ec_state = TPC_EC_RECOVERING;
+	tpc_stats.outages++;
+	start = sbinuptime();
+	device_printf(sc->dev, MSG_FMT("EC hang detected, recovering"));
+
+	for (prio = 0; prio < TP_EC_NPRIO; prio++)
+		while ((req = TAILQ_FIRST(&tpc_queue[prio])) != NULL) {
+			thinkpad_ec_dequeue(req);
+			thinkpad_ec_finish(req, -EIO);
+		}
+
+	backoff = TPC_RECOVER_MIN;
+	for (tries = 1;; tries++) {
+		mtx_unlock(&thinkpad_ec_mtx);
+		ret = thinkpad_ec_probe_ec();
+		mtx_lock(&thinkpad_ec_mtx);
+		tpc_stats.recovery_attempts++;
+		if (!ret || tpc_worker_exit)
+			break;
+		/* worker_stop wakes us through tpc_queue */
+		msleep_sbt(&tpc_queue, &thinkpad_ec_mtx, 0, "tpcrcv", backoff,
+		    0, 0);
+		backoff <<= 1;
+		if (backoff > TPC_RECOVER_MAX)
+			backoff = TPC_RECOVER_MAX;
+	}
+
+	tpc_fail_run = 0;
+	tpc_ec_state = TPC_EC_OK;
+	if (ret)
+		return;	/* unloading */
+
+	tpc_stats.recoveries++;
+	thinkpad_ec_hist(tpc_stats.recovery_ns, sbttons(sbinuptime() - start));
+	device_printf(sc->dev, MSG_FMT("EC recovered after %d attempts", tries));
+
+	mtx_unlock(&thinkpad_ec_mtx);
+	EVENTHANDLER_INVOKE(thinkpad_ec_reset);
+	mtx_lock(&thinkpad_ec_mtx);
+}
+
+/* The EC worker: the only thread that talks to the EC.
+ * While one request is being completed, the next one is already
+ * requested from the EC, so the EC prepares its reply in the meantime.
+ * Such a request has been handed to the EC and is served next whatever
+ * arrives in between.
+ */
+static void thinkpad_ec_worker(void *arg)
+{
+	struct thinkpad_ec_req *req, *next;
+	struct thinkpad_ec_trace_rec tr;
+	sbintime_t hold;
+	int prio, ret;
+
+	mtx_lock(&thinkpad_ec_mtx);
+	req = NULL;
+	for (;;) {
+		while (req == NULL && !tpc_worker_exit) {
+			req = thinkpad_ec_pick(sbinuptime(), &hold);
+			if (req != NULL) {
+				thinkpad_ec_dequeue(req);
+			} else if (hold != 0) {
+				tpc_stats.slot_holds++;
+				msleep_sbt(&tpc_queue, &thinkpad_ec_mtx, 0,
+				    "tpcslot", hold, 0, C_ABSOLUTE);
+			} else
+				mtx_sleep(&tpc_queue, &thinkpad_ec_mtx, 0,
+				    "tpcidle", 0);
+		}
+		if (req == NULL)
+			break;
+
+		tpc_running = req;
+		thinkpad_ec_trace_start(&tr, req, req->tr_started);
+		mtx_unlock(&thinkpad_ec_mtx);
+
+		tpc_port_io = req->tr_port_io;
+		ret = thinkpad_ec_transact(req, &tr);
+		tr.port_io = tpc_port_io;
+
+		/* Pipeline: get the EC going on the next request */
+		mtx_lock(&thinkpad_ec_mtx);
+		req->taken = sbinuptime();
+		thinkpad_ec_trace_end(&tr, req, ret, req->taken);
+		thinkpad_ec_chain(req, ret);
+		if (thinkpad_ec_check_hang(ret)) {
+			/* don't pipeline anything to a hung EC */
+			thinkpad_ec_finish(req, ret);
+			req = NULL;
+			thinkpad_ec_recover();
+			continue;
+		}
+		next = tpc_worker_exit ? NULL : thinkpad_ec_pick(sbinuptime(), &hold);
+		if (next != NULL) {
+			thinkpad_ec_dequeue(next);
+			mtx_unlock(&thinkpad_ec_mtx);
+			tpc_port_io = 0;
+			next->tr_issued = !thinkpad_ec_request_row(next);
+			next->tr_port_io = tpc_port_io;
+			mtx_lock(&thinkpad_ec_mtx);
+		}
+
+		thinkpad_ec_finish(req, ret);
+		req = next;
+	}
+
+	/* Fail whatever is left */
+	for (prio = 0; prio < TP_EC_NPRIO; prio++)
+		while ((req = TAILQ_FIRST(&tpc_queue[prio])) != NULL) {
+			thinkpad_ec_dequeue(req);
+			thinkpad_ec_finish(req, -ENXIO);
+		}
+
+	tpc_worker = NULL;
+	wakeup(&tpc_worker);
+	mtx_unlock(&thinkpad_ec_mtx);
+	kproc_exit(0);
+}
+
+static int thinkpad_ec_worker_start(void)
+{
+	int prio;
+
+	for (prio = 0; prio < TP_EC_NPRIO; prio++)
+		TAILQ_INIT(&tpc_queue[prio]);
+	tpc_queue_len = 0;
+	tpc_batch_next = NULL;
+	tpc_rt_last = tpc_rt_period = tpc_rt_gap = 0;
+	tpc_worker_exit = 0;
+	return kproc_create(thinkpad_ec_worker, NULL, &tpc_worker, 0, 0,
+	    DEVICE_NAME);
+}
+
+static void thinkpad_ec_worker_stop(void)
+{
+	mtx_lock(&thinkpad_ec_mtx);
+	tpc_worker_exit = 1;
+	wakeup(&tpc_queue);
+	while (tpc_worker != NULL)
+		mtx_sleep(&tpc_worker, &thinkpad_ec_mtx, 0, "tpcstop", 0);
+	mtx_unlock(&thinkpad_ec_mtx);
+}
+
+/* Do two argument rows describe the same request?
+ * Only the bytes selected by the (identical) masks are compared.
+ */
+static int thinkpad_ec_args_match(const struct thinkpad_ec_row *a,
+				  const struct thinkpad_ec_row *b)
+{
+	int i;
+
+	if (a->mask != b->mask)
+		return 0;
+	for (i=0; i<TP_CONTROLLER_ROW_LEN; i++)
+		if (((a->mask>>i)&1) && a->val[i] != b->val[i])
+			return 0;
+	return 1;
+}
+
+/* Single flight: find a queued or running request that a new request
+ * with the same args can share. A queued leader has its data mask widened
+ * as needed, and is raised to the new request's class and deadline if
+ * those are more urgent; a running one must already read every byte wanted.
+ * Only plain waited-for requests lead: a prefetch's readout belongs to
+ * the prefetch slot, a batch row must keep its place in the batch, and
+ * a request with a done callback may be gone or reused by its owner as
+ * soon as that has run.
+ */
+#define TPC_CAN_LEAD(l) \
+	(!((l)->tr_flags & (TPC_REQF_PREFETCH | TPC_REQF_BATCH)) && \
+	 (l)->done == NULL)
+
+static struct thinkpad_ec_req *
+thinkpad_ec_find_leader(const struct thinkpad_ec_req *req)
+{
+	struct thinkpad_ec_req *l;
+	int prio;
+
+	l = tpc_running;
+	if (l != NULL && TPC_CAN_LEAD(l) &&
+	    (req->data.mask & ~l->data.mask) == 0 &&
+	    thinkpad_ec_args_match(&l->args, &req->args))
+		return l;
+
+	for (prio = 0; prio < TP_EC_NPRIO; prio++)
+		TAILQ_FOREACH(l, &tpc_queue[prio], tr_link)
+			if (TPC_CAN_LEAD(l) &&
+			    thinkpad_ec_args_match(&l->args, &req->args))
+				goto found;
+	return NULL;
+
+found:
+	l->data.mask |= req->data.mask;
+	if (req->tr_deadline < l->tr_deadline)
+		l->tr_deadline = req->tr_deadline;
+	if (req->prio < l->prio) {
+		TAILQ_REMOVE(&tpc_queue[l->prio], l, tr_link);
+		l->prio = req->prio;
+		TAILQ_INSERT_TAIL(&tpc_queue[l->prio], l, tr_link);
+		tpc_stats.promoted++;
+	}
+	return l;
+}
+
+/* Check a new request and set up its private fields */
+static int thinkpad_ec_req_init(struct thinkpad_ec_req *req, int flags,
+				sbintime_t now)
+{
+	/* EC protocol requires write to TWR0 (function code): */
+	if (!(req->args.mask & 0x0001))
+		return -EINVAL;
+	if (req->prio < 0 || req->prio >= TP_EC_NPRIO)
+		return -EINVAL;
+
+	req->tr_cmd = thinkpad_ec_find_cmd(&req->args);
+	if (!thinkpad_ec_mask_ok(req->tr_cmd, req->data.mask))
+		return -EINVAL;
+
+	req->error = 0;
+	req->tr_state = TPC_REQ_QUEUED;
+	req->tr_flags = flags;
+	req->tr_issued = 0;
+	req->tr_next = NULL;
+	req->tr_port_io = 0;
+	req->tr_submitted = now;
+	req->tr_deadline = now + tpc_prio_slack[req->prio];
+	TAILQ_INIT(&req->tr_followers);
+	return 0;
+}
+
+/* Queue a request, or attach it to an identical one already in flight.
+ * Caller holds thinkpad_ec_mtx.
+ */
+static int __thinkpad_ec_submit(struct thinkpad_ec_req *req, int flags)
+{
+	struct thinkpad_ec_req *leader;
+	sbintime_t now;
+	int ret;
+
+	now = sbinuptime();
+	ret = thinkpad_ec_req_init(req, flags, now);
+	if (ret)
+		return ret;
+	if (tpc_worker == NULL || tpc_worker_exit)
+		return -ENXIO;
+	if (tpc_ec_state != TPC_EC_OK)
+		return -EBUSY;
+	tpc_stats.submitted++;
+
+	/* The sampler prefetches once per period; its other sampling
+	 * requests, such as draining the EC queue right after a readout,
+	 * come at no particular time and would skew the period. */
+	if (req->prio == TP_EC_PRIO_RT && (flags & TPC_REQF_PREFETCH)) {
+		if (tpc_rt_last != 0 && now - tpc_rt_last < TPC_RT_PERIOD_MAX)
+			TPC_EWMA(tpc_rt_period, now - tpc_rt_last);
+		if (tpc_rt_last != 0)
+			tpc_rt_gap = MIN(now - tpc_rt_last, TPC_PREFETCH_TTL_MAX);
+		tpc_rt_last = now;
+	}
+
+	if (!(flags & (TPC_REQF_PREFETCH | TPC_REQF_BATCH)) &&
+	    (leader = thinkpad_ec_find_leader(req)) != NULL) {
+		TAILQ_INSERT_TAIL(&leader->tr_followers, req, tr_link);
+		tpc_stats.coalesced++;
+		return 0;
+	}
+
+	TAILQ_INSERT_TAIL(&tpc_queue[req->prio], req, tr_link);
+	if (++tpc_queue_len > tpc_stats.queue_max)
+		tpc_stats.queue_max = tpc_queue_len;
+	wakeup(&tpc_queue);
+	return 0;
+}
+
+/**
+ * thinkpad_ec_submit - queue an asynchronous EC request
+ * @req Request; @req->args and @req->data.mask as for thinkpad_ec_read_row()
+ *
+ * Queue @req for the EC worker thread, in priority class @req->prio:
+ * TP_EC_PRIO_RT for periodic sampling, TP_EC_PRIO_INTERACTIVE for requests
+ * someone is waiting on, TP_EC_PRIO_BACKGROUND for anything else. If an identical request is already
+ * queued or being served, @req shares its result instead of costing
+ * another EC transaction. When it has been served,
+ * @req->error and @req->data are filled in and @req->done is called from
+ * the worker thread; that callback must neither sleep nor wait for other
+ * EC requests. If @req->done is NULL, use thinkpad_ec_wait() instead.
+ * @req must stay allocated until then. Never sleeps; no lock required.
+ *
+ * Returns 0 if queued, -EINVAL for bad args or class, or for a data mask
+ * asking for registers the command's reply doesn't use, -EBUSY while the EC
+ * is recovering from a hang and -ENXIO if the EC is gone.
+ */
+int thinkpad_ec_submit(struct thinkpad_ec_req *req)
+{
+	int ret;
+
+	mtx_lock(&thinkpad_ec_mtx);
+	ret = __thinkpad_ec_submit(req, 0);
+	mtx_unlock(&thinkpad_ec_mtx);
+	return ret;
+}
+
+/**
+ * thinkpad_ec_wait - wait for a request queued without callback
+ * @req Request passed to thinkpad_ec_submit() with @req->done == NULL
+ *
+ * Sleeps until the request has been served and returns @req->error.
+ */
+int thinkpad_ec_wait(struct thinkpad_ec_req *req)
+{
+	int ret;
+
+	mtx_lock(&thinkpad_ec_mtx);
+	while (req->tr_state != TPC_REQ_DONE)
+		mtx_sleep(req, &thinkpad_ec_mtx, 0, "tpcreq", 0);
+	ret = req->error;
+	mtx_unlock(&thinkpad_ec_mtx);
 	return ret;
+}
+
+/*****
+	Prefetch slots (all under thinkpad_ec_mtx)
+*/
+
+/* Find the prefetch slot for the given args, or NULL.
+ * Readouts older than hw.thinkpad_ec.prefetch_timeout_us are dropped on
+ * the way; but a sampler polling more slowly than that, such as hdaps
+ * while idle, would then never find its row. So a readout is also kept
+ * for one and a half times the last gap between sampling prefetches.
+ */
+static struct thinkpad_ec_prefetch *
+thinkpad_ec_find_prefetch(const struct thinkpad_ec_row *args)
+{
+	struct thinkpad_ec_prefetch *p;
+	sbintime_t expired, ttl;
+
+	ttl = MAX(tpc_prefetch_timeout_us * SBT_1US,
+	    tpc_rt_gap + tpc_rt_gap / 2);
+	expired = sbinuptime() - ttl;
+	for (p = prefetch_slots; p < prefetch_slots + TPC_PREFETCH_SLOTS; p++) {
+		if (p->state == TPC_SLOT_FREE)
+			continue;
+		if (p->state == TPC_SLOT_READY && p->taken <= expired) {
+			p->state = TPC_SLOT_FREE;
+			tpc_stats.prefetch_expired++;
+			continue;
+		}
+		if (thinkpad_ec_args_match(&p->req.args, args))
+			return p;
+	}
+	return NULL;
+}
 
+/* Get a slot for a new prefetch of the given args: the ready one for
+ * these args, a free one, or else the oldest ready one. Slots in flight
+ * can't be reused; returns NULL if all are.
+ */
+static struct thinkpad_ec_prefetch *
+thinkpad_ec_alloc_prefetch(const struct thinkpad_ec_row *args)
+{
+	struct thinkpad_ec_prefetch *p, *victim = NULL;
+	const struct thinkpad_ec_cmd *cmd;
+	int i;
+
+	p = thinkpad_ec_find_prefetch(args);
+	if (p == NULL) {
+		for (p = prefetch_slots; p < prefetch_slots + TPC_PREFETCH_SLOTS; p++) {
+			if (p->state == TPC_SLOT_FREE) {
+				victim = p;
+				break;
+			}
+			if (p->state == TPC_SLOT_READY &&
+			    (victim == NULL || p->taken < victim->taken))
+				victim = p;
+		}
+		if (victim == NULL)
+			return NULL;
+		p = victim;
+	}
+	if (p->state != TPC_SLOT_FREE)
+		tpc_stats.prefetch_evicts++;
+
+	p->req.args.mask = args->mask;
+	for (i=0; i<TP_CONTROLLER_ROW_LEN; i++)
+		p->req.args.val[i] = ((args->mask>>i)&1) ? args->val[i] : 0;
+	/* we don't know what the reader wants: all the reply has */
+	cmd = thinkpad_ec_find_cmd(&p->req.args);
+	p->req.data.mask = cmd != NULL ? cmd->reply_mask : 0xFFFF;
+	p->req.done = NULL;
+	p->req.prio = TP_EC_PRIO_RT; /* prefetching is for sampling */
+	p->junk = 0;
+	return p;
+}
+
+/* Hand out the data of a ready slot and release the slot. */
+static void thinkpad_ec_take_prefetch(struct thinkpad_ec_prefetch *p,
+				      struct thinkpad_ec_row *data)
+{
+	uint64_t age = sbttons(sbinuptime() - p->taken);
+
+	bcopy(p->req.data.val, data->val, sizeof(data->val));
+	p->state = TPC_SLOT_FREE;
+	thinkpad_ec_hist(tpc_stats.prefetch_age_ns, age);
+	SDT_PROBE2(thinkpad_ec, , prefetch, hit, &p->req.args, age);
+}
+
+/* Worker completion of a prefetch request */
+static void thinkpad_ec_prefetch_done(struct thinkpad_ec_req *req)
+{
+	struct thinkpad_ec_prefetch *p;
+
+	p = __containerof(req, struct thinkpad_ec_prefetch, req);
+	if (req->error || p->junk) {
+		p->state = TPC_SLOT_FREE;
+	} else {
+		p->state = TPC_SLOT_READY;
+		p->taken = req->taken;
+	}
+	wakeup(p);
 }
 
 /**
@@ -309,44 +1773,138 @@ static int thinkpad_ec_is_row_fetched(const struct thinkpad_ec_row *args)
  * bit in @data->mask. That is, if (@data->mask>>i)&1==0 then @data->val[i]
  * may not be filled (to save time).
  *
- * Returns -EBUSY on transient error and -EIO on abnormal condition.
- * Caller must hold controller lock.
+ * This is thinkpad_ec_submit() of an interactive request followed by
+ * thinkpad_ec_wait(), unless the row is prefetched. May sleep.
+ *
+ * Returns -EBUSY on transient error, -EIO on abnormal condition and
+ * -EINVAL for a @data->mask the command's reply doesn't cover.
+ * Caller should hold controller lock.
  */
 int thinkpad_ec_read_row(const struct thinkpad_ec_row *args,
                            struct thinkpad_ec_row *data)
 {
-        int retries, ret;
+        struct thinkpad_ec_prefetch *p;
+        struct thinkpad_ec_req req;
+        int ret;
 
-        if (thinkpad_ec_is_row_fetched(args))
-                goto read_row; /* already requested */
+        if (!thinkpad_ec_mask_ok(thinkpad_ec_find_cmd(args), data->mask))
+                return -EINVAL;
+
+        mtx_lock(&thinkpad_ec_mtx);
+        while ((p = thinkpad_ec_find_prefetch(args)) != NULL) {
+                if (p->state == TPC_SLOT_READY) {
+                        thinkpad_ec_take_prefetch(p, data);
+                        tpc_stats.prefetch_hits++;
+                        mtx_unlock(&thinkpad_ec_mtx);
+                        return 0;
+                }
+                /* prefetch in flight; wait for it */
+                mtx_sleep(p, &thinkpad_ec_mtx, 0, "tpcpf", 0);
+        }
+        tpc_stats.prefetch_misses++;
+        SDT_PROBE1(thinkpad_ec, , prefetch, miss, args);
+
+        req.args = *args;
+        req.data.mask = data->mask;
+        req.done = NULL;
+        req.prio = TP_EC_PRIO_INTERACTIVE;
+        ret = __thinkpad_ec_submit(&req, 0);
+        mtx_unlock(&thinkpad_ec_mtx);
+        if (ret)
+                return ret;
+
+        ret = thinkpad_ec_wait(&req);
+        if (!ret)
+                bcopy(req.data.val, data->val, sizeof(data->val));
+        return ret;
+}
 
-        /* Request the row */
-        for (retries=0; retries<TPC_READ_RETRIES; ++retries) {
-                ret = thinkpad_ec_request_row(args);
-                if (!ret)
-                        goto read_row;
-                if (ret != -EBUSY)
-                        break;
-                DELAY(TPC_READ_NDELAY); /* XXX */
+/**
+ * thinkpad_ec_read_rows - request and read several data rows from ThinkPad EC
+ * @args Input register arguments, @n rows
+ * @data Output register values, @n rows
+ * @status Per-row result, @n entries, or NULL
+ * @n Number of rows, at most TP_EC_ROWS_MAX
+ * @flags TP_EC_ROWS_STOP to skip the rows after the first failed one
+ *
+ * Read the rows in order, as with thinkpad_ec_read_row() for each, but
+ * back to back: the worker requests each row from the EC while it is
+ * still completing the previous one, and once the first row is served
+ * no other client's request gets in between (sampling excepted, and it
+ * may hold a row back for a sampling slot). Skipped rows get -ECANCELED.
+ * May sleep.
+ *
+ * Returns 0 if all rows were read, else the first row's error; -EINVAL
+ * for bad args, in which case nothing is read. If the batch can't be
+ * queued at all, every @status entry gets that error.
+ * Caller should hold controller lock.
+ */
+int thinkpad_ec_read_rows(const struct thinkpad_ec_row *args,
+                          struct thinkpad_ec_row *data, int *status,
+                          int n, int flags)
+{
+        struct thinkpad_ec_req *reqs;
+        sbintime_t start;
+        int i, ret, first = 0;
+
+        if (n <= 0)
+                return -EINVAL;
+        if (n > TP_EC_ROWS_MAX) {
+                ret = -EINVAL;
+                goto fail;
         }
-	device_printf(sc->dev, REQ_FMT("failed requesting row", ret));
-        goto out;
 
-read_row:
-        /* Read the row's data */
-        for (retries=0; retries<TPC_READ_RETRIES; ++retries) {
-                ret = thinkpad_ec_read_data(args, data);
-                if (!ret)
-                        goto out;
-                if (ret!=-EBUSY)
-                        break;
-                DELAY(TPC_READ_NDELAY); /*XXX*/
+        reqs = malloc(n * sizeof(*reqs), M_DEVBUF, M_WAITOK | M_ZERO);
+        start = sbinuptime();
+        for (i = 0; i < n; i++) {
+                reqs[i].args = args[i];
+                reqs[i].data.mask = data[i].mask;
+                reqs[i].prio = TP_EC_PRIO_INTERACTIVE;
+                ret = thinkpad_ec_req_init(&reqs[i], TPC_REQF_BATCH |
+                    ((flags & TP_EC_ROWS_STOP) ? TPC_REQF_STOP : 0), start);
+                if (ret) {
+                        free(reqs, M_DEVBUF);
+                        goto fail;
+                }
+        }
+
+        /* Only the first row is queued; thinkpad_ec_chain() does the rest */
+        mtx_lock(&thinkpad_ec_mtx);
+        ret = __thinkpad_ec_submit(&reqs[0], reqs[0].tr_flags);
+        if (!ret)
+                for (i = 0; i < n - 1; i++)
+                        reqs[i].tr_next = &reqs[i + 1];
+        mtx_unlock(&thinkpad_ec_mtx);
+        if (ret) {
+                free(reqs, M_DEVBUF);
+                goto fail;
         }
 
-	device_printf(sc->dev, REQ_FMT("failed waiting for data", ret));
+        for (i = 0; i < n; i++) {
+                ret = thinkpad_ec_wait(&reqs[i]);
+                if (status != NULL)
+                        status[i] = ret;
+                if (!ret)
+                        bcopy(reqs[i].data.val, data[i].val,
+                            sizeof(data[i].val));
+                else if (!first)
+                        first = ret;
+        }
+        ret = first;
+
+        mtx_lock(&thinkpad_ec_mtx);
+        tpc_stats.batches++;
+        tpc_stats.batch_rows += n;
+        thinkpad_ec_hist(tpc_stats.batch_ns, sbttons(sbinuptime() - start));
+        mtx_unlock(&thinkpad_ec_mtx);
+        free(reqs, M_DEVBUF);
+        return ret;
 
-out:
-        prefetch_ticks = TPC_PREFETCH_JUNK;
+fail:
+        /* nothing was read */
+        if (status != NULL)
+                for (i = 0; i < n; i++)
+                        status[i] = ret;
         return ret;
 }
 
@@ -360,20 +1918,52 @@ out:
  * thinkpad_ec_prefetch_row(). Does not fetch, retry or block.
  * The parameters have the same meaning as in thinkpad_ec_read_row().
  *
- * Returns -EBUSY is data not ready and -ENOATTR if row not prefetched.
- * Caller must hold controller lock.
+ * Returns -EBUSY is data not ready and -ENOATTR if row not prefetched,
+ * -EINVAL as for thinkpad_ec_read_row().
+ * Caller should hold controller lock.
  */
 int thinkpad_ec_try_read_row(const struct thinkpad_ec_row *args,
                                struct thinkpad_ec_row *data)
 {
+        sbintime_t taken;
+
+        return thinkpad_ec_try_read_row_time(args, data, &taken);
+}
+
+/**
+ * thinkpad_ec_try_read_row_time - thinkpad_ec_try_read_row(), with its age
+ * @args Input register arguments
+ * @data Output register values
+ * @taken Set to the sbinuptime() at which the EC was read, on success
+ *
+ * As thinkpad_ec_try_read_row(). A prefetched row may have waited for up
+ * to hw.thinkpad_ec.prefetch_timeout_us, or longer for a slow sampler (see
+ * thinkpad_ec_find_prefetch()), so @taken tells how old it is.
+ */
+int thinkpad_ec_try_read_row_time(const struct thinkpad_ec_row *args,
+                                  struct thinkpad_ec_row *data,
+                                  sbintime_t *taken)
+{
+        struct thinkpad_ec_prefetch *p;
         int ret;
-        if (!thinkpad_ec_is_row_fetched(args)) {
+
+        if (!thinkpad_ec_mask_ok(thinkpad_ec_find_cmd(args), data->mask))
+                return -EINVAL;
+
+        mtx_lock(&thinkpad_ec_mtx);
+        p = thinkpad_ec_find_prefetch(args);
+        if (p == NULL) {
+                tpc_stats.prefetch_misses++;
+                SDT_PROBE1(thinkpad_ec, , prefetch, miss, args);
                 ret = -ENOATTR;
-        } else {
-                ret = thinkpad_ec_read_data(args, data);
-                if (!ret)
-                        prefetch_ticks = TPC_PREFETCH_NONE; /* eaten up */
-        }
+        } else if (p->state == TPC_SLOT_READY) {
+                *taken = p->taken;
+                thinkpad_ec_take_prefetch(p, data);
+                tpc_stats.prefetch_hits++;
+                ret = 0;
+        } else
+                ret = -EBUSY;
+        mtx_unlock(&thinkpad_ec_mtx);
         return ret;
 }
 
@@ -387,21 +1977,32 @@ int thinkpad_ec_try_read_row(const struct thinkpad_ec_row *args,
  * thinkpad_ec_try_read_row() stands a good chance of succeeding if
  * done neither too soon nor too late. See
  * thinkpad_ec_read_row() for the meaning of @args.
+ * Only queues the request; never sleeps.
  *
- * Returns -EBUSY on transient error and -EIO on abnormal condition.
- * Caller must hold controller lock.
+ * Returns -EBUSY if all prefetch slots are in flight.
+ * Caller should hold controller lock.
  */
 int thinkpad_ec_prefetch_row(const struct thinkpad_ec_row *args)
 {
+        struct thinkpad_ec_prefetch *p;
         int ret;
-        ret = thinkpad_ec_request_row(args);
-        if (ret) {
-                prefetch_ticks = TPC_PREFETCH_JUNK;
+
+        mtx_lock(&thinkpad_ec_mtx);
+        p = thinkpad_ec_find_prefetch(args);
+        if (p != NULL && p->state == TPC_SLOT_PENDING) {
+                mtx_unlock(&thinkpad_ec_mtx);
+                return 0; /* already requested */
+        }
+
+        p = thinkpad_ec_alloc_prefetch(args);
+        if (p == NULL) {
+                ret = -EBUSY;
         } else {
-                prefetch_ticks = ticks;
-                prefetch_arg0 = args->val[0x0];
-                prefetch_argF = args->val[0xF];
+                ret = __thinkpad_ec_submit(&p->req, TPC_REQF_PREFETCH);
+                p->state = ret ? TPC_SLOT_FREE : TPC_SLOT_PENDING;
         }
+        SDT_PROBE2(thinkpad_ec, , prefetch, issue, args, ret);
+        mtx_unlock(&thinkpad_ec_mtx);
         return ret;
 }
 
@@ -409,13 +2010,23 @@ int thinkpad_ec_prefetch_row(const struct thinkpad_ec_row *args)
  * thinkpad_ec_invalidate - invalidate prefetched ThinkPad EC data
  *
  * Invalidate the data prefetched via thinkpad_ec_prefetch_row() from the
- * ThinkPad embedded controller LPC3 interface.
- * Must be called before unlocking by any code that accesses the controller
- * ports directly.
+ * ThinkPad embedded controller LPC3 interface. Prefetches still in flight
+ * are dropped when they complete.
+ * Must be called by code that changes EC state the prefetched rows
+ * depend on.
  */
 void thinkpad_ec_invalidate(void) 
 {
-        prefetch_ticks = TPC_PREFETCH_JUNK;
+        struct thinkpad_ec_prefetch *p;
+
+        mtx_lock(&thinkpad_ec_mtx);
+        for (p = prefetch_slots; p < prefetch_slots + TPC_PREFETCH_SLOTS; p++) {
+                if (p->state == TPC_SLOT_PENDING)
+                        p->junk = 1;
+                else
+                        p->state = TPC_SLOT_FREE;
+        }
+        mtx_unlock(&thinkpad_ec_mtx);
 }
 
 /*** Checking for EC hardware ***/
@@ -428,15 +2039,19 @@ void thinkpad_ec_invalidate(void)
 static int thinkpad_ec_test(void)
 {
         int ret;
-        const struct thinkpad_ec_row args = /* battery 0 basic status */
-          { .mask=0x8001, .val={0x01,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x00} };
-        struct thinkpad_ec_row data = { .mask = 0x0000 };
+        struct thinkpad_ec_req req = {
+          .args = tpc_test_args,
+          .data = { .mask = 0x0000 },
+          .prio = TP_EC_PRIO_BACKGROUND,
+        };
 
         ret = thinkpad_ec_lock();
 	if (ret)
 		return ret;
 
-        ret = thinkpad_ec_read_row(&args, &data);
+        ret = thinkpad_ec_submit(&req);
+        if (!ret)
+                ret = thinkpad_ec_wait(&req);
 
         thinkpad_ec_unlock();
 
@@ -472,7 +2087,7 @@ static void thinkpad_ec_identify(driver_t *driver, device_t parent)
 
 	device_t child;
 
-        if (!check_dmi_for_ec()) {
+        if (!tpc_simulate && !check_dmi_for_ec()) {
                 printf("thinkpad_ec: no ThinkPad embedded controller!\n");
 		return;
                // return (-ENODEV);
@@ -500,6 +2115,11 @@ static int thinkpad_ec_probe(device_t dev)
 	if (device_get_unit(dev) != 0 )
 		return (ENXIO);
 
+	if (tpc_simulate) {
+		device_set_desc(dev, "Simulated ThinkPad Embedded Controller");
+		return (0);
+	}
+
         if (!check_dmi_for_ec())
 		return (ENXIO);
 
@@ -517,6 +2137,13 @@ static int thinkpad_ec_attach(device_t dev)
 	sc->dev = dev;
 
 	sc->rid = 0;
+	sc->res = NULL;
+
+	if (tpc_simulate) {
+		tpc_ops = &thinkpad_ec_sim_ops;
+		tpc_cookie = thinkpad_ec_sim_attach(dev);
+		goto ports_ok;
+	}
 
 	sc->res = bus_alloc_resource(dev, SYS_RES_IOPORT, &sc->rid, 0, ~0, 1,RF_ACTIVE);
 
@@ -530,27 +2157,54 @@ static int thinkpad_ec_attach(device_t dev)
 
 	sc->bst = rman_get_bustag(sc->res);
 	sc->bsh = rman_get_bushandle(sc->res);
+	tpc_ops = &thinkpad_ec_bus_ops;
+	tpc_cookie = sc;
+
+ports_ok:
+
+	thinkpad_ec_deadline_calibrate();
+	thinkpad_ec_cmds_init();
 
-	/* Try accessing EC */
 	mtx_init(&thinkpad_ec_mtx, DEVICE_NAME, NULL, MTX_DEF);
+	thinkpad_ec_invalidate();
+
+	if (thinkpad_ec_worker_start()) {
+		device_printf(dev, "cannot start EC worker thread\n");
+		goto bad;
+	}
 
-	prefetch_ticks = TPC_PREFETCH_JUNK;
+	/* Try accessing EC */
         if (thinkpad_ec_test()) {
                 device_printf(sc->dev, "initial ec test failed\n");
-                return -ENXIO;
+                thinkpad_ec_worker_stop();
+                goto bad;
         }
 
         device_printf(dev, "thinkpad_ec " TP_VERSION " loaded.\n");
 	
 	return 0;
 
+bad:
+	/* as thinkpad_ec_detach(), the worker is gone already */
+	mtx_destroy(&thinkpad_ec_mtx);
+	if (tpc_simulate)
+		thinkpad_ec_sim_detach();
+	if (sc->res != NULL) {
+		bus_release_resource(dev, SYS_RES_IOPORT, sc->rid, sc->res);
+		sc->res = NULL;
+	}
+	return ENXIO;
 }
 
 static int thinkpad_ec_detach(device_t dev)
 {
+	thinkpad_ec_worker_stop();
 	mtx_destroy(&thinkpad_ec_mtx);
 
-	bus_release_resource(dev, SYS_RES_IOPORT, sc->rid, sc->res);
+	if (tpc_simulate)
+		thinkpad_ec_sim_detach();
+	if (sc->res != NULL)
+		bus_release_resource(dev, SYS_RES_IOPORT, sc->rid, sc->res);
 	device_printf(dev, "thinkpad_ec: unloaded.\n");
 	return 0;
 
@@ -21,27 +21,216 @@
 #ifndef _THINKPAD_EC_H
 #define _THINKPAD_EC_H
 
+/* EC access statistics, as returned by sysctl hw.thinkpad_ec.stats.all.
+ * Latency histograms are log2 buckets: bucket i counts calls that took
+ * [2^(i-1), 2^i) nanoseconds, bucket 0 those under 1ns.
+ */
+#define TP_EC_HIST_BUCKETS 24
+
+/* Request priority classes, see struct thinkpad_ec_req */
+#define TP_EC_PRIO_RT		0	/* periodic sampling */
+#define TP_EC_PRIO_INTERACTIVE	1	/* commands someone is waiting for */
+#define TP_EC_PRIO_BACKGROUND	2	/* housekeeping */
+#define TP_EC_NPRIO		3
+
+struct thinkpad_ec_class_stats {
+	uint64_t completed;		/* requests served in this class */
+	uint64_t wait_max_ns;		/* longest queueing time seen */
+	uint64_t wait_ns[TP_EC_HIST_BUCKETS]; /* queued until served */
+};
+
+struct thinkpad_ec_stats {
+	uint64_t requests;		/* rows requested from the EC */
+	uint64_t reads;			/* rows read from the EC */
+	uint64_t busy;			/* -EBUSY results (retried) */
+	uint64_t io_errors;		/* -EIO results */
+	uint64_t err_0x80;		/* 0x80 read from port 0x161F */
+	uint64_t prefetch_hits;		/* prefetched rows used */
+	uint64_t prefetch_misses;	/* rows not found prefetched */
+	uint64_t prefetch_evicts;	/* prefetched rows dropped for another */
+	uint64_t prefetch_expired;	/* prefetched rows that timed out */
+	uint64_t submitted;		/* requests queued */
+	uint64_t coalesced;		/* requests that shared another's */
+	uint64_t completed;		/* requests served by the worker */
+	uint64_t queue_max;		/* longest request queue seen */
+	uint64_t msgs_suppressed;	/* rate-limited console messages */
+	uint64_t port_io;		/* EC port accesses */
+	uint64_t outages;		/* EC hangs detected */
+	uint64_t recoveries;		/* EC hangs recovered from */
+	uint64_t recovery_attempts;	/* test handshakes while recovering */
+	uint64_t batches;		/* thinkpad_ec_read_rows() calls */
+	uint64_t batch_rows;		/* rows read by them */
+	uint64_t slot_holds;		/* dispatches held for a sampling slot */
+	uint64_t promoted;		/* requests raised by a joining one */
+	uint64_t request_ns[TP_EC_HIST_BUCKETS]; /* thinkpad_ec_request_row */
+	uint64_t read_ns[TP_EC_HIST_BUCKETS];	 /* thinkpad_ec_read_data */
+	uint64_t wait_ns[TP_EC_HIST_BUCKETS];	 /* queued until served */
+	uint64_t service_ns[TP_EC_HIST_BUCKETS]; /* served until done */
+	uint64_t batch_ns[TP_EC_HIST_BUCKETS];	 /* thinkpad_ec_read_rows */
+	uint64_t prefetch_age_ns[TP_EC_HIST_BUCKETS]; /* readout until used */
+	uint64_t recovery_ns[TP_EC_HIST_BUCKETS]; /* hang detected until over */
+	struct thinkpad_ec_class_stats prio[TP_EC_NPRIO];
+};
+
+/* Client lock profile, one entry per call site of thinkpad_ec_lock() and
+ * thinkpad_ec_try_lock(), as returned by sysctl hw.thinkpad_ec.stats.locks.
+ */
+#define TP_EC_LOCK_FILE_LEN	24
+
+struct thinkpad_ec_lock_site {
+	char file[TP_EC_LOCK_FILE_LEN];	/* caller's source file, basename */
+	uint32_t line;			/* caller's line */
+	uint32_t reserved;
+	uint64_t acquired;		/* times the lock was taken here */
+	uint64_t try_failed;		/* thinkpad_ec_try_lock() found it held */
+	uint64_t blocked;		/* others kept waiting while held here */
+	uint64_t wait_max_ns;		/* longest wait for the lock */
+	uint64_t hold_max_ns;		/* longest hold */
+	uint64_t wait_ns[TP_EC_HIST_BUCKETS]; /* called until acquired */
+	uint64_t hold_ns[TP_EC_HIST_BUCKETS]; /* acquired until unlocked */
+};
+
+/* Transaction trace, as returned by sysctl hw.thinkpad_ec.trace and
+ * accepted by hw.thinkpad_ec.sim.replay: a struct thinkpad_ec_trace_hdr
+ * followed by hdr.count records of hdr.rec_size bytes, oldest first.
+ * All fields are in host byte order. Records are only ever extended at
+ * the end; readers should skip rec_size bytes per record.
+ */
+#define TP_EC_TRACE_MAGIC	0x54504543	/* "TPEC" */
+#define TP_EC_TRACE_VERSION	2	/* 2: port_io */
+
+struct thinkpad_ec_trace_hdr {
+	uint32_t magic;			/* TP_EC_TRACE_MAGIC */
+	uint16_t version;		/* TP_EC_TRACE_VERSION */
+	uint16_t rec_size;		/* sizeof(struct thinkpad_ec_trace_rec) */
+	uint32_t count;			/* records that follow */
+	uint32_t reserved;
+};
+
+#define TP_EC_TRACE_PIPELINED	0x01	/* requested while the previous
+					   transaction was completed */
+#define TP_EC_TRACE_PREFETCH	0x02	/* readout went to a prefetch slot */
+#define TP_EC_TRACE_BATCH	0x04	/* row of a thinkpad_ec_read_rows() */
+
+struct thinkpad_ec_trace_rec {
+	uint64_t seq;			/* transaction number */
+	uint64_t time_ns;		/* start, nanoseconds since boot */
+	uint64_t latency_ns;		/* start to end of transaction */
+	int32_t error;			/* 0 or negative errno */
+	uint16_t args_mask;		/* as in struct thinkpad_ec_row */
+	uint16_t data_mask;
+	uint8_t args[16];
+	uint8_t data[16];		/* valid where data_mask is set */
+	uint16_t request_tries;		/* request handshakes attempted */
+	uint16_t read_tries;		/* readout attempts */
+	uint8_t str3;			/* last STR3 value read */
+	uint8_t prio;			/* TP_EC_PRIO_* */
+	uint8_t flags;			/* TP_EC_TRACE_* */
+	uint8_t reserved;
+	uint32_t port_io;		/* port accesses used */
+	uint32_t reserved2;
+};
+
 #ifdef _KERNEL
 
+#include <sys/queue.h>
+#include <sys/eventhandler.h>
+
 #define TP_CONTROLLER_ROW_LEN 16
 
+/* IO ports used by embedded controller LPC channel 3: */
+#define TPC_BASE_PORT	0x1600
+#define TPC_NUM_PORTS	0x20
+#define TPC_STR3_PORT	0x04  /* Reads H8S EC register STR3 */
+#define TPC_TWR0_PORT	0x10 /* Mapped to H8S EC register TWR0MW/SW  */
+#define TPC_TWR15_PORT	0x1f /* Mapped to H8S EC register TWR15. */
+  /* (and port TPC_TWR0_PORT+i is mapped to H8S reg TWRi for 0<i<16) */
+
+/* H8S STR3 status flags (see "H8S/2104B Group Hardware Manual" p.549) */
+#define H8S_STR3_IBF3B 0x80  /* Bidi. Data Register Input Buffer Full */
+#define H8S_STR3_OBF3B 0x40  /* Bidi. Data Register Output Buffer Full */
+#define H8S_STR3_MWMF  0x20  /* Master Write Mode Flag */
+#define H8S_STR3_SWMF  0x10  /* Slave Write Mode Flag */
+#define H8S_STR3_MASK  0xf0  /* All bits we care about in STR3 */
+
+/* Port I/O backend; ports are offsets from TPC_BASE_PORT.
+ * The region ops access @count consecutive ports and may be NULL.
+ */
+struct thinkpad_ec_port_ops {
+	const char *name;
+	u_char (*read)(void *cookie, u_int port);
+	void (*write)(void *cookie, u_int port, u_char val);
+	void (*read_region)(void *cookie, u_int port, u_char *buf,
+	    u_int count);
+	void (*write_region)(void *cookie, u_int port, const u_char *buf,
+	    u_int count);
+};
+
 /* EC transactions input and output (possibly partial) vectors of 16 bytes. */
 struct thinkpad_ec_row {
 	u_short mask; /* bitmap of which entries of val[] are meaningful */
 	u_char val[TP_CONTROLLER_ROW_LEN];
 };
 
-extern int thinkpad_ec_lock(void);
-extern int thinkpad_ec_try_lock(void);
+/* Asynchronous EC request, see thinkpad_ec_submit() */
+struct thinkpad_ec_req;
+struct thinkpad_ec_cmd;
+typedef void thinkpad_ec_done_t(struct thinkpad_ec_req *req, void *arg);
+
+struct thinkpad_ec_req {
+	struct thinkpad_ec_row args;	/* input register arguments */
+	struct thinkpad_ec_row data;	/* output; caller sets data.mask */
+	int error;			/* result, valid once done */
+	thinkpad_ec_done_t *done;	/* completion callback, or NULL */
+	void *done_arg;
+	int prio;			/* TP_EC_PRIO_* */
+	sbintime_t taken;		/* when it was read, valid once done */
+
+	/* private to thinkpad_ec */
+	TAILQ_ENTRY(thinkpad_ec_req) tr_link;
+	TAILQ_HEAD(, thinkpad_ec_req) tr_followers; /* sharing our result */
+	int tr_state;
+	int tr_flags;
+	int tr_issued;			/* already requested from the EC */
+	struct thinkpad_ec_req *tr_next; /* next row of a batch */
+	const struct thinkpad_ec_cmd *tr_cmd; /* descriptor, if known */
+	u_int tr_port_io;		/* port accesses so far */
+	sbintime_t tr_submitted;
+	sbintime_t tr_deadline;		/* latest wanted start of service */
+	sbintime_t tr_started;
+};
+
+extern int __thinkpad_ec_lock(const char *file, int line);
+extern int __thinkpad_ec_try_lock(const char *file, int line);
 extern void thinkpad_ec_unlock(void);
+#define thinkpad_ec_lock()	__thinkpad_ec_lock(__FILE__, __LINE__)
+#define thinkpad_ec_try_lock()	__thinkpad_ec_try_lock(__FILE__, __LINE__)
 
 extern int thinkpad_ec_read_row(const struct thinkpad_ec_row *args,
                                 struct thinkpad_ec_row *data);
 extern int thinkpad_ec_try_read_row(const struct thinkpad_ec_row *args,
                                     struct thinkpad_ec_row *mask);
+extern int thinkpad_ec_try_read_row_time(const struct thinkpad_ec_row *args,
+                                         struct thinkpad_ec_row *data,
+                                         sbintime_t *taken);
+extern int thinkpad_ec_read_rows(const struct thinkpad_ec_row *args,
+                                 struct thinkpad_ec_row *data, int *status,
+                                 int n, int flags);
+#define TP_EC_ROWS_STOP	0x01	/* don't run rows after a failed one */
+#define TP_EC_ROWS_MAX	16	/* most rows per call */
 extern int thinkpad_ec_prefetch_row(const struct thinkpad_ec_row *args);
 extern void thinkpad_ec_invalidate(void);
 
+extern int thinkpad_ec_submit(struct thinkpad_ec_req *req);
+extern int thinkpad_ec_wait(struct thinkpad_ec_req *req);
+
+/* Invoked after the EC recovered from a hang; EC state set up by clients
+ * may be gone. Runs on the EC worker thread, so handlers must not wait
+ * for EC requests (defer to a task instead).
+ */
+typedef void (*thinkpad_ec_reset_fn)(void *arg);
+EVENTHANDLER_DECLARE(thinkpad_ec_reset, thinkpad_ec_reset_fn);
+
 
 #endif /* _KERNEL */
 #endif /* _THINKPAD_EC_H */
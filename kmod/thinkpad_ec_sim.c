@@ -0,0 +1,527 @@
+/*
+ *  thinkpad_ec_sim.c - simulated ThinkPad embedded controller LPC3 channel
+ *
+ *  A port I/O backend for thinkpad_ec that models the H8S side of the
+ *  LPC3 protocol, so the EC and hdaps paths can be run, profiled and
+ *  benchmarked without ThinkPad hardware. Enable it at load time with
+ *	hw.thinkpad_ec.simulate=1
+ *  Timing and fault injection are tuned under hw.thinkpad_ec.sim.
+ *
+ *  Model of a transaction, as seen through STR3:
+ *	idle		0x00
+ *	TWR0 written	MWMF		(host writes TWR1..TWR15)
+ *	TWR15 written	IBF3B|MWMF	for ack_ns
+ *			0x00		for start_ns
+ *			SWMF		for reply_ns
+ *			OBF3B|SWMF	until the host reads TWR15
+ *  Reading TWR0..TWR14 returns the reply row; reading TWR15 ends the
+ *  transaction and returns the EC to idle.
+ *
+ *  Commands understood: 0x01, 0x02 and 0x03 (battery status, capacity
+ *  and design data, see smapi/smapi.c), 0x10 (set config), 0x11
+ *  (accelerometer readout), 0x13 (mode), 0x14 (power) and 0x17
+ *  subcommands 0x81, 0x82 and 0x83. Anything else replies 0x80 in TWR15.
+ *  The accelerometer reads around sim.x and sim.y, which can be moved to
+ *  simulate motion. The simulated battery 0 discharges from full in
+ *  sim.bat_hours after boot.
+ *
+ *  A trace taken from hw.thinkpad_ec.trace can be written to
+ *  hw.thinkpad_ec.sim.replay. The simulator then answers each command
+ *  with the next recorded reply and latency, and goes silent for the
+ *  recorded time where the recorded transaction failed, until the trace
+ *  is used up.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <sys/param.h>
+#include <sys/kernel.h>
+#include <sys/bus.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+
+#include <machine/cpu.h>
+
+#include "thinkpad_ec.h"
+#include "thinkpad_ec_sim.h"
+
+enum sim_phase {
+	SIM_IDLE,	/* waiting for TWR0 */
+	SIM_COMMAND,	/* TWR0 written, taking arguments */
+	SIM_BUSY,	/* TWR15 written, EC working on the reply */
+	SIM_HUNG,	/* injected fault: EC silent until hang_until */
+};
+
+struct thinkpad_ec_sim {
+	enum sim_phase phase;
+	sbintime_t cmd_time;		/* when TWR15 was written */
+	sbintime_t hang_until;
+	u_char args[TP_CONTROLLER_ROW_LEN];
+	u_char reply[TP_CONTROLLER_ROW_LEN];
+	sbintime_t reply_time;		/* SWMF phase of this transaction */
+	int bad_str3;			/* garble next STR3 read */
+
+	/* Accelerometer state */
+	int power;
+	int ec_rate;			/* EC samples per second */
+	int filter_order;
+	int fake_data;
+	int fake_counter;
+	sbintime_t last_sample;		/* time of last sample handed out */
+	uint64_t transactions;
+};
+
+static struct thinkpad_ec_sim sim;
+
+/* Timing in nanoseconds; defaults are in the range measured on a T43 */
+static int sim_ack_ns = 200;
+static int sim_start_ns = 300;
+static int sim_reply_ns = 2000;
+static int sim_io_ns = 1000;		/* cost of one port access */
+
+/* Fault injection: every Nth transaction, 0 disables */
+static int sim_fault_silent = 0;	/* EC stops responding */
+static int sim_fault_badstr3 = 0;	/* STR3 reads garbage once */
+static int sim_fault_err80 = 0;		/* TWR15 reads 0x80 */
+static int sim_hang_ms = 50;		/* duration of a silent EC */
+
+/* Accelerometer model: position the readouts wobble around */
+static int sim_pos_x = 500;
+static int sim_pos_y = 480;
+
+/* Battery model */
+static int sim_bat_mask = 0x1;		/* installed batteries */
+static int sim_bat_hours = 3;		/* battery 0 runtime from full */
+
+SYSCTL_DECL(_hw_thinkpad_ec);
+SYSCTL_NODE(_hw_thinkpad_ec, OID_AUTO, sim, CTLFLAG_RD, NULL, "EC simulator");
+SYSCTL_INT(_hw_thinkpad_ec_sim, OID_AUTO, ack_ns, CTLFLAG_RW, &sim_ack_ns, 0, "time in IBF3B|MWMF after a command");
+SYSCTL_INT(_hw_thinkpad_ec_sim, OID_AUTO, start_ns, CTLFLAG_RW, &sim_start_ns, 0, "time in 0x00 before the reply starts");
+SYSCTL_INT(_hw_thinkpad_ec_sim, OID_AUTO, reply_ns, CTLFLAG_RW, &sim_reply_ns, 0, "time in SWMF before the reply is ready");
+SYSCTL_INT(_hw_thinkpad_ec_sim, OID_AUTO, io_ns, CTLFLAG_RW, &sim_io_ns, 0, "cost of one port access");
+SYSCTL_INT(_hw_thinkpad_ec_sim, OID_AUTO, fault_silent, CTLFLAG_RW, &sim_fault_silent, 0, "hang the EC every Nth transaction");
+SYSCTL_INT(_hw_thinkpad_ec_sim, OID_AUTO, fault_badstr3, CTLFLAG_RW, &sim_fault_badstr3, 0, "garble STR3 every Nth transaction");
+SYSCTL_INT(_hw_thinkpad_ec_sim, OID_AUTO, fault_err80, CTLFLAG_RW, &sim_fault_err80, 0, "reply 0x80 every Nth transaction");
+SYSCTL_INT(_hw_thinkpad_ec_sim, OID_AUTO, x, CTLFLAG_RW, &sim_pos_x, 0, "accelerometer x position");
+SYSCTL_INT(_hw_thinkpad_ec_sim, OID_AUTO, y, CTLFLAG_RW, &sim_pos_y, 0, "accelerometer y position");
+SYSCTL_INT(_hw_thinkpad_ec_sim, OID_AUTO, bat_mask, CTLFLAG_RW, &sim_bat_mask, 0, "installed batteries, bit 0 and 1");
+SYSCTL_INT(_hw_thinkpad_ec_sim, OID_AUTO, bat_hours, CTLFLAG_RW, &sim_bat_hours, 0, "battery runtime from full (h)");
+SYSCTL_INT(_hw_thinkpad_ec_sim, OID_AUTO, hang_ms, CTLFLAG_RW, &sim_hang_ms, 0, "how long a hung EC stays silent");
+SYSCTL_UQUAD(_hw_thinkpad_ec_sim, OID_AUTO, transactions, CTLFLAG_RD, &sim.transactions, 0, "commands received");
+
+/* Trace replay; sim_replay_mtx guards the trace against the sysctl */
+static struct mtx sim_replay_mtx;
+MTX_SYSINIT(thinkpad_ec_sim_replay, &sim_replay_mtx, "tpcsimrp", MTX_DEF);
+
+static struct thinkpad_ec_trace_rec *sim_replay;
+static int sim_replay_len;
+static int sim_replay_pos;
+static int sim_replay_mismatch;		/* commands unlike the recorded */
+
+MALLOC_DEFINE(M_TPCSIM, "thinkpad_ec_sim", "ThinkPad EC simulator");
+
+#define SIM_REPLAY_MAX	(4 * 1024 * 1024)	/* largest trace accepted */
+
+/* Load a trace to replay; an empty write stops replaying */
+static int sim_replay_sysctlproc(SYSCTL_HANDLER_ARGS)
+{
+	struct thinkpad_ec_trace_hdr hdr;
+	struct thinkpad_ec_trace_rec *recs = NULL, *old;
+	char *buf;
+	size_t len;
+	u_int i;
+	int error;
+
+	error = SYSCTL_OUT(req, NULL, 0);
+	if (error || req->newptr == NULL)
+		return error;
+
+	len = req->newlen;
+	if (len > 0) {
+		if (len < sizeof(hdr) || len > SIM_REPLAY_MAX)
+			return EINVAL;
+		buf = malloc(len, M_TPCSIM, M_WAITOK);
+		error = SYSCTL_IN(req, buf, len);
+		bcopy(buf, &hdr, sizeof(hdr));
+		if (!error &&
+		    (hdr.magic != TP_EC_TRACE_MAGIC ||
+		     hdr.version != TP_EC_TRACE_VERSION ||
+		     hdr.rec_size < offsetof(struct thinkpad_ec_trace_rec,
+		     port_io) ||
+		     hdr.count == 0 ||
+		     hdr.count > (len - sizeof(hdr)) / hdr.rec_size))
+			error = EINVAL;
+		if (error) {
+			free(buf, M_TPCSIM);
+			return error;
+		}
+
+		/* records may be shorter (older) or longer than we know */
+		recs = malloc(hdr.count * sizeof(*recs), M_TPCSIM,
+		    M_WAITOK | M_ZERO);
+		for (i = 0; i < hdr.count; i++)
+			bcopy(buf + sizeof(hdr) + i * hdr.rec_size, &recs[i],
+			    MIN(hdr.rec_size, sizeof(*recs)));
+		free(buf, M_TPCSIM);
+	}
+
+	mtx_lock(&sim_replay_mtx);
+	old = sim_replay;
+	sim_replay = recs;
+	sim_replay_len = recs != NULL ? hdr.count : 0;
+	sim_replay_pos = 0;
+	sim_replay_mismatch = 0;
+	mtx_unlock(&sim_replay_mtx);
+	if (old != NULL)
+		free(old, M_TPCSIM);
+	return 0;
+}
+
+SYSCTL_PROC(_hw_thinkpad_ec_sim, OID_AUTO, replay, CTLTYPE_OPAQUE|CTLFLAG_WR, NULL, 0, sim_replay_sysctlproc, "S,thinkpad_ec_trace", "trace to replay (see thinkpad_ec.h)");
+SYSCTL_INT(_hw_thinkpad_ec_sim, OID_AUTO, replay_len, CTLFLAG_RD, &sim_replay_len, 0, "transactions in the replayed trace");
+SYSCTL_INT(_hw_thinkpad_ec_sim, OID_AUTO, replay_pos, CTLFLAG_RD, &sim_replay_pos, 0, "transactions replayed so far");
+SYSCTL_INT(_hw_thinkpad_ec_sim, OID_AUTO, replay_mismatch, CTLFLAG_RD, &sim_replay_mismatch, 0, "replayed commands unlike the recorded ones");
+
+static int sim_every(int n)
+{
+	return n > 0 && sim.transactions % n == 0;
+}
+
+/* Busy-wait like a slow LPC bus access would */
+static void sim_io_delay(void)
+{
+	sbintime_t until;
+
+	if (sim_io_ns <= 0)
+		return;
+	until = sbinuptime() + nstosbt(sim_io_ns);
+	while (sbinuptime() < until)
+		cpu_spinwait();
+}
+
+static void sim_put16(int i, int v)
+{
+	sim.reply[i] = v & 0xff;
+	sim.reply[i+1] = (v >> 8) & 0xff;
+}
+
+/* Fill in a 0x01..0x03 battery row; battery number in TWR15. Battery 0
+ * runs down from full since boot, then stays empty; battery 1 is idle.
+ */
+static void sim_battery(sbintime_t now)
+{
+	const int full = 4800;		/* 10 mWh */
+	int bat = sim.args[0xf], hours, left, charge;
+
+	if (bat > 1 || !((sim_bat_mask >> bat) & 1)) {
+		if (sim.args[0x0] == 0x01)
+			sim.reply[0x1] = 0x00;	/* not installed */
+		return;
+	}
+
+	hours = sim_bat_hours > 0 ? sim_bat_hours : 1;
+	left = hours * 60 - now / (60 * SBT_1S);	/* min */
+	if (bat == 1 || left < 0)
+		left = bat == 1 ? hours * 60 : 0;
+	charge = full * left / (hours * 60);
+
+	switch (sim.args[0x0]) {
+	case 0x01: /* status */
+		sim.reply[0x1] = bat == 0 && left > 0 ? 0xd0 : 0xc0;
+		sim_put16(0x6, 10800 + 1800 * left / (hours * 60)); /* mV */
+		sim_put16(0x8, bat == 0 && left > 0 ? -1500 : 0);   /* mA */
+		sim_put16(0xa, bat == 0 && left > 0 ? -1450 : 0);
+		sim_put16(0xc, 100 * left / (hours * 60));
+		break;
+	case 0x02: /* capacity */
+		sim_put16(0x2, full);
+		sim_put16(0x4, charge);
+		sim_put16(0x6, 0xffff);
+		sim_put16(0x8, bat == 0 ? left : 0xffff);
+		sim_put16(0xc, 142 + bat);
+		break;
+	case 0x03: /* design */
+		sim_put16(0x2, 5200);
+		sim_put16(0x4, 10800);
+		sim_put16(0x8, (2006 - 1980) << 9 | 8 << 5 | 25);
+		sim_put16(0xa, 0x1234 + bat);
+		break;
+	}
+}
+
+#define SIM_ACCEL_QUEUE	14	/* readouts the EC queues beyond a row */
+
+/* Fill in a 0x11 accelerometer readout */
+static void sim_accel(sbintime_t now)
+{
+	sbintime_t period, n;
+	int x, y;
+
+	if (!sim.power || sim.ec_rate <= 0) {
+		sim.reply[0x1] = 0;
+		return;
+	}
+
+	/* Readouts accumulated since the last read: at most two go in the
+	 * row, the rest stay queued for the next reads. The queue holds
+	 * SIM_ACCEL_QUEUE readouts; older ones are lost. */
+	period = SBT_1S / sim.ec_rate;
+	n = (now - sim.last_sample) / period;
+	if (n > SIM_ACCEL_QUEUE + 2) {
+		sim.last_sample += (n - SIM_ACCEL_QUEUE - 2) * period;
+		n = SIM_ACCEL_QUEUE + 2;
+	}
+	sim.last_sample += (n > 2 ? 2 : n) * period;
+
+	if (sim.fake_data) {
+		x = y = sim.fake_counter++;
+	} else {
+		/* gentle wobble around hw.thinkpad_ec.sim.x and .y */
+		x = sim_pos_x + (int)((now >> 26) & 0x7) - 4;
+		y = sim_pos_y + (int)((now >> 27) & 0x7) - 4;
+	}
+
+	sim.reply[0x1] = n > 2 ? 2 : n;
+	sim.reply[0x2] = y & 0xff;	/* YPOS1 */
+	sim.reply[0x3] = y >> 8;
+	sim.reply[0x4] = x & 0xff;	/* XPOS1 */
+	sim.reply[0x5] = x >> 8;
+	sim.reply[0x6] = 40;		/* TEMP1 */
+	sim.reply[0x7] = x & 0xff;	/* XPOS2 */
+	sim.reply[0x8] = x >> 8;
+	sim.reply[0x9] = y & 0xff;	/* YPOS2 */
+	sim.reply[0xa] = y >> 8;
+	sim.reply[0xb] = 40;		/* TEMP2 */
+	sim.reply[0xc] = n > 2 ? n - 2 : 0; /* QUEUED */
+	sim.reply[0xd] = 0;		/* KMACT */
+}
+
+/* Answer the command in sim.args from the replayed trace, if any.
+ * Returns 0 if not replaying, 1 for a reply and -1 for silence.
+ */
+static int sim_replay_command(sbintime_t now)
+{
+	struct thinkpad_ec_trace_rec *r;
+	sbintime_t t;
+	int i, ret;
+
+	mtx_lock(&sim_replay_mtx);
+	if (sim_replay == NULL || sim_replay_pos >= sim_replay_len) {
+		mtx_unlock(&sim_replay_mtx);
+		return 0;
+	}
+	r = &sim_replay[sim_replay_pos++];
+
+	for (i = 0; i < TP_CONTROLLER_ROW_LEN; i++)
+		if (((r->args_mask >> i) & 1) && r->args[i] != sim.args[i]) {
+			sim_replay_mismatch++;
+			break;
+		}
+
+	t = nstosbt(r->latency_ns);
+	if (r->error) {
+		sim.hang_until = now + t;
+		ret = -1;
+	} else {
+		bcopy(r->data, sim.reply, sizeof(sim.reply));
+		/* the recorded latency includes the earlier phases */
+		t -= nstosbt(sim_ack_ns) + nstosbt(sim_start_ns);
+		sim.reply_time = t > 0 ? t : 0;
+		ret = 1;
+	}
+	mtx_unlock(&sim_replay_mtx);
+	return ret;
+}
+
+/* Work out the reply row for the command in sim.args */
+static void sim_command(sbintime_t now)
+{
+	int rate;
+
+	bzero(sim.reply, sizeof(sim.reply));
+	sim.reply[0x0] = sim.args[0x0];
+	sim.reply[0xf] = 0x00;
+
+	switch (sim.args[0x0]) {
+	case 0x01: /* battery status */
+	case 0x02: /* battery capacity */
+	case 0x03: /* battery design data */
+		sim_battery(now);
+		break;
+	case 0x10: /* set config */
+		rate = sim.args[0x1] | (sim.args[0x2] << 8);
+		if (rate > 1000) {
+			sim.reply[0xf] = 0x03;
+			break;
+		}
+		sim.ec_rate = rate;
+		sim.filter_order = sim.args[0x3];
+		sim.last_sample = now;
+		break;
+	case 0x11: /* accelerometer readout */
+		sim_accel(now);
+		break;
+	case 0x13: /* mode latch */
+		sim.reply[0x1] = 0x01;
+		break;
+	case 0x14: /* power */
+		sim.power = sim.args[0x1] != 0;
+		break;
+	case 0x17:
+		switch (sim.args[0x1]) {
+		case 0x81: /* check */
+			sim.reply[0x2] = 0x60;
+			break;
+		case 0x82: /* get config */
+			sim.reply[0x1] = sim.ec_rate > 0 ? 0x01 : 0x00;
+			sim.reply[0x2] = sim.ec_rate & 0xff;
+			sim.reply[0x3] = sim.ec_rate >> 8;
+			sim.reply[0x4] = sim.filter_order;
+			break;
+		case 0x83: /* fake data mode */
+			sim.fake_data = sim.args[0x2] != 0;
+			break;
+		default:
+			sim.reply[0xf] = 0x80;
+		}
+		break;
+	default:
+		sim.reply[0xf] = 0x80;
+	}
+
+	if (sim_every(sim_fault_err80))
+		sim.reply[0xf] = 0x80;
+}
+
+static u_char sim_str3(void)
+{
+	sbintime_t t;
+
+	switch (sim.phase) {
+	case SIM_IDLE:
+		return 0x00;
+	case SIM_COMMAND:
+		return H8S_STR3_MWMF;
+	case SIM_HUNG:
+		if (sbinuptime() < sim.hang_until)
+			return H8S_STR3_IBF3B|H8S_STR3_MWMF;
+		sim.phase = SIM_IDLE;	/* EC came back, request lost */
+		return 0x00;
+	case SIM_BUSY:
+		break;
+	}
+
+	if (sim.bad_str3) {
+		sim.bad_str3 = 0;
+		return H8S_STR3_IBF3B|H8S_STR3_OBF3B;
+	}
+
+	t = sbinuptime() - sim.cmd_time;
+	if (t < nstosbt(sim_ack_ns))
+		return H8S_STR3_IBF3B|H8S_STR3_MWMF;
+	t -= nstosbt(sim_ack_ns);
+	if (t < nstosbt(sim_start_ns))
+		return 0x00;
+	t -= nstosbt(sim_start_ns);
+	if (t < sim.reply_time)
+		return H8S_STR3_SWMF;
+	return H8S_STR3_OBF3B|H8S_STR3_SWMF;
+}
+
+static u_char thinkpad_ec_sim_read(void *cookie, u_int port)
+{
+	u_char val = 0xff;
+
+	sim_io_delay();
+
+	if (port == TPC_STR3_PORT)
+		return sim_str3();
+	if (port < TPC_TWR0_PORT || port > TPC_TWR15_PORT)
+		return val;
+
+	if (sim.phase == SIM_BUSY)
+		val = sim.reply[port - TPC_TWR0_PORT];
+	if (port == TPC_TWR15_PORT && sim.phase == SIM_BUSY)
+		sim.phase = SIM_IDLE;	/* end of read transaction */
+	return val;
+}
+
+static void thinkpad_ec_sim_write(void *cookie, u_int port, u_char val)
+{
+	sbintime_t now;
+
+	sim_io_delay();
+
+	if (port < TPC_TWR0_PORT || port > TPC_TWR15_PORT)
+		return;
+
+	if (port == TPC_TWR0_PORT) {
+		if (sim.phase != SIM_IDLE)
+			return;	/* ignored, like the real EC */
+		bzero(sim.args, sizeof(sim.args));
+		sim.args[0] = val;
+		sim.phase = SIM_COMMAND;
+		return;
+	}
+
+	if (sim.phase != SIM_COMMAND)
+		return;
+	sim.args[port - TPC_TWR0_PORT] = val;
+	if (port != TPC_TWR15_PORT)
+		return;
+
+	/* TWR15 ends the command */
+	now = sbinuptime();
+	sim.transactions++;
+	sim.cmd_time = now;
+	sim.phase = SIM_BUSY;
+
+	switch (sim_replay_command(now)) {
+	case 1:
+		return;
+	case -1:
+		sim.phase = SIM_HUNG;
+		return;
+	}
+
+	sim_command(now);
+	sim.reply_time = nstosbt(sim_reply_ns);
+	if (sim_every(sim_fault_silent)) {
+		sim.phase = SIM_HUNG;
+		sim.hang_until = now + sim_hang_ms * SBT_1MS;
+	} else if (sim_every(sim_fault_badstr3))
+		sim.bad_str3 = 1;
+}
+
+const struct thinkpad_ec_port_ops thinkpad_ec_sim_ops = {
+	.name =		"simulator",
+	.read =		thinkpad_ec_sim_read,
+	.write =	thinkpad_ec_sim_write,
+};
+
+void *thinkpad_ec_sim_attach(device_t dev)
+{
+	bzero(&sim, sizeof(sim));
+	sim.phase = SIM_IDLE;
+	sim.last_sample = sbinuptime();
+
+	device_printf(dev, "using simulated LPC3 channel\n");
+	return &sim;
+}
+
+void thinkpad_ec_sim_detach(void)
+{
+	mtx_lock(&sim_replay_mtx);
+	if (sim_replay != NULL)
+		free(sim_replay, M_TPCSIM);
+	sim_replay = NULL;
+	sim_replay_len = sim_replay_pos = 0;
+	mtx_unlock(&sim_replay_mtx);
+}
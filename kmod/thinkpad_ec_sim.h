@@ -0,0 +1,21 @@
+/*
+ *  thinkpad_ec_sim.h - simulated ThinkPad embedded controller LPC3 channel
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef _THINKPAD_EC_SIM_H
+#define _THINKPAD_EC_SIM_H
+
+#ifdef _KERNEL
+
+extern const struct thinkpad_ec_port_ops thinkpad_ec_sim_ops;
+
+void *thinkpad_ec_sim_attach(device_t dev);
+void thinkpad_ec_sim_detach(void);
+
+#endif /* _KERNEL */
+#endif /* _THINKPAD_EC_SIM_H */
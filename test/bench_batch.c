@@ -0,0 +1,84 @@
+/*
+ *  bench_batch.c - hdaps init rows one by one or as one batch
+ *
+ *  Runs the rows hdaps_device_init() sends after the mode check (EC
+ *  check, power on, config, fake data mode off) as four read_row calls
+ *  and as one thinkpad_ec_read_rows() batch, first on an idle EC and then
+ *  with a background thread reading battery rows. Reports the EC
+ *  transactions and the wall clock time per sequence; with the reader
+ *  busy, the transactions beyond the four rows are the reader's that got
+ *  in between.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "test.h"
+
+#define ROUNDS		500
+#define NROWS		4
+
+static const struct thinkpad_ec_row init_args[NROWS] = {
+	{ .mask=0x0003, .val={0x17, 0x81} },		/* check EC */
+	{ .mask=0x0003, .val={0x14, 0x01} },		/* power on */
+	{ .mask=0x000F, .val={0x10, 100, 0, 2} },	/* config */
+	{ .mask=0x0007, .val={0x17, 0x83, 0x00} },	/* fake data off */
+};
+static const u_short init_masks[NROWS] = { 0x800E, 0x8000, 0x8000, 0x8000 };
+
+static volatile int stop;
+
+static void *reader_main(void *arg)
+{
+	struct thinkpad_ec_row data;
+
+	while (!stop) {
+		data.mask = 0xFFFF;
+		CHECK(thinkpad_ec_read_row(&test_battery_args, &data) == 0);
+	}
+	return NULL;
+}
+
+static void run(int batch, const char *what)
+{
+	struct thinkpad_ec_row data[NROWS];
+	uint64_t t0, tx0;
+	int i, j, status[NROWS];
+
+	tx0 = test_sim_transactions();
+	t0 = test_now_ns();
+	for (i = 0; i < ROUNDS; i++) {
+		for (j = 0; j < NROWS; j++)
+			data[j].mask = init_masks[j];
+		if (batch)
+			CHECK(thinkpad_ec_read_rows(init_args, data, status,
+			    NROWS, TP_EC_ROWS_STOP) == 0);
+		else
+			for (j = 0; j < NROWS; j++)
+				CHECK(thinkpad_ec_read_row(&init_args[j],
+				    &data[j]) == 0);
+		CHECK(data[0].val[0x2] == 0x60);
+	}
+	printf("%-26s %5.2f EC tx, %6.1f us per sequence\n", what,
+	    (double)(test_sim_transactions() - tx0) / ROUNDS,
+	    (test_now_ns() - t0) / 1000.0 / ROUNDS);
+}
+
+int main(void)
+{
+	pthread_t td;
+
+	test_ec_attach();
+
+	run(0, "idle, row by row:");
+	run(1, "idle, batched:");
+
+	CHECK(pthread_create(&td, NULL, reader_main, NULL) == 0);
+	run(0, "reader busy, row by row:");
+	run(1, "reader busy, batched:");
+	stop = 1;
+	pthread_join(td, NULL);
+	return 0;
+}
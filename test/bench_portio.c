@@ -0,0 +1,53 @@
+/*
+ *  bench_portio.c - port accesses per accelerometer sample
+ *
+ *  Reads the 0x11 row the way hdaps does, with the argument and reply
+ *  masks of its command descriptor, and for comparison with every reply
+ *  register and an argument in TWR15, which takes the generic path that
+ *  writes and reads all the registers in the masks, as every command
+ *  used to. Reports port accesses and time per row from the EC's stats.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "test.h"
+
+#define ROUNDS		5000
+
+static const struct thinkpad_ec_row generic_args =
+	{ .mask=0x8001, .val={0x11,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x01} };
+
+static void run(const struct thinkpad_ec_row *args, u_short mask,
+    const char *what)
+{
+	struct thinkpad_ec_stats st0, st1;
+	struct thinkpad_ec_row data;
+	uint64_t t0;
+	int i;
+
+	test_stats(&st0);
+	t0 = test_now_ns();
+	for (i = 0; i < ROUNDS; i++) {
+		data.mask = mask;
+		CHECK(thinkpad_ec_read_row(args, &data) == 0);
+		CHECK(data.val[0x0] == 0x11);
+	}
+	test_stats(&st1);
+	CHECK(st1.reads - st0.reads == ROUNDS);
+	printf("%-20s %5.1f port I/Os, %5.1f us per row\n", what,
+	    (double)(st1.port_io - st0.port_io) / ROUNDS,
+	    (test_now_ns() - t0) / 1000.0 / ROUNDS);
+}
+
+int main(void)
+{
+	test_ec_attach();
+	test_accel_on(100);
+
+	run(&test_accel_args, 0xBFFF, "command descriptor:");
+	run(&generic_args, 0xFFFF, "generic:");
+	return 0;
+}
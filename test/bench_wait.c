@@ -0,0 +1,89 @@
+/*
+ *  bench_wait.c - latency and CPU time of EC waits, spinning or sleeping
+ *
+ *  Reads the 0x11 row with the simulated EC taking longer and longer to
+ *  have its reply ready (hw.thinkpad_ec.sim.reply_ns, the time STR3 shows
+ *  SWMF), once with the worker spinning through every wait
+ *  (hw.thinkpad_ec.wait_sleep_us=0) and once with the default, which
+ *  sleeps once a wait gets long. Reports the median latency of a row and
+ *  the CPU time spent per row. The reply times in ns can be given on the
+ *  command line:
+ *	$ ./bench_wait 2000 50000 150000 250000
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "test.h"
+
+#include <time.h>
+
+#define ROUNDS		1000
+
+static const int default_reply_ns[] = { 2000, 50000, 150000, 250000 };
+
+static uint64_t cpu_ns(void)
+{
+	struct timespec ts;
+
+	CHECK(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) == 0);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void run(int reply_ns, int sleep_us)
+{
+	static uint64_t lat[ROUNDS];
+	struct thinkpad_ec_row data;
+	uint64_t t, cpu, sleeps;
+	int i;
+
+	CHECK(kh_sysctl_set_int("hw.thinkpad_ec.sim.reply_ns",
+	    reply_ns) == 0);
+	CHECK(kh_sysctl_set_int("hw.thinkpad_ec.wait_sleep_us",
+	    sleep_us) == 0);
+	sleeps = kh_sysctl_u64("hw.thinkpad_ec.stats.wait_sleeps");
+	cpu = cpu_ns();
+	for (i = 0; i < ROUNDS; i++) {
+		data.mask = 0xBFFF;
+		t = test_now_ns();
+		CHECK(thinkpad_ec_read_row(&test_accel_args, &data) == 0);
+		lat[i] = test_now_ns() - t;
+		CHECK(data.val[0x0] == 0x11);
+	}
+	cpu = cpu_ns() - cpu;
+	sleeps = kh_sysctl_u64("hw.thinkpad_ec.stats.wait_sleeps") - sleeps;
+	qsort(lat, ROUNDS, sizeof(lat[0]), cmp_u64);
+	printf("reply %6d ns, %-8s median %7.1f us, CPU %7.1f us, "
+	    "%5.2f sleeps per row\n", reply_ns,
+	    sleep_us ? "sleeping" : "spinning", lat[ROUNDS / 2] / 1000.0,
+	    cpu / 1000.0 / ROUNDS, (double)sleeps / ROUNDS);
+	if (!sleep_us)
+		CHECK(sleeps == 0);
+}
+
+int main(int argc, char **argv)
+{
+	int i, n, sleep_us, reply_ns;
+
+	test_ec_attach();
+	test_accel_on(100);
+	sleep_us = kh_sysctl_int("hw.thinkpad_ec.wait_sleep_us");
+	CHECK(sleep_us > 0);
+
+	n = argc > 1 ? argc - 1 : (int)nitems(default_reply_ns);
+	for (i = 0; i < n; i++) {
+		reply_ns = argc > 1 ? atoi(argv[i + 1]) : default_reply_ns[i];
+		run(reply_ns, 0);
+		run(reply_ns, sleep_us);
+	}
+	return 0;
+}
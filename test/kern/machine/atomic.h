@@ -0,0 +1 @@
+/* machine/atomic.h: see kern_host.h */
@@ -0,0 +1 @@
+/* machine/bus.h: see kern_host.h */
@@ -0,0 +1 @@
+/* machine/cpu.h: see kern_host.h */
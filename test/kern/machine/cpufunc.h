@@ -0,0 +1 @@
+/* machine/cpufunc.h: see kern_host.h */
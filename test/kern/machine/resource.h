@@ -0,0 +1 @@
+/* machine/resource.h: see kern_host.h */
@@ -0,0 +1 @@
+/* sys/bus.h: see kern_host.h */
@@ -0,0 +1 @@
+/* sys/conf.h: see kern_host.h */
@@ -0,0 +1 @@
+/* sys/eventhandler.h: see kern_host.h */
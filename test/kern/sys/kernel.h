@@ -0,0 +1 @@
+/* sys/kernel.h: see kern_host.h */
@@ -0,0 +1 @@
+/* sys/kthread.h: see kern_host.h */
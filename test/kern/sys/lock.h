@@ -0,0 +1 @@
+/* sys/lock.h: see kern_host.h */
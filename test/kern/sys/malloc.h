@@ -0,0 +1 @@
+/* sys/malloc.h: see kern_host.h */
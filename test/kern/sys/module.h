@@ -0,0 +1 @@
+/* sys/module.h: see kern_host.h */
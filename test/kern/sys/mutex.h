@@ -0,0 +1 @@
+/* sys/mutex.h: see kern_host.h */
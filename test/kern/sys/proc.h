@@ -0,0 +1 @@
+/* sys/proc.h: see kern_host.h */
@@ -0,0 +1 @@
+/* sys/rman.h: see kern_host.h */
@@ -0,0 +1 @@
+/* sys/sdt.h: see kern_host.h */
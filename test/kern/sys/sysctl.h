@@ -0,0 +1 @@
+/* sys/sysctl.h: see kern_host.h */
@@ -0,0 +1 @@
+/* sys/systm.h: see kern_host.h */
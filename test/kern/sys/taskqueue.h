@@ -0,0 +1 @@
+/* sys/taskqueue.h: see kern_host.h */
@@ -0,0 +1,1041 @@
+/*
+ *  kern_host.c - the kernel side of the host build, see kern_host.h
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <time.h>
+
+#include "../kmod/smbios.h"
+#include "../kmod/hdaps/hdaps_dev.h"
+#include "../kmod/hdaps/hdaps_joydev.h"
+#include "../kmod/hdaps/hdaps_shock.h"
+
+/* kern_host.h turns these into the kernel's; here we want libc's */
+#undef malloc
+#undef free
+
+int hz = 1000;
+
+MALLOC_DEFINE(M_DEVBUF, "devbuf", "device driver memory");
+MALLOC_DEFINE(M_TEMP, "temp", "misc temporary data buffers");
+
+static void __attribute__((noreturn))
+kh_fatal(const char *what, const char *name)
+{
+	fprintf(stderr, "kern_host: %s: %s\n", what, name);
+	abort();
+}
+
+size_t strlcpy(char *dst, const char *src, size_t size)
+{
+	size_t len = strlen(src);
+
+	if (size > 0) {
+		size = MIN(len, size - 1);
+		memcpy(dst, src, size);
+		dst[size] = '\0';
+	}
+	return len;
+}
+
+void *kh_malloc(size_t size, struct malloc_type *type, int flags)
+{
+	void *p;
+
+	if (size == 0)
+		size = 1;
+	p = (flags & M_ZERO) ? calloc(1, size) : malloc(size);
+	if (p == NULL && (flags & M_WAITOK))
+		kh_fatal("out of memory", type->ks_shortdesc);
+	return p;
+}
+
+void kh_free(void *addr, struct malloc_type *type)
+{
+	free(addr);
+}
+
+/*****
+	Time. Uptime starts at one second, so no timestamp is ever 0.
+*/
+
+static struct timespec kh_boot;
+
+static void __attribute__((constructor)) kh_time_init(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &kh_boot);
+	kh_boot.tv_sec--;
+}
+
+static int64_t kh_uptime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)(ts.tv_sec - kh_boot.tv_sec) * 1000000000 +
+	    (ts.tv_nsec - kh_boot.tv_nsec);
+}
+
+/* CLOCK_MONOTONIC time of an uptime */
+static struct timespec kh_sbt_to_ts(sbintime_t sbt)
+{
+	struct timespec ts;
+	int64_t ns = sbttons(sbt) + kh_boot.tv_nsec;
+
+	ts.tv_sec = kh_boot.tv_sec + ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	return ts;
+}
+
+sbintime_t sbinuptime(void)
+{
+	return nstosbt(kh_uptime_ns());
+}
+
+uint64_t cpu_ticks(void)
+{
+	return kh_uptime_ns();
+}
+
+uint64_t cpu_tickrate(void)
+{
+	return 1000000000;
+}
+
+void DELAY(int us)
+{
+	int64_t until = kh_uptime_ns() + (int64_t)us * 1000;
+
+	while (kh_uptime_ns() < until)
+		cpu_spinwait();
+}
+
+int kh_ticks(void)
+{
+	return (int)(kh_uptime_ns() / (1000000000 / hz));
+}
+
+int ppsratecheck(struct timeval *lasttime, int *curpps, int maxpps)
+{
+	int64_t sec = kh_uptime_ns() / 1000000000;
+
+	if (lasttime->tv_sec != sec) {
+		lasttime->tv_sec = sec;
+		lasttime->tv_usec = 0;
+		*curpps = 1;
+		return maxpps != 0;
+	}
+	(*curpps)++;
+	return maxpps < 0 || *curpps <= maxpps;
+}
+
+static void kh_cond_init(pthread_cond_t *cv)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cv, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/* Wait on @cv until woken or uptime @until (0: forever) */
+static int kh_cond_wait(pthread_cond_t *cv, pthread_mutex_t *m,
+    sbintime_t until)
+{
+	struct timespec ts;
+
+	if (until == 0)
+		return pthread_cond_wait(cv, m);
+	ts = kh_sbt_to_ts(until);
+	return pthread_cond_timedwait(cv, m, &ts);
+}
+
+/*****
+	Mutexes and sleep queues
+*/
+
+void mtx_init(struct mtx *m, const char *name, const char *type, int opts)
+{
+	pthread_mutex_init(&m->m, NULL);
+	m->name = name;
+	m->owned = 0;
+}
+
+void mtx_destroy(struct mtx *m)
+{
+	pthread_mutex_destroy(&m->m);
+}
+
+void mtx_lock(struct mtx *m)
+{
+	pthread_mutex_lock(&m->m);
+	m->owner = pthread_self();
+	m->owned = 1;
+}
+
+void mtx_unlock(struct mtx *m)
+{
+	m->owned = 0;
+	pthread_mutex_unlock(&m->m);
+}
+
+int mtx_owned(struct mtx *m)
+{
+	return m->owned && pthread_equal(m->owner, pthread_self());
+}
+
+struct kh_sleeper {
+	TAILQ_ENTRY(kh_sleeper) link;
+	void *chan;
+	int woken;
+	pthread_cond_t cv;
+};
+
+static TAILQ_HEAD(, kh_sleeper) kh_sleepers =
+    TAILQ_HEAD_INITIALIZER(kh_sleepers);
+static pthread_mutex_t kh_sleep_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* The sleeper is queued before @m is dropped, so a wakeup issued under
+ * @m can't be missed.
+ */
+int msleep_sbt(void *chan, struct mtx *m, int pri, const char *wmesg,
+    sbintime_t sbt, sbintime_t pr, int flags)
+{
+	struct kh_sleeper s;
+	sbintime_t until = 0;
+	int woken;
+
+	if (sbt != 0)
+		until = (flags & C_ABSOLUTE) ? sbt : sbinuptime() + sbt;
+
+	s.chan = chan;
+	s.woken = 0;
+	kh_cond_init(&s.cv);
+	pthread_mutex_lock(&kh_sleep_mtx);
+	TAILQ_INSERT_TAIL(&kh_sleepers, &s, link);
+	if (m != NULL)
+		mtx_unlock(m);
+	while (!s.woken)
+		if (kh_cond_wait(&s.cv, &kh_sleep_mtx, until) == ETIMEDOUT)
+			break;
+	TAILQ_REMOVE(&kh_sleepers, &s, link);
+	woken = s.woken;
+	pthread_mutex_unlock(&kh_sleep_mtx);
+	pthread_cond_destroy(&s.cv);
+	if (m != NULL)
+		mtx_lock(m);
+	return woken ? 0 : EWOULDBLOCK;
+}
+
+int pause_sbt(const char *wmesg, sbintime_t sbt, sbintime_t pr, int flags)
+{
+	static int chan;
+
+	return msleep_sbt(&chan, NULL, 0, wmesg, MAX(sbt, 1), pr, flags);
+}
+
+static void kh_wakeup(void *chan, int all)
+{
+	struct kh_sleeper *s;
+
+	pthread_mutex_lock(&kh_sleep_mtx);
+	TAILQ_FOREACH(s, &kh_sleepers, link)
+		if (s->chan == chan && !s->woken) {
+			s->woken = 1;
+			pthread_cond_signal(&s->cv);
+			if (!all)
+				break;
+		}
+	pthread_mutex_unlock(&kh_sleep_mtx);
+}
+
+void wakeup(void *chan)
+{
+	kh_wakeup(chan, 1);
+}
+
+void wakeup_one(void *chan)
+{
+	kh_wakeup(chan, 0);
+}
+
+/*****
+	Kernel threads
+*/
+
+struct proc {
+	pthread_t td;
+	void (*func)(void *);
+	void *arg;
+};
+
+static void *kh_kproc_main(void *arg)
+{
+	struct proc *p = arg;
+
+	p->func(p->arg);
+	return NULL;
+}
+
+int kproc_create(void (*func)(void *), void *arg, struct proc **procp,
+    int flags, int pages, const char *fmt, ...)
+{
+	struct proc *p;
+	int error;
+
+	p = kh_malloc(sizeof(*p), M_DEVBUF, M_WAITOK | M_ZERO);
+	p->func = func;
+	p->arg = arg;
+	if (procp != NULL)
+		*procp = p;
+	error = pthread_create(&p->td, NULL, kh_kproc_main, p);
+	if (error) {
+		if (procp != NULL)
+			*procp = NULL;
+		free(p);
+		return error;
+	}
+	pthread_detach(p->td);
+	return 0;
+}
+
+void kproc_exit(int ecode)
+{
+	pthread_exit(NULL);
+}
+
+/*****
+	Callouts, all run by one thread. c_gen tells the thread whether a
+	callout it picked was reset or stopped while it waited for c_mtx;
+	stopping a callout under its mutex thus keeps it from running, as in
+	the kernel.
+*/
+
+static TAILQ_HEAD(, callout) kh_callouts = TAILQ_HEAD_INITIALIZER(kh_callouts);
+static pthread_mutex_t kh_callout_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kh_callout_cv;	/* new callout, or one done */
+static pthread_once_t kh_callout_once = PTHREAD_ONCE_INIT;
+
+static void *kh_callout_main(void *arg)
+{
+	struct callout *c, *first;
+	sbintime_t now;
+	u_int gen;
+
+	pthread_mutex_lock(&kh_callout_mtx);
+	for (;;) {
+		first = NULL;
+		TAILQ_FOREACH(c, &kh_callouts, c_link)
+			if (first == NULL || c->c_time < first->c_time)
+				first = c;
+		now = sbinuptime();
+		if (first == NULL || first->c_time > now) {
+			kh_cond_wait(&kh_callout_cv, &kh_callout_mtx,
+			    first != NULL ? first->c_time : 0);
+			continue;
+		}
+
+		c = first;
+		TAILQ_REMOVE(&kh_callouts, c, c_link);
+		c->c_pending = 0;
+		c->c_running = 1;
+		gen = c->c_gen;
+		pthread_mutex_unlock(&kh_callout_mtx);
+
+		if (c->c_mtx != NULL)
+			mtx_lock(c->c_mtx);
+		pthread_mutex_lock(&kh_callout_mtx);
+		if (c->c_gen == gen) {
+			pthread_mutex_unlock(&kh_callout_mtx);
+			c->c_func(c->c_arg);
+			pthread_mutex_lock(&kh_callout_mtx);
+		}
+		pthread_mutex_unlock(&kh_callout_mtx);
+		if (c->c_mtx != NULL)
+			mtx_unlock(c->c_mtx);
+
+		pthread_mutex_lock(&kh_callout_mtx);
+		c->c_running = 0;
+		pthread_cond_broadcast(&kh_callout_cv);
+	}
+	return NULL;
+}
+
+static void kh_callout_start(void)
+{
+	pthread_t td;
+
+	kh_cond_init(&kh_callout_cv);
+	if (pthread_create(&td, NULL, kh_callout_main, NULL))
+		kh_fatal("cannot start", "callout thread");
+	pthread_detach(td);
+}
+
+void callout_init(struct callout *c, int mpsafe)
+{
+	bzero(c, sizeof(*c));
+}
+
+void callout_init_mtx(struct callout *c, struct mtx *m, int flags)
+{
+	bzero(c, sizeof(*c));
+	c->c_mtx = m;
+}
+
+int callout_reset_sbt(struct callout *c, sbintime_t sbt, sbintime_t pr,
+    callout_func_t *func, void *arg, int flags)
+{
+	int was;
+
+	pthread_once(&kh_callout_once, kh_callout_start);
+	pthread_mutex_lock(&kh_callout_mtx);
+	was = c->c_pending;
+	if (was)
+		TAILQ_REMOVE(&kh_callouts, c, c_link);
+	c->c_func = func;
+	c->c_arg = arg;
+	c->c_time = (flags & C_ABSOLUTE) ? sbt : sbinuptime() + sbt;
+	c->c_gen++;
+	c->c_pending = 1;
+	TAILQ_INSERT_TAIL(&kh_callouts, c, c_link);
+	pthread_cond_broadcast(&kh_callout_cv);
+	pthread_mutex_unlock(&kh_callout_mtx);
+	return was;
+}
+
+int callout_stop(struct callout *c)
+{
+	int was;
+
+	pthread_mutex_lock(&kh_callout_mtx);
+	was = c->c_pending;
+	if (was)
+		TAILQ_REMOVE(&kh_callouts, c, c_link);
+	c->c_pending = 0;
+	c->c_gen++;
+	pthread_mutex_unlock(&kh_callout_mtx);
+	return was;
+}
+
+int callout_drain(struct callout *c)
+{
+	int was;
+
+	was = callout_stop(c);
+	pthread_mutex_lock(&kh_callout_mtx);
+	while (c->c_running)
+		pthread_cond_wait(&kh_callout_cv, &kh_callout_mtx);
+	pthread_mutex_unlock(&kh_callout_mtx);
+	return was;
+}
+
+/*****
+	taskqueue_thread
+*/
+
+struct taskqueue {
+	STAILQ_HEAD(, task) tq_queue;
+	pthread_mutex_t tq_mtx;
+	pthread_cond_t tq_cv;		/* task queued, or one done */
+	pthread_once_t tq_once;
+};
+
+static struct taskqueue kh_taskqueue_thread = {
+	STAILQ_HEAD_INITIALIZER(kh_taskqueue_thread.tq_queue),
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	PTHREAD_ONCE_INIT,
+};
+struct taskqueue *taskqueue_thread = &kh_taskqueue_thread;
+
+static void *kh_taskqueue_main(void *arg)
+{
+	struct taskqueue *q = arg;
+	struct task *t;
+	int pending;
+
+	pthread_mutex_lock(&q->tq_mtx);
+	for (;;) {
+		while ((t = STAILQ_FIRST(&q->tq_queue)) == NULL)
+			pthread_cond_wait(&q->tq_cv, &q->tq_mtx);
+		STAILQ_REMOVE_HEAD(&q->tq_queue, ta_link);
+		pending = t->ta_pending;
+		t->ta_pending = 0;
+		t->ta_running = 1;
+		pthread_mutex_unlock(&q->tq_mtx);
+
+		t->ta_func(t->ta_context, pending);
+
+		pthread_mutex_lock(&q->tq_mtx);
+		t->ta_running = 0;
+		pthread_cond_broadcast(&q->tq_cv);
+	}
+	return NULL;
+}
+
+static void kh_taskqueue_start(void)
+{
+	pthread_t td;
+
+	if (pthread_create(&td, NULL, kh_taskqueue_main, taskqueue_thread))
+		kh_fatal("cannot start", "taskqueue thread");
+	pthread_detach(td);
+}
+
+int taskqueue_enqueue(struct taskqueue *q, struct task *t)
+{
+	pthread_once(&q->tq_once, kh_taskqueue_start);
+	pthread_mutex_lock(&q->tq_mtx);
+	if (t->ta_pending) {
+		if (t->ta_pending < USHRT_MAX)
+			t->ta_pending++;
+	} else {
+		STAILQ_INSERT_TAIL(&q->tq_queue, t, ta_link);
+		t->ta_pending = 1;
+		pthread_cond_broadcast(&q->tq_cv);
+	}
+	pthread_mutex_unlock(&q->tq_mtx);
+	return 0;
+}
+
+void taskqueue_drain(struct taskqueue *q, struct task *t)
+{
+	pthread_mutex_lock(&q->tq_mtx);
+	while (t->ta_pending || t->ta_running)
+		pthread_cond_wait(&q->tq_cv, &q->tq_mtx);
+	pthread_mutex_unlock(&q->tq_mtx);
+}
+
+static void kh_timeout_task_fire(void *arg)
+{
+	struct timeout_task *tt = arg;
+
+	taskqueue_enqueue(tt->q, &tt->t);
+}
+
+int taskqueue_enqueue_timeout(struct taskqueue *q, struct timeout_task *tt,
+    int timo)
+{
+	if (timo <= 0)
+		return taskqueue_enqueue(q, &tt->t);
+	callout_reset_sbt(&tt->c, (sbintime_t)timo * SBT_1S / hz, 0,
+	    kh_timeout_task_fire, tt, 0);
+	return 0;
+}
+
+int taskqueue_cancel_timeout(struct taskqueue *q, struct timeout_task *tt,
+    u_int *pendp)
+{
+	u_int pending;
+	int running;
+
+	pending = callout_stop(&tt->c);
+	pthread_mutex_lock(&q->tq_mtx);
+	if (tt->t.ta_pending) {
+		STAILQ_REMOVE(&q->tq_queue, &tt->t, task, ta_link);
+		pending += tt->t.ta_pending;
+		tt->t.ta_pending = 0;
+	}
+	running = tt->t.ta_running;
+	pthread_mutex_unlock(&q->tq_mtx);
+	if (pendp != NULL)
+		*pendp = pending;
+	return running ? EBUSY : 0;
+}
+
+void taskqueue_drain_timeout(struct taskqueue *q, struct timeout_task *tt)
+{
+	callout_drain(&tt->c);
+	taskqueue_drain(q, &tt->t);
+}
+
+/*****
+	Event handlers
+*/
+
+struct kh_eventhandler {
+	TAILQ_ENTRY(kh_eventhandler) link;
+	const char *name;
+	void (*func)(void *);
+	void *arg;
+};
+
+static TAILQ_HEAD(, kh_eventhandler) kh_eventhandlers =
+    TAILQ_HEAD_INITIALIZER(kh_eventhandlers);
+static pthread_mutex_t kh_eventhandler_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+eventhandler_tag kh_eventhandler_register(const char *name,
+    void (*func)(void *), void *arg)
+{
+	struct kh_eventhandler *eh;
+
+	eh = kh_malloc(sizeof(*eh), M_DEVBUF, M_WAITOK);
+	eh->name = name;
+	eh->func = func;
+	eh->arg = arg;
+	pthread_mutex_lock(&kh_eventhandler_mtx);
+	TAILQ_INSERT_TAIL(&kh_eventhandlers, eh, link);
+	pthread_mutex_unlock(&kh_eventhandler_mtx);
+	return eh;
+}
+
+void kh_eventhandler_deregister(eventhandler_tag tag)
+{
+	struct kh_eventhandler *eh = tag;
+
+	pthread_mutex_lock(&kh_eventhandler_mtx);
+	TAILQ_REMOVE(&kh_eventhandlers, eh, link);
+	pthread_mutex_unlock(&kh_eventhandler_mtx);
+	free(eh);
+}
+
+void kh_eventhandler_invoke(const char *name)
+{
+	struct kh_eventhandler *eh;
+
+	pthread_mutex_lock(&kh_eventhandler_mtx);
+	TAILQ_FOREACH(eh, &kh_eventhandlers, link)
+		if (strcmp(eh->name, name) == 0)
+			eh->func(eh->arg);
+	pthread_mutex_unlock(&kh_eventhandler_mtx);
+}
+
+/*****
+	sysctl. Only leaves are registered; a leaf's name is found by
+	walking up its parents.
+*/
+
+struct sysctl_oid sysctl__hw = {
+	NULL, "hw", CTLTYPE_NODE|CTLFLAG_RD, NULL, 0, NULL, NULL
+};
+
+static struct sysctl_oid *kh_oids;
+
+void kh_sysctl_register(struct sysctl_oid *oidp)
+{
+	oidp->oid_next = kh_oids;
+	kh_oids = oidp;
+}
+
+/* Does @oidp have the dotted name @name, of length @nlen? */
+static int kh_oid_match(const struct sysctl_oid *oidp, const char *name,
+    size_t nlen)
+{
+	size_t len = strlen(oidp->oid_name);
+
+	if (oidp->oid_parent == NULL)
+		return nlen == len && strncmp(name, oidp->oid_name, len) == 0;
+	if (nlen < len + 2 || name[nlen - len - 1] != '.' ||
+	    strncmp(name + nlen - len, oidp->oid_name, len) != 0)
+		return 0;
+	return kh_oid_match(oidp->oid_parent, name, nlen - len - 1);
+}
+
+static struct sysctl_oid *kh_oid_find(const char *name)
+{
+	struct sysctl_oid *oidp;
+
+	for (oidp = kh_oids; oidp != NULL; oidp = oidp->oid_next)
+		if (kh_oid_match(oidp, name, strlen(name)))
+			return oidp;
+	return NULL;
+}
+
+int kh_sysctl_out(struct sysctl_req *req, const void *p, size_t l)
+{
+	size_t i = req->oldidx;
+
+	req->oldidx += l;
+	if (req->oldptr == NULL || l == 0)
+		return 0;
+	if (i >= req->oldlen)
+		return ENOMEM;
+	memcpy((char *)req->oldptr + i, p, MIN(l, req->oldlen - i));
+	return i + l > req->oldlen ? ENOMEM : 0;
+}
+
+int kh_sysctl_in(struct sysctl_req *req, void *p, size_t l)
+{
+	if (req->newptr == NULL)
+		return 0;
+	if (req->newlen - req->newidx < l)
+		return EINVAL;
+	memcpy(p, (const char *)req->newptr + req->newidx, l);
+	req->newidx += l;
+	return 0;
+}
+
+int sysctl_handle_int(SYSCTL_HANDLER_ARGS)
+{
+	int tmp, error;
+
+	if (arg1 == NULL) {
+		tmp = arg2;
+		return SYSCTL_OUT(req, &tmp, sizeof(tmp));
+	}
+	error = SYSCTL_OUT(req, arg1, sizeof(int));
+	if (error || req->newptr == NULL)
+		return error;
+	return SYSCTL_IN(req, arg1, sizeof(int));
+}
+
+int sysctl_handle_64(SYSCTL_HANDLER_ARGS)
+{
+	int error;
+
+	error = SYSCTL_OUT(req, arg1, sizeof(uint64_t));
+	if (error || req->newptr == NULL)
+		return error;
+	return SYSCTL_IN(req, arg1, sizeof(uint64_t));
+}
+
+/* arg2 is the buffer size, 0 for a read-only string */
+int sysctl_handle_string(SYSCTL_HANDLER_ARGS)
+{
+	size_t len;
+	int error;
+
+	error = SYSCTL_OUT(req, arg1, strlen(arg1) + 1);
+	if (error || req->newptr == NULL)
+		return error;
+	len = req->newlen - req->newidx;
+	if (arg2 == 0)
+		return EPERM;
+	if (len >= (size_t)arg2)
+		return EINVAL;
+	error = SYSCTL_IN(req, arg1, len);
+	((char *)arg1)[len] = '\0';
+	return error;
+}
+
+int sysctl_handle_opaque(SYSCTL_HANDLER_ARGS)
+{
+	int error;
+
+	error = SYSCTL_OUT(req, arg1, arg2);
+	if (error || req->newptr == NULL)
+		return error;
+	return SYSCTL_IN(req, arg1, arg2);
+}
+
+int kh_sysctlbyname(const char *name, void *oldp, size_t *oldlenp,
+    const void *newp, size_t newlen)
+{
+	struct sysctl_oid *oidp;
+	struct sysctl_req req;
+	int error;
+
+	oidp = kh_oid_find(name);
+	if (oidp == NULL)
+		return ENOENT;
+	if (newp != NULL && !(oidp->oid_kind & CTLFLAG_WR))
+		return EPERM;
+
+	bzero(&req, sizeof(req));
+	req.oldptr = oldp;
+	req.oldlen = oldlenp != NULL ? *oldlenp : 0;
+	req.newptr = newp;
+	req.newlen = newlen;
+	error = oidp->oid_handler(oidp, oidp->oid_arg1, oidp->oid_arg2, &req);
+	if (oldlenp != NULL)
+		*oldlenp = req.oldidx;
+	return error;
+}
+
+int kh_sysctl_int(const char *name)
+{
+	size_t len;
+	int val;
+
+	len = sizeof(val);
+	if (kh_sysctlbyname(name, &val, &len, NULL, 0) || len != sizeof(val))
+		kh_fatal("cannot read", name);
+	return val;
+}
+
+uint64_t kh_sysctl_u64(const char *name)
+{
+	uint64_t val;
+	size_t len;
+
+	len = sizeof(val);
+	if (kh_sysctlbyname(name, &val, &len, NULL, 0) || len != sizeof(val))
+		kh_fatal("cannot read", name);
+	return val;
+}
+
+int kh_sysctl_set_int(const char *name, int val)
+{
+	return kh_sysctlbyname(name, NULL, NULL, &val, sizeof(val));
+}
+
+/*****
+	Loader tunables
+*/
+
+struct kh_env {
+	const char *name;
+	int val;
+	struct kh_env *next;
+};
+
+static struct kh_tunable *kh_tunables;
+static struct kh_env *kh_envs;
+
+void kh_tunable_register(struct kh_tunable *t)
+{
+	t->next = kh_tunables;
+	kh_tunables = t;
+}
+
+void kh_setenv(const char *name, int val)
+{
+	struct kh_tunable *t;
+	struct sysctl_oid *oidp;
+	struct kh_env *e;
+
+	e = kh_malloc(sizeof(*e), M_DEVBUF, M_WAITOK);
+	e->name = name;
+	e->val = val;
+	e->next = kh_envs;
+	kh_envs = e;
+
+	for (t = kh_tunables; t != NULL; t = t->next)
+		if (strcmp(t->name, name) == 0)
+			*t->ptr = val;
+	oidp = kh_oid_find(name);
+	if (oidp != NULL && (oidp->oid_kind & CTLFLAG_TUN))
+		*(int *)oidp->oid_arg1 = val;
+}
+
+int kh_getenv_int(const char *name, int *val)
+{
+	struct kh_env *e;
+
+	for (e = kh_envs; e != NULL; e = e->next)
+		if (strcmp(e->name, name) == 0) {
+			*val = e->val;
+			return 1;
+		}
+	return 0;
+}
+
+/*****
+	Devices
+*/
+
+struct kh_device {
+	driver_t *driver;
+	void *softc;
+	int unit;
+	char nameunit[32];
+	const char *desc;
+	char *desc_copy;
+};
+
+static struct kh_driver_entry *kh_drivers;
+
+void kh_driver_register(struct kh_driver_entry *e)
+{
+	e->next = kh_drivers;
+	kh_drivers = e;
+}
+
+static kobjop_t kh_method(device_t dev, const char *name)
+{
+	device_method_t *m;
+
+	for (m = dev->driver->methods; m->name != NULL; m++)
+		if (strcmp(m->name, name) == 0)
+			return m->func;
+	return NULL;
+}
+
+int kh_device_method(device_t dev, const char *name)
+{
+	kobjop_t f = kh_method(dev, name);
+
+	return f != NULL ? ((int (*)(device_t))f)(dev) : 0;
+}
+
+/* Probe and attach unit 0 of a driver; NULL if either fails */
+device_t kh_device_attach(const char *name)
+{
+	struct kh_driver_entry *e;
+	device_t dev;
+
+	for (e = kh_drivers; e != NULL; e = e->next)
+		if (strcmp(e->driver->name, name) == 0)
+			break;
+	if (e == NULL)
+		kh_fatal("no such driver", name);
+
+	dev = kh_malloc(sizeof(*dev), M_DEVBUF, M_WAITOK | M_ZERO);
+	dev->driver = e->driver;
+	dev->softc = kh_malloc(e->driver->size, M_DEVBUF, M_WAITOK | M_ZERO);
+	snprintf(dev->nameunit, sizeof(dev->nameunit), "%s0", name);
+	if (kh_device_method(dev, "device_probe") > 0 ||
+	    kh_device_method(dev, "device_attach") != 0) {
+		free(dev->softc);
+		free(dev);
+		return NULL;
+	}
+	return dev;
+}
+
+void kh_device_detach(device_t dev)
+{
+	if (kh_device_method(dev, "device_detach"))
+		kh_fatal("detach failed", dev->nameunit);
+	free(dev->desc_copy);
+	free(dev->softc);
+	free(dev);
+}
+
+void *device_get_softc(device_t dev)
+{
+	return dev->softc;
+}
+
+int device_get_unit(device_t dev)
+{
+	return dev->unit;
+}
+
+const char *device_get_nameunit(device_t dev)
+{
+	return dev->nameunit;
+}
+
+void device_set_desc(device_t dev, const char *desc)
+{
+	dev->desc = desc;
+}
+
+void device_set_desc_copy(device_t dev, const char *desc)
+{
+	free(dev->desc_copy);
+	dev->desc_copy = strdup(desc);
+	dev->desc = dev->desc_copy;
+}
+
+int device_printf(device_t dev, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	n = printf("%s: ", dev->nameunit);
+	va_start(ap, fmt);
+	n += vprintf(fmt, ap);
+	va_end(ap);
+	return n;
+}
+
+/* Devices are attached by the tests, not by identify */
+device_t device_find_child(device_t dev, const char *name, int unit)
+{
+	return NULL;
+}
+
+device_t device_add_child_ordered(device_t dev, u_int order,
+    const char *name, int unit)
+{
+	return NULL;
+}
+
+int bus_set_resource(device_t dev, int type, int rid, u_long start,
+    u_long count)
+{
+	return 0;
+}
+
+/* thinkpad_ec's is the only port resource asked for */
+u_long bus_get_resource_start(device_t dev, int type, int rid)
+{
+	return 0x1600;
+}
+
+/* There is no bus to claim ports on */
+struct resource *bus_alloc_resource(device_t dev, int type, int *rid,
+    u_long start, u_long end, u_long count, u_int flags)
+{
+	return NULL;
+}
+
+int bus_release_resource(device_t dev, int type, int rid,
+    struct resource *r)
+{
+	return 0;
+}
+
+bus_space_tag_t rman_get_bustag(struct resource *r)
+{
+	kh_fatal("no bus", __func__);
+}
+
+bus_space_handle_t rman_get_bushandle(struct resource *r)
+{
+	kh_fatal("no bus", __func__);
+}
+
+u_char bus_space_read_1(bus_space_tag_t t, bus_space_handle_t h,
+    bus_size_t o)
+{
+	kh_fatal("no bus", __func__);
+}
+
+void bus_space_write_1(bus_space_tag_t t, bus_space_handle_t h,
+    bus_size_t o, u_char v)
+{
+	kh_fatal("no bus", __func__);
+}
+
+void bus_space_read_region_1(bus_space_tag_t t, bus_space_handle_t h,
+    bus_size_t o, u_char *buf, bus_size_t count)
+{
+	kh_fatal("no bus", __func__);
+}
+
+void bus_space_write_region_1(bus_space_tag_t t, bus_space_handle_t h,
+    bus_size_t o, const u_char *buf, bus_size_t count)
+{
+	kh_fatal("no bus", __func__);
+}
+
+/*****
+	smbios.c maps BIOS memory and is not built; there is no DMI here
+*/
+
+smbios_values_t smbios_values;
+
+int smbios_check_system(smbios_system_id *list)
+{
+	return 0;
+}
+
+int smbios_find_oem_substring(const char *substr)
+{
+	return 0;
+}
+
+/*****
+	hdaps_dev.c, hdaps_joydev.c and hdaps_shock.c make character devices
+	and are not built; hdaps runs without its devices and shock detection
+*/
+
+void hdaps_make_dev(void) { }
+void hdaps_destroy_dev(void) { }
+void hdaps_joy_make_dev(void) { }
+void hdaps_joy_destroy_dev(void) { }
+void hdaps_shock_make_dev(void) { }
+void hdaps_shock_destroy_dev(void) { }
+void hdaps_shock_pause(void) { }
+
+void hdaps_shock_sample(const struct hdaps_sample *s, int rest_x, int rest_y)
+{
+}
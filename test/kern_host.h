@@ -0,0 +1,509 @@
+/*
+ *  kern_host.h - just enough of the FreeBSD kernel API to run thinkpad_ec,
+ *  its simulator and the modules on top of it as a userland process
+ *
+ *  The module sources, and the tests driving them, are compiled with
+ *	-D_KERNEL -Ikern -include kern_host.h
+ *  The headers under kern/ are empty, so the sources' own #includes work
+ *  unchanged; whatever they would have declared is here instead. Threads
+ *  are pthreads, time is CLOCK_MONOTONIC counted from program start, and
+ *  sysctls and tunables live in a table the tests reach through
+ *  kh_sysctlbyname() and kh_setenv(). Port I/O on the real bus aborts:
+ *  only the simulated EC (hw.thinkpad_ec.simulate) runs here.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef _KERN_HOST_H
+#define _KERN_HOST_H
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+
+/*****
+	Errors, types, bit and string helpers
+*/
+
+#ifndef ENOATTR
+#define ENOATTR		ENODATA
+#endif
+
+#define nitems(x)		(sizeof(x) / sizeof((x)[0]))
+#define __containerof(p, s, f)	((s *)((char *)(p) - offsetof(s, f)))
+#define __DECONST(type, var)	((type)(uintptr_t)(const void *)(var))
+
+static inline int flsll(long long mask)
+{
+	return mask == 0 ? 0 :
+	    (int)(sizeof(mask) * 8) - __builtin_clzll((unsigned long long)mask);
+}
+
+size_t strlcpy(char *dst, const char *src, size_t size);
+
+/*****
+	Time
+*/
+
+typedef int64_t sbintime_t;
+
+#define SBT_1S		((sbintime_t)1 << 32)
+#define SBT_1MS		(SBT_1S / 1000)
+#define SBT_1US		(SBT_1S / 1000000)
+#define SBT_1NS		(SBT_1S / 1000000000)
+
+static inline int64_t sbttons(sbintime_t sbt)
+{
+	return (sbt >> 32) * 1000000000 +
+	    (int64_t)(((uint64_t)(sbt & 0xffffffff) * 1000000000) >> 32);
+}
+
+static inline sbintime_t nstosbt(int64_t ns)
+{
+	return ((ns / 1000000000) << 32) +
+	    (sbintime_t)((((uint64_t)(ns % 1000000000)) << 32) / 1000000000);
+}
+
+static inline int64_t sbttous(sbintime_t sbt)	{ return sbttons(sbt) / 1000; }
+static inline sbintime_t ustosbt(int64_t us)	{ return nstosbt(us * 1000); }
+static inline sbintime_t mstosbt(int64_t ms)	{ return nstosbt(ms * 1000000); }
+
+/* callout and msleep_sbt flags */
+#define C_DIRECT_EXEC	0x0001
+#define C_ABSOLUTE	0x0200
+#define C_HARDCLOCK	0x0100
+#define C_PREL(x)	((x) << 1)
+
+extern int hz;
+#define ticks		kh_ticks()
+int kh_ticks(void);
+
+sbintime_t sbinuptime(void);
+uint64_t cpu_ticks(void);		/* nanoseconds */
+uint64_t cpu_tickrate(void);
+void DELAY(int us);			/* busy-waits */
+
+static inline void cpu_spinwait(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+int ppsratecheck(struct timeval *lasttime, int *curpps, int maxpps);
+
+/*****
+	Console; kernel messages go to stdout
+*/
+
+#define log(pri, ...)	printf(__VA_ARGS__)
+
+/*****
+	Memory
+*/
+
+struct malloc_type {
+	const char *ks_shortdesc;
+};
+
+#define MALLOC_DEFINE(type, shortdesc, longdesc) \
+	struct malloc_type type[1] = { { shortdesc } }
+#define MALLOC_DECLARE(type)	extern struct malloc_type type[1]
+
+MALLOC_DECLARE(M_DEVBUF);
+MALLOC_DECLARE(M_TEMP);
+
+#define M_NOWAIT	0x0001
+#define M_WAITOK	0x0002
+#define M_ZERO		0x0100
+
+void *kh_malloc(size_t size, struct malloc_type *type, int flags);
+void kh_free(void *addr, struct malloc_type *type);
+#define malloc(size, type, flags)	kh_malloc((size), (type), (flags))
+#define free(addr, type)		kh_free((addr), (type))
+
+/*****
+	Atomics (machine/atomic.h)
+*/
+
+#define atomic_load_acq_int(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_store_rel_int(p, v) \
+	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_add_int(p, v)	((void)__atomic_fetch_add((p), (v), \
+				    __ATOMIC_SEQ_CST))
+#define atomic_thread_fence_acq()	__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define atomic_thread_fence_rel()	__atomic_thread_fence(__ATOMIC_RELEASE)
+
+/*****
+	Mutexes and sleeping
+*/
+
+struct mtx {
+	pthread_mutex_t m;
+	const char *name;
+	pthread_t owner;
+	int owned;
+};
+
+#define MTX_DEF		0x0000
+#define MTX_SPIN	0x0001
+#define MA_OWNED	0x01
+#define MA_NOTOWNED	0x00
+
+void mtx_init(struct mtx *m, const char *name, const char *type, int opts);
+void mtx_destroy(struct mtx *m);
+void mtx_lock(struct mtx *m);
+void mtx_unlock(struct mtx *m);
+int mtx_owned(struct mtx *m);
+#define mtx_assert(m, what)	do { } while (0)
+
+#define MTX_SYSINIT(name, mtx, desc, opts) \
+	static void __attribute__((constructor)) kh_mtx_sysinit_##name(void) \
+	{ mtx_init((mtx), (desc), NULL, (opts)); }
+
+/* priorities are ignored */
+#define PZERO		0
+#define PCATCH		0x100
+
+int msleep_sbt(void *chan, struct mtx *m, int pri, const char *wmesg,
+    sbintime_t sbt, sbintime_t pr, int flags);
+#define mtx_sleep(chan, m, pri, wmesg, timo) \
+	msleep_sbt((chan), (m), (pri), (wmesg), \
+	    (timo) ? (sbintime_t)(timo) * SBT_1S / hz : 0, 0, 0)
+int pause_sbt(const char *wmesg, sbintime_t sbt, sbintime_t pr, int flags);
+#define pause(wmesg, timo) \
+	pause_sbt((wmesg), (sbintime_t)(timo) * SBT_1S / hz, 0, 0)
+void wakeup(void *chan);
+void wakeup_one(void *chan);
+
+/*****
+	Threads, callouts and taskqueues
+*/
+
+struct proc;
+int kproc_create(void (*func)(void *), void *arg, struct proc **procp,
+    int flags, int pages, const char *fmt, ...);
+void kproc_exit(int ecode) __attribute__((noreturn));
+
+typedef void callout_func_t(void *);
+
+struct callout {
+	TAILQ_ENTRY(callout) c_link;
+	struct mtx *c_mtx;		/* held while c_func runs, or NULL */
+	callout_func_t *c_func;
+	void *c_arg;
+	sbintime_t c_time;
+	u_int c_gen;			/* bumped by every reset and stop */
+	int c_pending;
+	int c_running;
+};
+
+void callout_init(struct callout *c, int mpsafe);
+void callout_init_mtx(struct callout *c, struct mtx *m, int flags);
+int callout_reset_sbt(struct callout *c, sbintime_t sbt, sbintime_t pr,
+    callout_func_t *func, void *arg, int flags);
+int callout_stop(struct callout *c);
+int callout_drain(struct callout *c);
+
+typedef void task_fn_t(void *context, int pending);
+
+struct task {
+	STAILQ_ENTRY(task) ta_link;
+	u_short ta_pending;
+	int ta_running;
+	task_fn_t *ta_func;
+	void *ta_context;
+};
+
+struct taskqueue;
+
+struct timeout_task {
+	struct taskqueue *q;
+	struct task t;
+	struct callout c;
+};
+
+extern struct taskqueue *taskqueue_thread;
+
+#define TASK_INIT(task, priority, func, context) do { \
+	(task)->ta_pending = 0; \
+	(task)->ta_running = 0; \
+	(task)->ta_func = (func); \
+	(task)->ta_context = (context); \
+} while (0)
+#define TIMEOUT_TASK_INIT(queue, timeout_task, priority, func, context) do { \
+	TASK_INIT(&(timeout_task)->t, (priority), (func), (context)); \
+	(timeout_task)->q = (queue); \
+	callout_init(&(timeout_task)->c, 1); \
+} while (0)
+
+int taskqueue_enqueue(struct taskqueue *queue, struct task *task);
+void taskqueue_drain(struct taskqueue *queue, struct task *task);
+int taskqueue_enqueue_timeout(struct taskqueue *queue,
+    struct timeout_task *timeout_task, int timo);
+int taskqueue_cancel_timeout(struct taskqueue *queue,
+    struct timeout_task *timeout_task, u_int *pendp);
+void taskqueue_drain_timeout(struct taskqueue *queue,
+    struct timeout_task *timeout_task);
+
+/*****
+	Event handlers; only handlers taking their registered argument
+*/
+
+typedef void *eventhandler_tag;
+
+#define EVENTHANDLER_PRI_ANY	10000
+#define EVENTHANDLER_DECLARE(name, type)	struct kh_eventhandler_##name
+#define EVENTHANDLER_REGISTER(name, func, arg, priority) \
+	kh_eventhandler_register(#name, (void (*)(void *))(func), (arg))
+#define EVENTHANDLER_DEREGISTER(name, tag) \
+	kh_eventhandler_deregister(tag)
+#define EVENTHANDLER_INVOKE(name) \
+	kh_eventhandler_invoke(#name)
+
+eventhandler_tag kh_eventhandler_register(const char *name,
+    void (*func)(void *), void *arg);
+void kh_eventhandler_deregister(eventhandler_tag tag);
+void kh_eventhandler_invoke(const char *name);
+
+/*****
+	sysctl and tunables
+*/
+
+struct sysctl_req {
+	void *oldptr;
+	size_t oldlen;
+	size_t oldidx;
+	const void *newptr;
+	size_t newlen;
+	size_t newidx;
+};
+
+#define SYSCTL_HANDLER_ARGS \
+	struct sysctl_oid *oidp, void *arg1, intptr_t arg2, \
+	struct sysctl_req *req
+
+struct sysctl_oid {
+	struct sysctl_oid *oid_parent;	/* NULL for the root */
+	const char *oid_name;
+	int oid_kind;			/* CTLTYPE_* | CTLFLAG_* */
+	void *oid_arg1;
+	intptr_t oid_arg2;
+	int (*oid_handler)(SYSCTL_HANDLER_ARGS);
+	struct sysctl_oid *oid_next;	/* in the table */
+};
+
+#define CTLTYPE		0xf
+#define CTLTYPE_NODE	1
+#define CTLTYPE_INT	2
+#define CTLTYPE_STRING	3
+#define CTLTYPE_S64	4
+#define CTLTYPE_OPAQUE	5
+#define CTLTYPE_UINT	6
+#define CTLTYPE_U64	9
+#define CTLFLAG_RD	0x80000000
+#define CTLFLAG_WR	0x40000000
+#define CTLFLAG_RW	(CTLFLAG_RD|CTLFLAG_WR)
+#define CTLFLAG_TUN	0x00080000
+#define CTLFLAG_RDTUN	(CTLFLAG_RD|CTLFLAG_TUN)
+#define CTLFLAG_RWTUN	(CTLFLAG_RW|CTLFLAG_TUN)
+#define CTLFLAG_MPSAFE	0
+#define OID_AUTO	(-1)
+
+extern struct sysctl_oid sysctl__hw;
+
+void kh_sysctl_register(struct sysctl_oid *oidp);
+
+#define SYSCTL_DECL(name)	extern struct sysctl_oid sysctl_##name
+
+#define KH_SYSCTL_OID(parent, name, kind, a1, a2, handler) \
+	static struct sysctl_oid kh_oid_##parent##_##name = { \
+		&sysctl_##parent, #name, (kind), (void *)(a1), (a2), \
+		(handler), NULL }; \
+	static void __attribute__((constructor)) \
+	kh_oid_reg_##parent##_##name(void) \
+	{ kh_sysctl_register(&kh_oid_##parent##_##name); }
+
+#define SYSCTL_NODE(parent, nbr, name, access, handler, descr) \
+	struct sysctl_oid sysctl_##parent##_##name = { \
+		&sysctl_##parent, #name, CTLTYPE_NODE|(access), NULL, 0, \
+		NULL, NULL }
+#define SYSCTL_INT(parent, nbr, name, access, ptr, val, descr) \
+	KH_SYSCTL_OID(parent, name, CTLTYPE_INT|(access), ptr, val, \
+	    sysctl_handle_int)
+#define SYSCTL_UINT(parent, nbr, name, access, ptr, val, descr) \
+	KH_SYSCTL_OID(parent, name, CTLTYPE_UINT|(access), ptr, val, \
+	    sysctl_handle_int)
+#define SYSCTL_UQUAD(parent, nbr, name, access, ptr, val, descr) \
+	KH_SYSCTL_OID(parent, name, CTLTYPE_U64|(access), ptr, val, \
+	    sysctl_handle_64)
+#define SYSCTL_OPAQUE(parent, nbr, name, access, ptr, len, fmt, descr) \
+	KH_SYSCTL_OID(parent, name, CTLTYPE_OPAQUE|(access), ptr, len, \
+	    sysctl_handle_opaque)
+#define SYSCTL_PROC(parent, nbr, name, access, ptr, arg, handler, fmt, \
+	    descr) \
+	KH_SYSCTL_OID(parent, name, (access), ptr, arg, handler)
+
+#define SYSCTL_OUT(req, p, l)	kh_sysctl_out((req), (p), (l))
+#define SYSCTL_IN(req, p, l)	kh_sysctl_in((req), (p), (l))
+
+int kh_sysctl_out(struct sysctl_req *req, const void *p, size_t l);
+int kh_sysctl_in(struct sysctl_req *req, void *p, size_t l);
+int sysctl_handle_int(SYSCTL_HANDLER_ARGS);
+int sysctl_handle_64(SYSCTL_HANDLER_ARGS);
+int sysctl_handle_string(SYSCTL_HANDLER_ARGS);
+int sysctl_handle_opaque(SYSCTL_HANDLER_ARGS);
+
+/* kh_setenv() sets TUNABLE_INT variables and CTLFLAG_TUN sysctls of that
+ * name at once and keeps the value for TUNABLE_INT_FETCH(); tests call it
+ * before attaching anything, as the loader would.
+ */
+struct kh_tunable {
+	const char *name;
+	int *ptr;
+	struct kh_tunable *next;
+};
+
+void kh_tunable_register(struct kh_tunable *t);
+int kh_getenv_int(const char *name, int *val);
+
+#define KH_CAT(a, b)	KH_CAT2(a, b)
+#define KH_CAT2(a, b)	a##b
+#define TUNABLE_INT(path, var) \
+	static struct kh_tunable KH_CAT(kh_tunable_, __LINE__) = \
+	    { (path), (var), NULL }; \
+	static void __attribute__((constructor)) \
+	KH_CAT(kh_tunable_reg_, __LINE__)(void) \
+	{ kh_tunable_register(&KH_CAT(kh_tunable_, __LINE__)); }
+#define TUNABLE_INT_FETCH(path, var)	kh_getenv_int((path), (var))
+
+/*****
+	DTrace probes compile away; arguments are still evaluated
+*/
+
+#define SDT_PROVIDER_DEFINE(prov)	struct kh_sdt_##prov
+#define SDT_PROBE_DEFINE0(prov, mod, func, name)
+#define SDT_PROBE_DEFINE1(prov, mod, func, name, ...)
+#define SDT_PROBE_DEFINE2(prov, mod, func, name, ...)
+#define SDT_PROBE_DEFINE3(prov, mod, func, name, ...)
+#define SDT_PROBE_DEFINE4(prov, mod, func, name, ...)
+#define SDT_PROBE0(prov, mod, func, name)	do { } while (0)
+#define SDT_PROBE1(prov, mod, func, name, a0)	((void)(a0))
+#define SDT_PROBE2(prov, mod, func, name, a0, a1) \
+	((void)(a0), (void)(a1))
+#define SDT_PROBE3(prov, mod, func, name, a0, a1, a2) \
+	((void)(a0), (void)(a1), (void)(a2))
+#define SDT_PROBE4(prov, mod, func, name, a0, a1, a2, a3) \
+	((void)(a0), (void)(a1), (void)(a2), (void)(a3))
+
+/*****
+	Newbus. Drivers are found by name; kh_device_attach() runs probe and
+	attach, and the other methods are run through kh_device_method().
+*/
+
+typedef struct kh_device *device_t;
+typedef struct kh_devclass *devclass_t;
+typedef int (*kobjop_t)(void);
+
+typedef struct {
+	const char *name;
+	kobjop_t func;
+} device_method_t;
+
+#define DEVMETHOD(name, func)	{ #name, (kobjop_t)(func) }
+#define DEVMETHOD_END		{ NULL, NULL }
+
+typedef struct kh_driver {
+	const char *name;
+	device_method_t *methods;
+	size_t size;
+} driver_t;
+
+struct kh_driver_entry {
+	driver_t *driver;
+	struct kh_driver_entry *next;
+};
+
+void kh_driver_register(struct kh_driver_entry *e);
+
+#define DRIVER_MODULE(name, busname, driver, devclass, evh, arg) \
+	static struct kh_driver_entry kh_drv_##name##_##busname = \
+	    { &(driver), NULL }; \
+	static void __attribute__((constructor)) \
+	kh_drv_reg_##name##_##busname(void) \
+	{ (void)&(devclass); kh_driver_register(&kh_drv_##name##_##busname); }
+#define MODULE_VERSION(name, version)		struct kh_modver_##name
+#define MODULE_DEPEND(name, dep, lo, pref, hi)	struct kh_moddep_##name
+
+void *device_get_softc(device_t dev);
+int device_get_unit(device_t dev);
+const char *device_get_nameunit(device_t dev);
+void device_set_desc(device_t dev, const char *desc);
+void device_set_desc_copy(device_t dev, const char *desc);
+int device_printf(device_t dev, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+device_t device_find_child(device_t dev, const char *name, int unit);
+device_t device_add_child_ordered(device_t dev, u_int order,
+    const char *name, int unit);
+#define BUS_ADD_CHILD(bus, order, name, unit) \
+	device_add_child_ordered((bus), (order), (name), (unit))
+
+/* Port resources; only the simulated channel is used on the host */
+typedef int bus_space_tag_t;
+typedef u_long bus_space_handle_t;
+typedef u_long bus_size_t;
+struct resource;
+
+#define SYS_RES_IOPORT	4
+#define RF_ACTIVE	0x0002
+
+int bus_set_resource(device_t dev, int type, int rid, u_long start,
+    u_long count);
+u_long bus_get_resource_start(device_t dev, int type, int rid);
+struct resource *bus_alloc_resource(device_t dev, int type, int *rid,
+    u_long start, u_long end, u_long count, u_int flags);
+int bus_release_resource(device_t dev, int type, int rid,
+    struct resource *r);
+bus_space_tag_t rman_get_bustag(struct resource *r);
+bus_space_handle_t rman_get_bushandle(struct resource *r);
+u_char bus_space_read_1(bus_space_tag_t t, bus_space_handle_t h,
+    bus_size_t o);
+void bus_space_write_1(bus_space_tag_t t, bus_space_handle_t h,
+    bus_size_t o, u_char v);
+void bus_space_read_region_1(bus_space_tag_t t, bus_space_handle_t h,
+    bus_size_t o, u_char *buf, bus_size_t count);
+void bus_space_write_region_1(bus_space_tag_t t, bus_space_handle_t h,
+    bus_size_t o, const u_char *buf, bus_size_t count);
+
+/*****
+	Host side: what the tests use to drive the modules
+*/
+
+int kh_sysctlbyname(const char *name, void *oldp, size_t *oldlenp,
+    const void *newp, size_t newlen);
+int kh_sysctl_int(const char *name);
+uint64_t kh_sysctl_u64(const char *name);
+int kh_sysctl_set_int(const char *name, int val);
+void kh_setenv(const char *name, int val);
+
+device_t kh_device_attach(const char *name);
+int kh_device_method(device_t dev, const char *method);
+void kh_device_detach(device_t dev);
+
+#endif /* _KERN_HOST_H */
@@ -0,0 +1,88 @@
+/*
+ *  test.c - helpers shared by the host tests, see test.h
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "test.h"
+
+const struct thinkpad_ec_row test_accel_args =
+	{ .mask=0x0001, .val={0x11} };
+const struct thinkpad_ec_row test_config_args =
+	{ .mask=0x0003, .val={0x17, 0x82} };
+const struct thinkpad_ec_row test_battery_args =
+	{ .mask=0x8001, .val={0x01,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x00} };
+
+/* Attach thinkpad_ec on the simulated EC */
+device_t test_ec_attach(void)
+{
+	device_t dev;
+
+	kh_setenv("hw.thinkpad_ec.simulate", 1);
+	dev = kh_device_attach("thinkpad_ec");
+	CHECK(dev != NULL);
+	return dev;
+}
+
+/* Power the accelerometer up at @rate readouts per second, as hdaps does */
+void test_accel_on(int rate)
+{
+	const struct thinkpad_ec_row power =
+		{ .mask=0x0003, .val={0x14, 0x01} };
+	const struct thinkpad_ec_row config =
+		{ .mask=0x000F, .val={0x10, rate & 0xff, rate >> 8, 2} };
+	struct thinkpad_ec_row data;
+
+	data.mask = 0x8001;
+	CHECK(thinkpad_ec_read_row(&power, &data) == 0);
+	CHECK(thinkpad_ec_read_row(&config, &data) == 0);
+	CHECK(data.val[0xf] == 0x00);
+}
+
+/* Read a row in class @prio, waiting for it; @data->mask as for
+ * thinkpad_ec_read_row(). Returns the request's result.
+ */
+int test_read(const struct thinkpad_ec_row *args, int prio,
+    struct thinkpad_ec_row *data)
+{
+	struct thinkpad_ec_req req;
+	int ret;
+
+	bzero(&req, sizeof(req));
+	req.args = *args;
+	req.data.mask = data->mask;
+	req.prio = prio;
+	ret = thinkpad_ec_submit(&req);
+	if (!ret)
+		ret = thinkpad_ec_wait(&req);
+	if (!ret)
+		bcopy(req.data.val, data->val, sizeof(data->val));
+	return ret;
+}
+
+void test_stats(struct thinkpad_ec_stats *st)
+{
+	size_t len = sizeof(*st);
+
+	CHECK(kh_sysctlbyname("hw.thinkpad_ec.stats.all", st, &len,
+	    NULL, 0) == 0);
+	CHECK(len == sizeof(*st));
+}
+
+uint64_t test_sim_transactions(void)
+{
+	return kh_sysctl_u64("hw.thinkpad_ec.sim.transactions");
+}
+
+uint64_t test_now_ns(void)
+{
+	return sbttons(sbinuptime());
+}
+
+void test_sleep_ns(uint64_t ns)
+{
+	pause_sbt("test", nstosbt(ns), 0, 0);
+}
@@ -0,0 +1,37 @@
+/*
+ *  test.h - helpers shared by the host tests, see kern_host.h
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef _TEST_H
+#define _TEST_H
+
+#include "../kmod/thinkpad_ec.h"
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", \
+		    __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while (0)
+
+/* Rows the tests and benchmarks use */
+extern const struct thinkpad_ec_row test_accel_args;	/* 0x11 readout */
+extern const struct thinkpad_ec_row test_config_args;	/* 0x17 0x82 */
+extern const struct thinkpad_ec_row test_battery_args;	/* 0x01, battery 0 */
+
+device_t test_ec_attach(void);
+void test_accel_on(int rate);
+int test_read(const struct thinkpad_ec_row *args, int prio,
+    struct thinkpad_ec_row *data);
+void test_stats(struct thinkpad_ec_stats *st);
+uint64_t test_sim_transactions(void);
+uint64_t test_now_ns(void);
+void test_sleep_ns(uint64_t ns);
+
+#endif /* _TEST_H */
@@ -0,0 +1,113 @@
+/*
+ *  test_adaptive.c - hdaps drops to the idle rate at rest and comes back
+ *
+ *  Attaches hdaps on the simulated EC with motion-adaptive sampling on
+ *  and the rest position the simulated accelerometer wobbles around.
+ *  The sampler must go idle after idle_delay_ms, with the EC and the poll
+ *  rate at idle_rate. Moving hw.thinkpad_ec.sim.x away from rest must
+ *  bring back hw.hdaps.sampling_rate within about one idle period, and
+ *  moving it back must make the sampler idle again. Reading the EC config
+ *  back through the sysctls must not disturb the rates, and an
+ *  oversampling ratio the EC can't take at sampling_rate is refused.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "test.h"
+
+#define REST_X		500		/* sim.x and .y defaults */
+#define REST_Y		480
+#define RATE		50		/* hw.hdaps.sampling_rate default */
+#define IDLE_RATE	5
+#define OVERSAMPLING	5		/* EC readouts per poll */
+#define IDLE_DELAY_MS	300
+#define WAIT_NS		3000000000
+
+/* Wait for hw.hdaps.adaptive.idle to read @idle; returns the time taken */
+static uint64_t wait_idle(int idle)
+{
+	uint64_t start = test_now_ns();
+
+	while (kh_sysctl_int("hw.hdaps.adaptive.idle") != idle) {
+		CHECK(test_now_ns() - start < WAIT_NS);
+		test_sleep_ns(1000000);
+	}
+	return test_now_ns() - start;
+}
+
+/* Check the sampler and the EC run at @rate; returns polls per second */
+static int check_rate(int rate)
+{
+	struct thinkpad_ec_row data;
+	uint64_t polls;
+	int pps;
+
+	CHECK(kh_sysctl_int("hw.hdaps.adaptive.rate") == rate);
+	data.mask = 0x801F;
+	CHECK(thinkpad_ec_read_row(&test_config_args, &data) == 0);
+	CHECK(data.val[0x2] == ((rate * OVERSAMPLING) & 0xff));
+
+	polls = kh_sysctl_u64("hw.hdaps.sampler.polls");
+	test_sleep_ns(1000000000);
+	pps = kh_sysctl_u64("hw.hdaps.sampler.polls") - polls;
+	CHECK(pps >= rate * 8 / 10 && pps <= rate * 12 / 10 + 1);
+	return pps;
+}
+
+int main(void)
+{
+	device_t dev;
+	uint64_t t;
+
+	test_ec_attach();
+	kh_setenv("hw.hdaps.rest_x", REST_X);
+	kh_setenv("hw.hdaps.rest_y", REST_Y);
+	CHECK(kh_sysctl_set_int("hw.hdaps.adaptive.idle_band", 5) == 0);
+	CHECK(kh_sysctl_set_int("hw.hdaps.adaptive.idle_rate",
+	    IDLE_RATE) == 0);
+	CHECK(kh_sysctl_set_int("hw.hdaps.adaptive.idle_delay_ms",
+	    IDLE_DELAY_MS) == 0);
+	CHECK(kh_sysctl_set_int("hw.hdaps.adaptive.enable", 1) == 0);
+	dev = kh_device_attach("hdaps");
+	CHECK(dev != NULL);
+
+	t = wait_idle(1);
+	printf("at rest: idle after %ju ms, %d polls/s\n",
+	    (uintmax_t)(t / 1000000), check_rate(IDLE_RATE));
+	CHECK(t >= IDLE_DELAY_MS * 1000000ULL);
+	CHECK(kh_sysctl_u64("hw.hdaps.adaptive.switches") == 1);
+
+	CHECK(kh_sysctl_set_int("hw.thinkpad_ec.sim.x", REST_X + 100) == 0);
+	t = wait_idle(0);
+	printf("moved: active after %ju ms, %d polls/s\n",
+	    (uintmax_t)(t / 1000000), check_rate(RATE));
+	CHECK(t < 2000000000ULL / IDLE_RATE);
+	CHECK(kh_sysctl_u64("hw.hdaps.adaptive.switches") == 2);
+
+	CHECK(kh_sysctl_set_int("hw.thinkpad_ec.sim.x", REST_X) == 0);
+	t = wait_idle(1);
+	printf("back at rest: idle after %ju ms\n", (uintmax_t)(t / 1000000));
+	CHECK(kh_sysctl_u64("hw.hdaps.adaptive.switches") == 3);
+
+	/* reading the EC config while idle leaves the rates alone */
+	kh_sysctl_int("hw.hdaps.running_avg_filter_order");
+	CHECK(kh_sysctl_int("hw.hdaps.oversampling_ratio") == OVERSAMPLING);
+	CHECK(kh_sysctl_int("hw.hdaps.adaptive.rate") == IDLE_RATE);
+	CHECK(kh_sysctl_int("hw.hdaps.sampling_rate") == RATE);
+	CHECK(kh_sysctl_set_int("hw.hdaps.oversampling_ratio",
+	    0xFFFF / RATE + 1) == EINVAL);
+
+	printf("%ju ms active, %ju ms idle, %ju polls missed\n",
+	    (uintmax_t)kh_sysctl_u64("hw.hdaps.adaptive.active_ms"),
+	    (uintmax_t)kh_sysctl_u64("hw.hdaps.adaptive.idle_ms"),
+	    (uintmax_t)kh_sysctl_u64("hw.hdaps.sampler.missed"));
+	CHECK(kh_sysctl_u64("hw.hdaps.adaptive.errors") == 0);
+	CHECK(kh_sysctl_u64("hw.hdaps.adaptive.active_ms") >= 1000);
+	CHECK(kh_sysctl_u64("hw.hdaps.adaptive.idle_ms") >= 1000);
+
+	kh_device_detach(dev);
+	return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ *  test_coalesce.c - EC transactions per second as readers are added
+ *
+ *  1, 2, 4 and 8 threads read the 0x11 accelerometer row as fast as they
+ *  can for half a second each. Identical reads in flight share one EC
+ *  transaction, so the EC transaction rate must stay about flat while
+ *  the rows handed out grow with the readers. A read issued while an
+ *  asynchronous request with a done callback is in flight must not share
+ *  it, and costs a transaction of its own.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "test.h"
+
+#define RUN_NS		500000000
+#define MAX_READERS	8
+
+#define REPLY_NS	200000		/* keeps the callback request in flight */
+
+static volatile int stop;
+static volatile int cb_done;
+
+static void *reader_main(void *arg)
+{
+	struct thinkpad_ec_row data;
+	uint64_t *reads = arg;
+
+	while (!stop) {
+		data.mask = 0xBFFF;
+		CHECK(thinkpad_ec_read_row(&test_accel_args, &data) == 0);
+		CHECK(data.val[0x0] == 0x11);
+		(*reads)++;
+	}
+	return NULL;
+}
+
+static void cb(struct thinkpad_ec_req *req, void *arg)
+{
+	cb_done = 1;
+}
+
+int main(void)
+{
+	struct thinkpad_ec_stats st0, st1;
+	struct thinkpad_ec_req req;
+	struct thinkpad_ec_row data;
+	pthread_t td[MAX_READERS];
+	uint64_t reads[MAX_READERS], tx0, tx, total;
+	double tps, tps1 = 0;
+	int n, i;
+
+	test_ec_attach();
+	test_accel_on(100);
+
+	for (n = 1; n <= MAX_READERS; n *= 2) {
+		test_stats(&st0);
+		tx0 = test_sim_transactions();
+		stop = 0;
+		for (i = 0; i < n; i++) {
+			reads[i] = 0;
+			CHECK(pthread_create(&td[i], NULL, reader_main,
+			    &reads[i]) == 0);
+		}
+		test_sleep_ns(RUN_NS);
+		stop = 1;
+		for (total = 0, i = 0; i < n; i++) {
+			pthread_join(td[i], NULL);
+			total += reads[i];
+		}
+		tx = test_sim_transactions() - tx0;
+		test_stats(&st1);
+
+		tps = tx * 1e9 / RUN_NS;
+		printf("%d readers: %8.0f EC tx/s, %8.0f rows/s, "
+		    "%ju coalesced\n", n, tps, total * 1e9 / RUN_NS,
+		    (uintmax_t)(st1.coalesced - st0.coalesced));
+		if (n == 1) {
+			tps1 = tps;
+			CHECK(st1.coalesced == st0.coalesced);
+			CHECK(tx == total);
+		} else {
+			CHECK(st1.coalesced > st0.coalesced);
+			CHECK(total > tx);
+			CHECK(tps < 1.5 * tps1);
+		}
+	}
+
+	/* a callback request leads nobody */
+	CHECK(kh_sysctl_set_int("hw.thinkpad_ec.sim.reply_ns",
+	    REPLY_NS) == 0);
+	test_stats(&st0);
+	tx0 = test_sim_transactions();
+	bzero(&req, sizeof(req));
+	req.args = test_accel_args;
+	req.data.mask = 0xBFFF;
+	req.prio = TP_EC_PRIO_INTERACTIVE;
+	req.done = cb;
+	CHECK(thinkpad_ec_submit(&req) == 0);
+	data.mask = 0xBFFF;
+	CHECK(thinkpad_ec_read_row(&test_accel_args, &data) == 0);
+	while (!cb_done)
+		test_sleep_ns(100000);
+	CHECK(req.error == 0);
+	test_stats(&st1);
+	printf("read behind a callback request: %ju EC tx, %ju coalesced\n",
+	    (uintmax_t)(test_sim_transactions() - tx0),
+	    (uintmax_t)(st1.coalesced - st0.coalesced));
+	CHECK(st1.coalesced == st0.coalesced);
+	CHECK(test_sim_transactions() - tx0 == 2);
+	return 0;
+}
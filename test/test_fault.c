@@ -0,0 +1,113 @@
+/*
+ *  test_fault.c - EC hang detection and recovery
+ *
+ *  The simulated EC goes silent for 50ms every 20th transaction while a
+ *  client reads battery rows back to back for a second. Each hang must be
+ *  detected, recovered from and announced through the thinkpad_ec_reset
+ *  event, and no read may be held off for long. Once the faults stop,
+ *  reads must succeed again. A second run makes the EC report 0x80 in
+ *  TWR15 instead, which is counted but is no hang. Before all that, an EC
+ *  that never answers must fail attach, and attach must work once it does.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "test.h"
+
+#define RUN_NS		1000000000
+#define MAX_GAP_NS	500000000	/* longest time without a good read */
+
+static int resets;
+
+static void reset_event(void *arg)
+{
+	__atomic_add_fetch(&resets, 1, __ATOMIC_RELAXED);
+}
+
+/* Read battery rows for RUN_NS; returns the longest time between two
+ * successful reads.
+ */
+static uint64_t run(int *failed)
+{
+	struct thinkpad_ec_row data;
+	uint64_t start, now, last, gap = 0;
+
+	start = last = test_now_ns();
+	*failed = 0;
+	do {
+		data.mask = 0xFFFF;
+		now = test_now_ns();
+		if (thinkpad_ec_read_row(&test_battery_args, &data) == 0) {
+			CHECK(data.val[0x1] == 0xd0);
+			gap = MAX(gap, now - last);
+			last = now;
+		} else {
+			(*failed)++;
+			test_sleep_ns(1000000);
+		}
+	} while (now - start < RUN_NS);
+	return MAX(gap, now - last);
+}
+
+int main(void)
+{
+	struct thinkpad_ec_stats st0, st1;
+	struct thinkpad_ec_row data;
+	eventhandler_tag tag;
+	uint64_t gap;
+	int failed;
+
+	/* an EC that never answers fails attach, which must unwind */
+	kh_setenv("hw.thinkpad_ec.simulate", 1);
+	CHECK(kh_sysctl_set_int("hw.thinkpad_ec.sim.hang_ms", 10) == 0);
+	CHECK(kh_sysctl_set_int("hw.thinkpad_ec.sim.fault_silent", 1) == 0);
+	CHECK(kh_device_attach("thinkpad_ec") == NULL);
+	CHECK(kh_sysctl_set_int("hw.thinkpad_ec.sim.fault_silent", 0) == 0);
+
+	test_ec_attach();
+	tag = EVENTHANDLER_REGISTER(thinkpad_ec_reset, reset_event, NULL,
+	    EVENTHANDLER_PRI_ANY);
+
+	/* hangs */
+	test_stats(&st0);
+	CHECK(kh_sysctl_set_int("hw.thinkpad_ec.sim.hang_ms", 50) == 0);
+	CHECK(kh_sysctl_set_int("hw.thinkpad_ec.sim.fault_silent", 20) == 0);
+	gap = run(&failed);
+	CHECK(kh_sysctl_set_int("hw.thinkpad_ec.sim.fault_silent", 0) == 0);
+	test_sleep_ns(MAX_GAP_NS);	/* let a recovery in progress finish */
+	data.mask = 0xFFFF;
+	CHECK(thinkpad_ec_read_row(&test_battery_args, &data) == 0);
+	test_stats(&st1);
+
+	printf("hangs: %ju outages, %ju recoveries in %ju attempts, "
+	    "%d resets, %d reads failed, longest gap %ju ms\n",
+	    (uintmax_t)(st1.outages - st0.outages),
+	    (uintmax_t)(st1.recoveries - st0.recoveries),
+	    (uintmax_t)(st1.recovery_attempts - st0.recovery_attempts),
+	    resets, failed, (uintmax_t)(gap / 1000000));
+	CHECK(st1.outages > st0.outages);
+	CHECK(st1.recoveries - st0.recoveries == st1.outages - st0.outages);
+	CHECK(resets == (int)(st1.recoveries - st0.recoveries));
+	CHECK(kh_sysctl_int("hw.thinkpad_ec.state") == 0);
+	CHECK(gap < MAX_GAP_NS);
+
+	/* error replies */
+	st0 = st1;
+	CHECK(kh_sysctl_set_int("hw.thinkpad_ec.sim.fault_err80", 5) == 0);
+	run(&failed);
+	CHECK(kh_sysctl_set_int("hw.thinkpad_ec.sim.fault_err80", 0) == 0);
+	test_stats(&st1);
+
+	printf("0x80 replies: %ju counted, %ju outages, %d reads failed\n",
+	    (uintmax_t)(st1.err_0x80 - st0.err_0x80),
+	    (uintmax_t)(st1.outages - st0.outages), failed);
+	CHECK(st1.err_0x80 > st0.err_0x80);
+	CHECK(st1.outages == st0.outages);
+	CHECK(failed == 0);
+
+	EVENTHANDLER_DEREGISTER(thinkpad_ec_reset, tag);
+	return 0;
+}
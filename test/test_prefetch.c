@@ -0,0 +1,106 @@
+/*
+ *  test_prefetch.c - prefetch hit rate under mixed EC traffic
+ *
+ *  A sampler prefetches the 0x11 accelerometer row every 10ms and picks
+ *  it up with thinkpad_ec_try_read_row() the next period, as hdaps does,
+ *  while another thread reads config (0x17 0x82) and battery (0x01) rows
+ *  every 2ms. Prefetch slots are keyed on the whole argument row, so the
+ *  other rows must not cost the sampler its prefetch. For comparison the
+ *  last run invalidates the prefetches after each of those reads, which
+ *  is what any other transaction used to do to the single prefetched row.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "test.h"
+
+#define PERIOD_NS	10000000	/* sampler */
+#define MIX_NS		2000000		/* other traffic */
+#define SAMPLES		100
+
+enum mix { MIX_NONE, MIX_ROWS, MIX_ROWS_INVALIDATE };
+
+static volatile int mix_mode, mix_stop;
+
+static void *mix_main(void *arg)
+{
+	struct thinkpad_ec_row data;
+	int i;
+
+	for (i = 0; !mix_stop; i++) {
+		if (mix_mode != MIX_NONE) {
+			if (i & 1) {
+				data.mask = 0x801F;
+				CHECK(thinkpad_ec_read_row(&test_config_args,
+				    &data) == 0);
+				CHECK(data.val[0x2] == 100);
+			} else {
+				data.mask = 0xFFFF;
+				CHECK(thinkpad_ec_read_row(&test_battery_args,
+				    &data) == 0);
+				CHECK(data.val[0x1] == 0xd0);
+			}
+			if (mix_mode == MIX_ROWS_INVALIDATE)
+				thinkpad_ec_invalidate();
+		}
+		test_sleep_ns(MIX_NS);
+	}
+	return NULL;
+}
+
+/* Sample for SAMPLES periods; returns the try_read hit rate in percent */
+static int run(int mode, const char *what)
+{
+	struct thinkpad_ec_stats st0, st1;
+	struct thinkpad_ec_row data;
+	uint64_t next;
+	int i, hits = 0;
+
+	mix_mode = mode;
+	test_stats(&st0);
+
+	CHECK(thinkpad_ec_prefetch_row(&test_accel_args) == 0);
+	next = test_now_ns() + PERIOD_NS;
+	for (i = 0; i < SAMPLES; i++) {
+		test_sleep_ns(next - MIN(next, test_now_ns()));
+		next += PERIOD_NS;
+		data.mask = 0xBFFF;
+		if (thinkpad_ec_try_read_row(&test_accel_args, &data) == 0) {
+			CHECK(data.val[0x0] == 0x11);
+			hits++;
+		}
+		thinkpad_ec_prefetch_row(&test_accel_args);
+	}
+
+	test_stats(&st1);
+	printf("%-28s %3d%% hits, %ju evicted, %ju expired\n", what,
+	    hits * 100 / SAMPLES,
+	    (uintmax_t)(st1.prefetch_evicts - st0.prefetch_evicts),
+	    (uintmax_t)(st1.prefetch_expired - st0.prefetch_expired));
+	return hits * 100 / SAMPLES;
+}
+
+int main(void)
+{
+	pthread_t mix;
+	int alone, mixed, junked;
+
+	test_ec_attach();
+	test_accel_on(100);
+	CHECK(pthread_create(&mix, NULL, mix_main, NULL) == 0);
+
+	alone = run(MIX_NONE, "sampler alone:");
+	mixed = run(MIX_ROWS, "with config/battery reads:");
+	junked = run(MIX_ROWS_INVALIDATE, "reads junking the prefetch:");
+
+	mix_stop = 1;
+	pthread_join(mix, NULL);
+
+	CHECK(alone >= 95);
+	CHECK(mixed >= 95);
+	CHECK(junked < mixed);
+	return 0;
+}
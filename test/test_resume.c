@@ -0,0 +1,69 @@
+/*
+ *  test_resume.c - hdaps restores its EC setup on resume
+ *
+ *  Attaches hdaps on the simulated EC, then changes the EC config through
+ *  each of its sysctls and suspends and resumes after each change. Every
+ *  resume must restore the setup just set, without the full
+ *  initialization, and leave the simulated EC running it.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "test.h"
+
+#define REST_X		500		/* sim.x and .y defaults */
+#define REST_Y		480
+
+static device_t dev;
+
+/* Suspend and resume; check it was a fast resume at @rate*@ratio, @order */
+static void cycle(int rate, int ratio, int order)
+{
+	struct thinkpad_ec_row data;
+	uint64_t fast = kh_sysctl_u64("hw.hdaps.pm.fast_resumes");
+	int ec_rate;
+
+	CHECK(kh_device_method(dev, "device_suspend") == 0);
+	CHECK(kh_device_method(dev, "device_resume") == 0);
+	CHECK(kh_sysctl_u64("hw.hdaps.pm.fast_resumes") == fast + 1);
+	CHECK(kh_sysctl_u64("hw.hdaps.pm.full_resumes") == 0);
+
+	data.mask = 0x801F;
+	CHECK(thinkpad_ec_read_row(&test_config_args, &data) == 0);
+	ec_rate = data.val[0x2] | data.val[0x3] << 8;
+	printf("resumed at %d readouts/s, filter order %d\n", ec_rate,
+	    data.val[0x4]);
+	CHECK(ec_rate == rate * ratio);
+	CHECK(data.val[0x4] == order);
+}
+
+int main(void)
+{
+	test_ec_attach();
+	kh_setenv("hw.hdaps.rest_x", REST_X);
+	kh_setenv("hw.hdaps.rest_y", REST_Y);
+	dev = kh_device_attach("hdaps");
+	CHECK(dev != NULL);
+
+	cycle(50, 5, 2);
+	CHECK(kh_sysctl_set_int("hw.hdaps.sampling_rate", 40) == 0);
+	cycle(40, 5, 2);
+	CHECK(kh_sysctl_set_int("hw.hdaps.oversampling_ratio", 4) == 0);
+	cycle(40, 4, 2);
+	CHECK(kh_sysctl_set_int("hw.hdaps.running_avg_filter_order", 3) == 0);
+	cycle(40, 4, 3);
+	CHECK(kh_sysctl_set_int("hw.hdaps.fake_data_mode", 1) == 0);
+	cycle(40, 4, 3);
+	CHECK(kh_sysctl_set_int("hw.hdaps.fake_data_mode", 0) == 0);
+	cycle(40, 4, 3);
+
+	printf("%ju fast resumes, %ju verify failures\n",
+	    (uintmax_t)kh_sysctl_u64("hw.hdaps.pm.fast_resumes"),
+	    (uintmax_t)kh_sysctl_u64("hw.hdaps.pm.verify_failures"));
+	kh_device_detach(dev);
+	CHECK(kh_sysctl_u64("hw.hdaps.pm.verify_failures") == 0);
+	return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ *  test_ring.c - hdaps sample ring under concurrent readers
+ *
+ *  One producer publishes samples as fast as it can, every field of which
+ *  is derived from the sample number, while readers follow the ring as the
+ *  hdaps device readers do, or poll the newest sample as the sysctls do.
+ *  No reader may see a torn sample or go backwards, and every sample a
+ *  follower missed must be counted as an overrun. The ring is small
+ *  against the producer's rate, so overwrites under readers happen often.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "test.h"
+#include "../kmod/hdaps/hdaps.h"
+#include "../kmod/hdaps/hdaps_ring.h"
+
+#define SAMPLES		2000000
+#define FOLLOWERS	4
+#define POLLERS		2
+#define SPIN_NS		100		/* between two samples */
+
+static struct hdaps_ring ring;
+static volatile int done;
+static int started;
+
+struct reader {
+	pthread_t td;
+	uint64_t reads, missed;
+};
+
+static void check_sample(const struct hdaps_sample *s)
+{
+	CHECK(s->seq != 0);
+	CHECK(s->time == (sbintime_t)s->seq << 8);
+	CHECK(s->x == (int)(s->seq * 3));
+	CHECK(s->y == -(int)s->seq);
+	CHECK(s->temp == (int)(s->seq & 0xff));
+	CHECK(s->kmact == (int)(~s->seq & 0x3));
+}
+
+static void *follower_main(void *arg)
+{
+	struct reader *rd = arg;
+	struct hdaps_sample s;
+	u_int cursor = 0, last = 0;
+	int end;
+
+	__atomic_add_fetch(&started, 1, __ATOMIC_RELEASE);
+	do {
+		end = done;
+		while (hdaps_ring_follow(&ring, &cursor, &s) == 0) {
+			check_sample(&s);
+			CHECK(cursor == s.seq);
+			if (last != 0) {
+				CHECK(s.seq > last);
+				rd->missed += s.seq - last - 1;
+			}
+			last = s.seq;
+			rd->reads++;
+		}
+	} while (!end);
+	CHECK(last == SAMPLES);
+	return NULL;
+}
+
+static void *poller_main(void *arg)
+{
+	struct reader *rd = arg;
+	struct hdaps_sample s;
+	u_int last = 0;
+	int end;
+
+	__atomic_add_fetch(&started, 1, __ATOMIC_RELEASE);
+	do {
+		end = done;
+		if (hdaps_ring_newest(&ring, &s) == 0) {
+			check_sample(&s);
+			CHECK(s.seq >= last);
+			last = s.seq;
+			rd->reads++;
+		}
+	} while (!end);
+	CHECK(last == SAMPLES);
+	return NULL;
+}
+
+int main(void)
+{
+	struct reader rd[FOLLOWERS + POLLERS];
+	struct hdaps_sample s;
+	uint64_t missed = 0, t;
+	u_int cursor = 0, seq;
+	int i;
+
+	CHECK(hdaps_ring_newest(&ring, &s) == -ENOENT);
+	CHECK(hdaps_ring_follow(&ring, &cursor, &s) == -EAGAIN);
+
+	bzero(rd, sizeof(rd));
+	for (i = 0; i < FOLLOWERS + POLLERS; i++)
+		CHECK(pthread_create(&rd[i].td, NULL, i < FOLLOWERS ?
+		    follower_main : poller_main, &rd[i]) == 0);
+	while (__atomic_load_n(&started, __ATOMIC_ACQUIRE) <
+	    FOLLOWERS + POLLERS)
+		cpu_spinwait();
+
+	for (seq = 1; seq <= SAMPLES; seq++) {
+		s.time = (sbintime_t)seq << 8;
+		s.x = seq * 3;
+		s.y = -(int)seq;
+		s.temp = seq & 0xff;
+		s.kmact = ~seq & 0x3;
+		hdaps_ring_put(&ring, &s);
+		CHECK(s.seq == seq);
+		for (t = cpu_ticks() + SPIN_NS; cpu_ticks() < t;)
+			cpu_spinwait();
+	}
+	atomic_store_rel_int(&done, 1);
+
+	for (i = 0; i < FOLLOWERS + POLLERS; i++) {
+		pthread_join(rd[i].td, NULL);
+		if (i < FOLLOWERS)
+			missed += rd[i].missed;
+		printf("%s %d: %9ju samples read, %9ju missed\n",
+		    i < FOLLOWERS ? "follower" : "poller  ", i,
+		    (uintmax_t)rd[i].reads, (uintmax_t)rd[i].missed);
+	}
+	printf("%u overruns counted\n", ring.overruns);
+	CHECK(ring.overruns == missed);
+	return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ *  test_sched.c - sampling jitter with other EC clients busy
+ *
+ *  A sampler prefetches the 0x11 row every 10ms and picks it up the next
+ *  period, as hdaps does, for two seconds, first alone and then while
+ *  two threads read battery rows in the background class and one reads
+ *  the config row in the interactive class, back to back. The simulated
+ *  EC takes 0.1ms to answer each transaction, so a background
+ *  read started just before a sample is due would hold the sample up by
+ *  that much; the worker keeps the EC free for it instead. The delay from
+ *  the prefetch to the EC readout (90th percentile, the maximum is up to
+ *  the host's scheduler) must grow by well under one transaction, and the
+ *  other clients must still get served.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "test.h"
+
+#define PERIOD_NS	10000000
+#define SAMPLES		200
+#define REPLY_NS	100000		/* EC time per transaction */
+
+static volatile int stop;
+static int errors;
+
+/* The host may preempt the worker while it waits for the EC, so a read
+ * can time out now and then; that is counted, not fatal.
+ */
+static void *client_main(void *arg)
+{
+	struct thinkpad_ec_row data;
+	int prio = (intptr_t)arg, ret;
+
+	while (!stop) {
+		if (prio == TP_EC_PRIO_BACKGROUND) {
+			data.mask = 0xFFFF;
+			ret = test_read(&test_battery_args, prio, &data);
+		} else {
+			data.mask = 0x801F;
+			ret = test_read(&test_config_args, prio, &data);
+		}
+		if (ret)
+			__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sample for SAMPLES periods; returns the 90th percentile of the delay
+ * from prefetch to readout.
+ */
+static uint64_t run(const char *what)
+{
+	struct thinkpad_ec_row data;
+	sbintime_t taken, asked;
+	uint64_t next, delay[SAMPLES], sum = 0;
+	int i, hits = 0;
+
+	asked = sbinuptime();
+	CHECK(thinkpad_ec_prefetch_row(&test_accel_args) == 0);
+	next = test_now_ns() + PERIOD_NS;
+	for (i = 0; i < SAMPLES; i++) {
+		test_sleep_ns(next - MIN(next, test_now_ns()));
+		next += PERIOD_NS;
+		data.mask = 0xBFFF;
+		if (thinkpad_ec_try_read_row_time(&test_accel_args, &data,
+		    &taken) == 0) {
+			delay[hits] = sbttons(taken - asked);
+			sum += delay[hits++];
+		}
+		asked = sbinuptime();
+		thinkpad_ec_prefetch_row(&test_accel_args);
+	}
+
+	CHECK(hits >= SAMPLES * 95 / 100);
+	qsort(delay, hits, sizeof(delay[0]), cmp_u64);
+	printf("%-22s %3d%% hits, prefetch to readout %4ju us avg, "
+	    "%4ju us 90%%, %4ju us max\n", what, hits * 100 / SAMPLES,
+	    (uintmax_t)(sum / hits / 1000),
+	    (uintmax_t)(delay[hits * 9 / 10] / 1000),
+	    (uintmax_t)(delay[hits - 1] / 1000));
+	return delay[hits * 9 / 10];
+}
+
+int main(void)
+{
+	struct thinkpad_ec_stats st0, st1;
+	pthread_t td[3];
+	uint64_t alone, loaded;
+	int i;
+
+	test_ec_attach();
+	test_accel_on(100);
+	CHECK(kh_sysctl_set_int("hw.thinkpad_ec.sim.reply_ns",
+	    REPLY_NS) == 0);
+
+	alone = run("sampler alone:");
+
+	test_stats(&st0);
+	CHECK(pthread_create(&td[0], NULL, client_main,
+	    (void *)(intptr_t)TP_EC_PRIO_BACKGROUND) == 0);
+	CHECK(pthread_create(&td[1], NULL, client_main,
+	    (void *)(intptr_t)TP_EC_PRIO_BACKGROUND) == 0);
+	CHECK(pthread_create(&td[2], NULL, client_main,
+	    (void *)(intptr_t)TP_EC_PRIO_INTERACTIVE) == 0);
+	loaded = run("with other clients:");
+	stop = 1;
+	for (i = 0; i < 3; i++)
+		pthread_join(td[i], NULL);
+	test_stats(&st1);
+
+	printf("served: %ju background, %ju interactive, %d failed; "
+	    "%ju slot holds; sampling waited at most %ju us\n",
+	    (uintmax_t)(st1.prio[TP_EC_PRIO_BACKGROUND].completed -
+	    st0.prio[TP_EC_PRIO_BACKGROUND].completed),
+	    (uintmax_t)(st1.prio[TP_EC_PRIO_INTERACTIVE].completed -
+	    st0.prio[TP_EC_PRIO_INTERACTIVE].completed), errors,
+	    (uintmax_t)(st1.slot_holds - st0.slot_holds),
+	    (uintmax_t)st1.prio[TP_EC_PRIO_RT].wait_max_ns / 1000);
+
+	CHECK(st1.prio[TP_EC_PRIO_BACKGROUND].completed >
+	    st0.prio[TP_EC_PRIO_BACKGROUND].completed);
+	CHECK(st1.prio[TP_EC_PRIO_INTERACTIVE].completed >
+	    st0.prio[TP_EC_PRIO_INTERACTIVE].completed);
+	CHECK(loaded < alone + REPLY_NS / 2);
+	return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ *  test_smapi.c - battery status against the simulated batteries
+ *
+ *  Attaches smapi on the simulated EC and checks what hw.smapi.bat0 and
+ *  bat1 report for the simulated battery 0 (discharging) and the empty
+ *  second bay, then puts a battery in the second bay and resumes, which
+ *  must pick it up with its design data. Reading the sysctls is served
+ *  from the cache and must not cost any EC transactions.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "test.h"
+
+#define WAIT_NS		2000000000	/* for a refresh to complete */
+
+static void bat_state(int bat, char *buf, size_t len)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "hw.smapi.bat%d.state", bat);
+	CHECK(kh_sysctlbyname(name, buf, &len, NULL, 0) == 0);
+}
+
+static int bat_int(int bat, const char *leaf)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "hw.smapi.bat%d.%s", bat, leaf);
+	return kh_sysctl_int(name);
+}
+
+/* Wait until the cache has been refreshed after @seen refreshes */
+static void wait_refresh(uint64_t seen)
+{
+	uint64_t start = test_now_ns();
+
+	while (kh_sysctl_u64("hw.smapi.refreshes") <= seen) {
+		CHECK(test_now_ns() - start < WAIT_NS);
+		test_sleep_ns(1000000);
+	}
+}
+
+int main(void)
+{
+	device_t dev;
+	char state[32];
+	uint64_t refreshes, tx;
+	int bat, i;
+
+	test_ec_attach();
+	dev = kh_device_attach("smapi");
+	CHECK(dev != NULL);
+	wait_refresh(0);
+
+	bat_state(0, state, sizeof(state));
+	CHECK(strcmp(state, "discharging") == 0);
+	CHECK(bat_int(0, "installed") == 1);
+	CHECK(bat_int(0, "design_capacity") == 52000);
+	CHECK(bat_int(0, "design_voltage") == 10800);
+	CHECK(bat_int(0, "manufacture_date") == 20060825);
+	CHECK(bat_int(0, "cycle_count") == 142);
+	CHECK(bat_int(0, "serial") == 0x1234);
+	CHECK(bat_int(0, "remaining_capacity") <=
+	    bat_int(0, "last_full_capacity"));
+	CHECK(bat_int(0, "age_ms") >= 0);
+
+	bat_state(1, state, sizeof(state));
+	CHECK(strcmp(state, "none") == 0);
+	CHECK(bat_int(1, "installed") == 0);
+
+	CHECK(kh_sysctl_set_int("hw.smapi.refresh_ms", 500) == EINVAL);
+	CHECK(kh_sysctl_set_int("hw.smapi.refresh_ms", 1000) == 0);
+	CHECK(kh_sysctl_int("hw.smapi.refresh_ms") == 1000);
+
+	/* the cache answers without the EC */
+	tx = test_sim_transactions();
+	for (i = 0; i < 1000; i++) {
+		bat = i & 1;
+		bat_state(bat, state, sizeof(state));
+		bat_int(bat, "remaining_percent");
+	}
+	CHECK(test_sim_transactions() == tx);
+
+	/* a second battery shows up after resume */
+	CHECK(kh_sysctl_set_int("hw.thinkpad_ec.sim.bat_mask", 0x3) == 0);
+	refreshes = kh_sysctl_u64("hw.smapi.refreshes");
+	CHECK(kh_device_method(dev, "device_resume") == 0);
+	wait_refresh(refreshes);
+
+	bat_state(1, state, sizeof(state));
+	CHECK(strcmp(state, "idle") == 0);
+	CHECK(bat_int(1, "installed") == 1);
+	CHECK(bat_int(1, "serial") == 0x1235);
+	CHECK(bat_int(1, "cycle_count") == 143);
+
+	printf("bat0 %d%%, %d mWh of %d; bat1 %s; %ju refreshes, "
+	    "%ju errors\n", bat_int(0, "remaining_percent"),
+	    bat_int(0, "remaining_capacity"),
+	    bat_int(0, "last_full_capacity"), state,
+	    (uintmax_t)kh_sysctl_u64("hw.smapi.refreshes"),
+	    (uintmax_t)kh_sysctl_u64("hw.smapi.errors"));
+	CHECK(kh_sysctl_u64("hw.smapi.errors") == 0);
+
+	kh_device_detach(dev);
+	return 0;
+}
@@ -0,0 +1,248 @@
+/*
+ *  test_trace.c - trace ring and replay
+ *
+ *  Records accelerometer, battery and config reads on a slow simulated
+ *  EC, reads the trace back from hw.thinkpad_ec.trace and checks it,
+ *  then loads it into hw.thinkpad_ec.sim.replay on a fast EC and runs
+ *  the recorded commands again: the replies must be the recorded ones,
+ *  with the recorded latencies, and no command may be out of step. A
+ *  second replay with one command changed must count a mismatch.
+ *
+ *  Given a file saved with tpectrace -w, it replays that trace instead and
+ *  reports the replayed latency and port accesses per transaction, so a
+ *  trace from a real machine can be examined on the build host:
+ *	$ ./test_trace trace.bin
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "test.h"
+
+#define ROUNDS		10
+#define REPLY_NS	50000		/* EC time per recorded transaction */
+#define SLOW_NS		250000		/* near the driver's read timeout */
+
+struct trace {
+	struct thinkpad_ec_trace_hdr hdr;
+	struct thinkpad_ec_trace_rec rec[];
+};
+
+static struct trace *trace_get(size_t *lenp)
+{
+	struct trace *t;
+	size_t len;
+
+	CHECK(kh_sysctlbyname("hw.thinkpad_ec.trace", NULL, &len,
+	    NULL, 0) == 0);
+	t = malloc(len, M_TEMP, M_WAITOK);
+	CHECK(kh_sysctlbyname("hw.thinkpad_ec.trace", t, &len, NULL, 0) == 0);
+	CHECK(len == sizeof(t->hdr) + t->hdr.count * sizeof(t->rec[0]));
+	CHECK(t->hdr.magic == TP_EC_TRACE_MAGIC);
+	CHECK(t->hdr.version == TP_EC_TRACE_VERSION);
+	CHECK(t->hdr.rec_size == sizeof(t->rec[0]));
+	*lenp = len;
+	return t;
+}
+
+/* Load @t into the simulator and run its commands again, as they were
+ * recorded; if @change, ask for the other battery in one battery row
+ * past the middle. Returns nonzero if a read failed, which leaves the
+ * replay out of step.
+ */
+static int replay_once(const struct trace *t, size_t len, int change)
+{
+	const struct thinkpad_ec_trace_rec *r;
+	struct thinkpad_ec_row args, data;
+	u_int i, j;
+
+	CHECK(kh_sysctlbyname("hw.thinkpad_ec.sim.replay", NULL, NULL,
+	    t, len) == 0);
+	CHECK(kh_sysctl_int("hw.thinkpad_ec.sim.replay_len") ==
+	    (int)t->hdr.count);
+	for (i = 0; i < t->hdr.count; i++) {
+		r = &t->rec[i];
+		args.mask = r->args_mask;
+		bcopy(r->args, args.val, sizeof(args.val));
+		if (change && i >= t->hdr.count / 2 && (args.mask & 0x8000)) {
+			args.val[0xf] ^= 1;
+			change = 0;
+		}
+		data.mask = r->data_mask;
+		if (thinkpad_ec_read_row(&args, &data) != 0)
+			return 1;
+		for (j = 0; j < TP_CONTROLLER_ROW_LEN; j++)
+			if ((data.mask >> j) & 1)
+				CHECK(data.val[j] == r->data[j]);
+	}
+	CHECK(!change);
+	return 0;
+}
+
+/* The worker may be preempted while it busy-waits for a replayed reply,
+ * so a replay can time out now and then; such a replay is run again.
+ */
+static void replay(const struct trace *t, size_t len, int change)
+{
+	int tries;
+
+	for (tries = 1; replay_once(t, len, change) != 0; tries++)
+		CHECK(tries < 3);
+	CHECK(kh_sysctl_int("hw.thinkpad_ec.sim.replay_pos") ==
+	    (int)t->hdr.count);
+}
+
+/* Replay the trace saved in @path, as tpectrace -w saves it, and report */
+static void replay_file(const char *path)
+{
+	const struct thinkpad_ec_trace_rec *r, *r2;
+	struct thinkpad_ec_row args, data;
+	struct trace *t, *t2;
+	uint64_t rec_ns = 0, rep_ns = 0, port_io = 0;
+	u_int i, j, n, failed = 0, rec_failed = 0, differ = 0;
+	size_t len, len2;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	CHECK(fseek(f, 0, SEEK_END) == 0);
+	len = ftell(f);
+	rewind(f);
+	CHECK(len >= sizeof(t->hdr));
+	t = malloc(len, M_TEMP, M_WAITOK);
+	CHECK(fread(t, 1, len, f) == len);
+	fclose(f);
+	CHECK(t->hdr.magic == TP_EC_TRACE_MAGIC);
+	CHECK(t->hdr.version == TP_EC_TRACE_VERSION);
+	CHECK(t->hdr.rec_size == sizeof(t->rec[0]));
+	CHECK(len == sizeof(t->hdr) + t->hdr.count * sizeof(t->rec[0]));
+	n = t->hdr.count;
+	CHECK(n > 0);
+
+	CHECK(kh_sysctlbyname("hw.thinkpad_ec.sim.replay", NULL, NULL,
+	    t, len) == 0);
+	for (i = 0; i < n; i++) {
+		r = &t->rec[i];
+		args.mask = r->args_mask;
+		bcopy(r->args, args.val, sizeof(args.val));
+		data.mask = r->data_mask;
+		if (r->error)
+			rec_failed++;
+		if (thinkpad_ec_read_row(&args, &data) != 0) {
+			failed++;
+			continue;
+		}
+		for (j = 0; j < TP_CONTROLLER_ROW_LEN; j++)
+			if (((data.mask >> j) & 1) && data.val[j] != r->data[j])
+				break;
+		if (j < TP_CONTROLLER_ROW_LEN)
+			differ++;
+	}
+
+	t2 = trace_get(&len2);
+	CHECK(t2->hdr.count >= n);
+	for (i = 0; i < n; i++) {
+		r = &t->rec[i];
+		r2 = &t2->rec[t2->hdr.count - n + i];
+		rec_ns += r->latency_ns;
+		rep_ns += r2->latency_ns;
+		port_io += r2->port_io;
+	}
+	printf("%s: %u transactions, %u failed (%u when recorded), "
+	    "%u replies differ, %d out of step\n", path, n, failed,
+	    rec_failed, differ,
+	    kh_sysctl_int("hw.thinkpad_ec.sim.replay_mismatch"));
+	printf("latency %ju us recorded, %ju us replayed, %ju port "
+	    "accesses per transaction\n", (uintmax_t)(rec_ns / n / 1000),
+	    (uintmax_t)(rep_ns / n / 1000), (uintmax_t)(port_io / n));
+
+	free(t, M_TEMP);
+	free(t2, M_TEMP);
+}
+
+int main(int argc, char **argv)
+{
+	const struct thinkpad_ec_row *rows[3] = {
+		&test_accel_args, &test_battery_args, &test_config_args
+	};
+	const u_short masks[3] = { 0xBFFF, 0xFFFF, 0x801F };
+	struct thinkpad_ec_row data;
+	struct trace *t, *t2;
+	const struct thinkpad_ec_trace_rec *r, *r2;
+	uint64_t rec_ns = 0, rep_ns = 0;
+	size_t len, len2;
+	u_int i, n;
+
+	test_ec_attach();
+	if (argc > 1) {
+		replay_file(argv[1]);
+		return 0;
+	}
+	test_accel_on(100);
+
+	/* record */
+	CHECK(kh_sysctl_set_int("hw.thinkpad_ec.sim.reply_ns",
+	    REPLY_NS) == 0);
+	for (i = 0; i < 3 * ROUNDS; i++) {
+		data.mask = masks[i % 3];
+		CHECK(thinkpad_ec_read_row(rows[i % 3], &data) == 0);
+	}
+	t = trace_get(&len);
+	n = t->hdr.count;
+	CHECK(n >= 3 * ROUNDS);
+	for (i = 0; i < 3 * ROUNDS; i++) {
+		r = &t->rec[n - 3 * ROUNDS + i];
+		CHECK(r->args[0x0] == rows[i % 3]->val[0x0]);
+		CHECK(r->args_mask == rows[i % 3]->mask);
+		CHECK(r->data_mask == masks[i % 3]);
+		CHECK(r->error == 0);
+		CHECK(r->prio == TP_EC_PRIO_INTERACTIVE);
+		CHECK(r->port_io > 0);
+		CHECK(r->latency_ns >= REPLY_NS);
+		if (i > 0)
+			CHECK(r->seq == r[-1].seq + 1);
+	}
+
+	/* A recorded latency includes the host's scheduling; one the host
+	 * stretched near the read timeout would time out when replayed.
+	 */
+	for (i = 0; i < n; i++)
+		t->rec[i].latency_ns = MIN(t->rec[i].latency_ns, SLOW_NS);
+
+	/* replay on a fast EC */
+	CHECK(kh_sysctl_set_int("hw.thinkpad_ec.sim.reply_ns", 2000) == 0);
+	replay(t, len, 0);
+	CHECK(kh_sysctl_int("hw.thinkpad_ec.sim.replay_mismatch") == 0);
+
+	t2 = trace_get(&len2);
+	CHECK(t2->hdr.count >= 2 * n);
+	for (i = 0; i < n; i++) {
+		r = &t->rec[i];
+		r2 = &t2->rec[t2->hdr.count - n + i];
+		CHECK(r2->args[0x0] == r->args[0x0]);
+		CHECK(r2->latency_ns >= r->latency_ns * 8 / 10);
+		rec_ns += r->latency_ns;
+		rep_ns += r2->latency_ns;
+	}
+	printf("%u transactions replayed, %ju us recorded, %ju us replayed "
+	    "on average\n", n, (uintmax_t)(rec_ns / n / 1000),
+	    (uintmax_t)(rep_ns / n / 1000));
+
+	/* a replay out of step */
+	replay(t, len, 1);
+	CHECK(kh_sysctl_int("hw.thinkpad_ec.sim.replay_mismatch") == 1);
+
+	/* an empty write stops replaying */
+	CHECK(kh_sysctlbyname("hw.thinkpad_ec.sim.replay", NULL, NULL,
+	    "", 0) == 0);
+	CHECK(kh_sysctl_int("hw.thinkpad_ec.sim.replay_len") == 0);
+
+	free(t, M_TEMP);
+	free(t2, M_TEMP);
+	return 0;
+}
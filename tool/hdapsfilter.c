@@ -0,0 +1,109 @@
+/*
+ * Time the hdaps filter chain (kmod/hdaps/hdaps_filter.h) outside the
+ * kernel, on a synthetic accelerometer signal
+ *
+ *	hdapsfilter		time the worst case: all biquad sections
+ *				and all FIR taps
+ *	hdapsfilter -b n -t n	time n sections and n taps
+ *	hdapsfilter -n count	filter count samples (default 1000000)
+ *
+ * compile with
+ *		cc -Wall -O2 -o hdapsfilter hdapsfilter.c
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../kmod/hdaps/hdaps_filter.h"
+
+static uint64_t cycles(void)
+{
+#if defined(__amd64__) || defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+
+	__asm __volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32) | lo;
+#else
+	return 0;
+#endif
+}
+
+static uint64_t nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: hdapsfilter [-b sections] [-t taps] "
+	    "[-n samples]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static struct hdaps_filter f;
+	uint64_t c0, c1, t0, t1;
+	long i, n = 1000000;
+	int ch, x, y, sum = 0;
+
+	f.c.biquads = HDAPS_FILTER_BIQUADS;
+	f.c.taps = HDAPS_FILTER_TAPS;
+	while ((ch = getopt(argc, argv, "b:t:n:")) != -1) {
+		switch (ch) {
+		case 'b':
+			f.c.biquads = atoi(optarg);
+			break;
+		case 't':
+			f.c.taps = atoi(optarg);
+			break;
+		case 'n':
+			n = atol(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || n <= 0 ||
+	    f.c.biquads < 0 || f.c.biquads > HDAPS_FILTER_BIQUADS ||
+	    f.c.taps < 0 || f.c.taps > HDAPS_FILTER_TAPS)
+		usage();
+
+	/* 2nd order low-pass, fc = fs/10, and a moving average */
+	for (i = 0; i < f.c.biquads; i++) {
+		f.c.bq[i][0] = 4127;
+		f.c.bq[i][1] = 8254;
+		f.c.bq[i][2] = 4127;
+		f.c.bq[i][3] = -75514;
+		f.c.bq[i][4] = 26486;
+	}
+	for (i = 0; i < f.c.taps; i++)
+		f.c.fir[i] = 65536 / f.c.taps;
+
+	t0 = nsecs();
+	c0 = cycles();
+	for (i = 0; i < n; i++) {
+		x = 500 + (int)(i % 37) - 18;
+		y = 500 - (int)(i % 23) + 11;
+		hdaps_filter_run(&f, &x, &y);
+		sum += x + y;	/* keep the work */
+	}
+	c1 = cycles();
+	t1 = nsecs();
+
+	printf("%d sections, %d taps: %.1f ns", f.c.biquads, f.c.taps,
+	    (double)(t1 - t0) / n);
+	if (c1 != c0)
+		printf(", %.1f cycles", (double)(c1 - c0) / n);
+	printf(" per sample (checksum %d)\n", sum);
+	return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * Print the client lock profile of thinkpad_ec.ko
+ * (sysctl hw.thinkpad_ec.stats.locks, format in thinkpad_ec.h)
+ *
+ *	tpeclock		print acquisitions, failed tries, waits and
+ *				hold times per call site
+ *	tpeclock -h		also print the wait and hold histograms
+ *	tpeclock -c		clear the profile
+ *
+ * compile with
+ *		cc -Wall -o tpeclock tpeclock.c
+ */
+
+#include <sys/types.h>
+
+#include <sys/sysctl.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../kmod/thinkpad_ec.h"
+
+#define LOCKS_OID	"hw.thinkpad_ec.stats.locks"
+
+/* Rough mean of a log2 histogram, taking 3/4 of each bucket's limit */
+static uint64_t hist_mean(const uint64_t *hist)
+{
+	uint64_t n = 0, sum = 0;
+	int i;
+
+	for (i = 0; i < TP_EC_HIST_BUCKETS; i++) {
+		n += hist[i];
+		if (i > 0)
+			sum += hist[i] * (3ULL << (i - 1)) / 2;
+	}
+	return n ? sum / n : 0;
+}
+
+static void print_hist(const char *name, const uint64_t *hist)
+{
+	int i;
+
+	printf("    %s:", name);
+	for (i = 0; i < TP_EC_HIST_BUCKETS; i++)
+		if (hist[i])
+			printf(" <%juns:%ju", (uintmax_t)1 << i,
+			    (uintmax_t)hist[i]);
+	printf("\n");
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: tpeclock [-h | -c]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct thinkpad_ec_lock_site *sites, *s;
+	size_t len;
+	int ch, hist = 0, clear = 0, zero = 0;
+	unsigned i, n;
+
+	while ((ch = getopt(argc, argv, "hc")) != -1) {
+		switch (ch) {
+		case 'h':
+			hist = 1;
+			break;
+		case 'c':
+			clear = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || hist + clear > 1)
+		usage();
+
+	if (clear) {
+		if (sysctlbyname(LOCKS_OID, NULL, NULL, &zero, sizeof(zero)))
+			err(1, LOCKS_OID);
+		return 0;
+	}
+
+	if (sysctlbyname(LOCKS_OID, NULL, &len, NULL, 0))
+		err(1, LOCKS_OID);
+	if ((sites = malloc(len + 1)) == NULL)
+		err(1, "malloc");
+	if (sysctlbyname(LOCKS_OID, sites, &len, NULL, 0))
+		err(1, LOCKS_OID);
+	n = len / sizeof(*sites);
+
+	printf("%-28s %10s %10s %10s %10s %10s %10s %10s\n", "site",
+	    "acquired", "try_fail", "blocked", "wait_avg", "wait_max",
+	    "hold_avg", "hold_max");
+	for (i = 0; i < n; i++) {
+		s = &sites[i];
+		printf("%-*.*s:%-5u %10ju %10ju %10ju %10ju %10ju %10ju %10ju\n",
+		    22, TP_EC_LOCK_FILE_LEN, s->file, s->line,
+		    (uintmax_t)s->acquired, (uintmax_t)s->try_failed,
+		    (uintmax_t)s->blocked, (uintmax_t)hist_mean(s->wait_ns),
+		    (uintmax_t)s->wait_max_ns, (uintmax_t)hist_mean(s->hold_ns),
+		    (uintmax_t)s->hold_max_ns);
+		if (hist) {
+			print_hist("wait", s->wait_ns);
+			print_hist("hold", s->hold_ns);
+		}
+	}
+	free(sites);
+	return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * Dump, save and replay the EC transaction trace of thinkpad_ec.ko
+ * (sysctl hw.thinkpad_ec.trace, format in thinkpad_ec.h)
+ *
+ *	tpectrace		print the current trace
+ *	tpectrace -w file	save the current trace to file
+ *	tpectrace -f file	print a saved trace
+ *	tpectrace -r file	replay a saved trace on the EC simulator
+ *				(needs hw.thinkpad_ec.simulate=1)
+ *
+ * -r only loads the trace into the running kernel's simulator, which then
+ * answers the driver's commands with the recorded replies and timing.
+ * To replay a trace offline on the build host and get the latency and
+ * port accesses per transaction, use test/test_trace file instead.
+ *
+ * compile with
+ *		cc -Wall -o tpectrace tpectrace.c
+ */
+
+#include <sys/types.h>
+
+#include <sys/sysctl.h>
+
+#include <err.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../kmod/thinkpad_ec.h"
+
+/* Fetch the trace from the kernel */
+static void *trace_fetch(size_t *len)
+{
+	void *buf;
+
+	if (sysctlbyname("hw.thinkpad_ec.trace", NULL, len, NULL, 0))
+		err(1, "hw.thinkpad_ec.trace");
+	if ((buf = malloc(*len)) == NULL)
+		err(1, "malloc");
+	if (sysctlbyname("hw.thinkpad_ec.trace", buf, len, NULL, 0))
+		err(1, "hw.thinkpad_ec.trace");
+	return buf;
+}
+
+static void *trace_load(const char *file, size_t *len)
+{
+	FILE *f;
+	void *buf;
+	long size;
+
+	if ((f = fopen(file, "r")) == NULL)
+		err(1, "%s", file);
+	if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 ||
+	    fseek(f, 0, SEEK_SET))
+		err(1, "%s", file);
+	if ((buf = malloc(size)) == NULL)
+		err(1, "malloc");
+	if (fread(buf, 1, size, f) != (size_t)size)
+		err(1, "%s", file);
+	fclose(f);
+	*len = size;
+	return buf;
+}
+
+static void trace_save(const char *file, const void *buf, size_t len)
+{
+	FILE *f;
+
+	if ((f = fopen(file, "w")) == NULL)
+		err(1, "%s", file);
+	if (fwrite(buf, 1, len, f) != len || fclose(f))
+		err(1, "%s", file);
+}
+
+/* Check the header; returns the number of records */
+static uint32_t trace_check(const void *buf, size_t len)
+{
+	struct thinkpad_ec_trace_hdr hdr;
+
+	if (len < sizeof(hdr))
+		errx(1, "trace too short");
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.magic != TP_EC_TRACE_MAGIC)
+		errx(1, "not an EC trace");
+	if (hdr.version != TP_EC_TRACE_VERSION)
+		errx(1, "trace version %u, expected %u", hdr.version,
+		    TP_EC_TRACE_VERSION);
+	if (hdr.rec_size < offsetof(struct thinkpad_ec_trace_rec, port_io) ||
+	    hdr.count > (len - sizeof(hdr)) / hdr.rec_size)
+		errx(1, "trace truncated");
+	return hdr.count;
+}
+
+static void print_row(uint16_t mask, const uint8_t *val)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		if ((mask >> i) & 1)
+			printf("%02x", val[i]);
+		else
+			printf("..");
+}
+
+static void trace_print(const void *buf, size_t len)
+{
+	const struct thinkpad_ec_trace_hdr *hdr = buf;
+	struct thinkpad_ec_trace_rec r;
+	uint64_t lat_sum = 0, lat_max = 0, io_sum = 0;
+	uint32_t i, n, errors = 0;
+	size_t size;
+
+	n = trace_check(buf, len);
+	size = hdr->rec_size < sizeof(r) ? hdr->rec_size : sizeof(r);
+	printf("%8s %14s %8s p fl rq rd st io %-32s %-32s err\n",
+	    "seq", "time_us", "lat_ns", "args", "data");
+	for (i = 0; i < n; i++) {
+		memset(&r, 0, sizeof(r));
+		memcpy(&r, (const char *)buf + sizeof(*hdr) +
+		    (size_t)i * hdr->rec_size, size);
+		printf("%8ju %14.3f %8ju %u %02x %2u %2u %02x %2u ",
+		    (uintmax_t)r.seq, r.time_ns / 1000.0,
+		    (uintmax_t)r.latency_ns, r.prio, r.flags,
+		    r.request_tries, r.read_tries, r.str3, r.port_io);
+		print_row(r.args_mask, r.args);
+		printf(" ");
+		print_row(r.data_mask, r.data);
+		printf(" %d\n", r.error);
+
+		lat_sum += r.latency_ns;
+		io_sum += r.port_io;
+		if (r.latency_ns > lat_max)
+			lat_max = r.latency_ns;
+		if (r.error)
+			errors++;
+	}
+	if (n > 0)
+		printf("%u transactions, %u failed, latency avg %ju ns "
+		    "max %ju ns, %.1f port accesses each\n", n, errors,
+		    (uintmax_t)(lat_sum / n), (uintmax_t)lat_max,
+		    (double)io_sum / n);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: tpectrace [-w file | -f file | -r file]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *wfile = NULL, *ffile = NULL, *rfile = NULL;
+	void *buf;
+	size_t len;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "w:f:r:")) != -1) {
+		switch (ch) {
+		case 'w':
+			wfile = optarg;
+			break;
+		case 'f':
+			ffile = optarg;
+			break;
+		case 'r':
+			rfile = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || (wfile != NULL) + (ffile != NULL) +
+	    (rfile != NULL) > 1)
+		usage();
+
+	if (rfile != NULL) {
+		buf = trace_load(rfile, &len);
+		printf("replaying %u transactions\n", trace_check(buf, len));
+		if (sysctlbyname("hw.thinkpad_ec.sim.replay", NULL, NULL,
+		    buf, len))
+			err(1, "hw.thinkpad_ec.sim.replay");
+	} else if (ffile != NULL) {
+		buf = trace_load(ffile, &len);
+		trace_print(buf, len);
+	} else {
+		buf = trace_fetch(&len);
+		if (wfile != NULL) {
+			trace_check(buf, len);
+			trace_save(wfile, buf, len);
+		} else
+			trace_print(buf, len);
+	}
+	free(buf);
+	return 0;
+}